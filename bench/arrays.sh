@@ -0,0 +1,8 @@
+#!/bin/sh
+# Time of the bulk array natives on each --simd level.
+# usage: bench/arrays.sh [engine flags...]
+make -s polity || exit 1
+for level in scalar sse2 avx; do
+    echo "== $level"
+    ./polity --no-cache --simd "$level" "$@" bench/arrays.np | grep -v -E '^[0-9]{4} |^ +\||^== code ==$|^max stack depth' | paste - - -
+done
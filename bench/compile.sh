@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compile time of a program split over many imported modules, by thread
+# count. Every run compiles from source. The modules only use locals, so
+# they stay within the 256 constants a linked chunk can hold.
+# usage: bench/compile.sh [modules] [statements per module]
+modules=${1:-64}
+statements=${2:-2000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+: > "$dir/main.np"
+while [ $i -lt "$modules" ]; do
+    awk -v n="$statements" 'BEGIN {
+        print "{";
+        print "    var a = 1; var b = 2; var c = 3;";
+        for (s = 0; s < n; s++)
+            print "    if (a < b) { a = a + b * c - a; } else { b = (b + a) / c; }";
+        print "}";
+    }' > "$dir/m$i.np"
+    echo "import \"m$i.np\";" >> "$dir/main.np"
+    i=$((i + 1))
+done
+echo 'print "linked";' >> "$dir/main.np"
+
+for jobs in 1 2 4 8 $(nproc); do
+    start=$(date +%s%N)
+    ./polity --no-cache -j "$jobs" "$dir/main.np" >/dev/null
+    end=$(date +%s%N)
+    echo "-j $jobs  $(( (end - start) / 1000000 )) ms"
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Differential check of the engines. Every bench/*.np runs on the stack
+# interpreter, --register, -O and --jit, with clock() replaced by 0 so the
+# output is deterministic, and each output must match the interpreter's.
+# --jit runs with --trace-tiers, and at least one script has to tier up:
+# a JIT that never runs would otherwise pass by matching the interpreter.
+# usage: bench/differential.sh [scripts...]
+make -s polity || exit 1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+[ $# -eq 0 ] && set -- bench/*.np
+
+# Standard output without the disassembly, then standard error without
+# the tier trace, kept apart so their writes cannot interleave
+output() {
+    ./polity --no-cache "$@" 2>"$dir/stderr" | grep -v -E '^[0-9]{4} |^ +\||^== code ==$|^max stack depth'
+    grep -v '^\[tier\]' "$dir/stderr"
+}
+
+failed=0
+tiered=0
+for script in "$@"; do
+    name=$(basename "$script")
+    sed 's/clock()/0/g' "$script" > "$dir/$name"
+    output "$dir/$name" > "$dir/expected"
+    for flags in --register -O --jit "-O --jit"; do
+        output $flags --trace-tiers "$dir/$name" > "$dir/actual"
+        if ! cmp -s "$dir/expected" "$dir/actual"; then
+            echo "FAIL $script $flags"
+            diff "$dir/expected" "$dir/actual" | head -10
+            failed=1
+        fi
+    done
+    if ./polity --no-cache --jit --trace-tiers "$dir/$name" 2>&1 >/dev/null | grep -q 'entering JIT'; then
+        tiered=$((tiered + 1))
+        echo "ok   $script (tiered up)"
+    else
+        echo "ok   $script"
+    fi
+done
+
+if [ "$tiered" -eq 0 ]; then
+    echo "FAIL no script tiered up into the JIT"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,84 @@
+/* Context-switch cost and memory per fiber, through the embedding API.
+ * Every fiber counts to a number in a local, yielding after each step,
+ * and the host resumes them round-robin until all are done.
+ * usage: bench/fibers.sh [fibers] [yields per fiber] [stack|register|jit] */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "polity.h"
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void discard(void* user_data, const char* text, size_t length)
+{
+}
+
+int main(int argc, char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 10000;
+    int yields = argc > 2 ? atoi(argv[2]) : 100;
+    polity_options options = {POLITY_ENGINE_STACK};
+    if (argc > 3 && strcmp(argv[3], "register") == 0)
+        options.engine = POLITY_ENGINE_REGISTER;
+    if (argc > 3 && strcmp(argv[3], "jit") == 0)
+        options.engine = POLITY_ENGINE_JIT;
+
+    char source[256];
+    snprintf(source, sizeof(source), "{ var i = 0; while (i < %d) { i = i + 1; yield; } }", yields);
+    polity_io quiet = {discard, NULL, NULL};
+    polity_vm* vm = polity_new(&options);
+    polity_program* program = polity_compile(vm, source, NULL, &quiet);
+
+    /* The same loop without yield, to subtract the work between switches */
+    snprintf(source, sizeof(source), "{ var i = 0; while (i < %d) { i = i + 1; } }", yields);
+    polity_program* baseline = polity_compile(vm, source, NULL, &quiet);
+
+    /* Memory is measured once every fiber is parked at its first yield */
+    double start = now();
+    long long switches = 0;
+    size_t before = mallinfo2().uordblks;
+    polity_fiber** fibers = (polity_fiber**)malloc(sizeof(polity_fiber*) * count);
+    for (int i = 0; i < count; i++) {
+        fibers[i] = polity_fiber_new(vm, program);
+        polity_fiber_resume(vm, fibers[i], NULL);
+        switches++;
+    }
+    size_t after = mallinfo2().uordblks;
+
+    for (int live = count; live > 0;) {
+        live = 0;
+        for (int i = 0; i < count; i++) {
+            if (polity_fiber_resume(vm, fibers[i], NULL) == POLITY_YIELD)
+                live++;
+            switches++;
+        }
+    }
+    double elapsed = now() - start;
+
+    start = now();
+    for (int i = 0; i < count; i++)
+        polity_run(vm, baseline, NULL);
+    double work = now() - start;
+
+    printf("fibers            %d\n", count);
+    printf("resumes           %lld\n", switches);
+    printf("memory per fiber  %zu bytes\n", (after - before) / count);
+    printf("resume + yield    %.1f ns\n", (elapsed - work) * 1e9 / switches);
+    printf("total             %.3f s (loop alone %.3f s)\n", elapsed, work);
+
+    for (int i = 0; i < count; i++)
+        polity_fiber_free(vm, fibers[i]);
+    free(fibers);
+    polity_free_program(vm, baseline);
+    polity_free_program(vm, program);
+    polity_free(vm);
+    return 0;
+}
@@ -0,0 +1,8 @@
+#!/bin/sh
+# Build bench/fibers.c against libpolity.a and run it.
+# usage: bench/fibers.sh [fibers] [yields per fiber] [stack|register|jit]
+make -s libpolity.a || exit 1
+binary=$(mktemp)
+trap 'rm -f "$binary"' EXIT
+cc -O2 -Iinclude bench/fibers.c libpolity.a -pthread -o "$binary" || exit 1
+"$binary" "$@" | grep -v -E '^[0-9]{4} |^== code ==$|^max stack depth'
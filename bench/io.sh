@@ -0,0 +1,37 @@
+#!/bin/sh
+# Line throughput of the file natives on each I/O backend: a script copies
+# a generated file to another a line at a time. Blocking is the baseline,
+# reading and writing each block only when the script reaches it.
+# usage: bench/io.sh [lines] [engine flags...]
+lines=${1:-1000000}
+[ $# -gt 0 ] && shift
+make -s polity || exit 1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$lines" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "%d,customer %d,%s\n", i, i % 977, substr("lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor", 1 + i % 40);
+}' > "$dir/input.txt"
+cat > "$dir/copy.np" <<EOF
+var input = open_read("$dir/input.txt");
+var output = open_write("$dir/output.txt");
+var line = read_line(input);
+while (line != nil) {
+    write_line(output, line);
+    line = read_line(input);
+}
+close(input);
+close(output);
+EOF
+bytes=$(wc -c < "$dir/input.txt")
+
+for backend in blocking threads uring; do
+    rm -f "$dir/output.txt"
+    start=$(date +%s%N)
+    ./polity --no-cache --io "$backend" "$@" "$dir/copy.np" >/dev/null
+    end=$(date +%s%N)
+    cmp -s "$dir/input.txt" "$dir/output.txt" || echo "$backend: output differs"
+    ms=$(( (end - start) / 1000000 ))
+    echo "$backend  $ms ms  $(( bytes / 1000 / (ms > 0 ? ms : 1) )) MB/s  $(( lines * 1000 / (ms > 0 ? ms : 1) )) lines/s"
+done
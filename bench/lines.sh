@@ -0,0 +1,33 @@
+#!/bin/sh
+# Throughput and peak memory of polity -n counting lines and keeping the
+# last one, next to awk doing the same. Peak memory should not move with
+# the number of lines.
+# usage: bench/lines.sh [lines] [engine flags...]
+lines=${1:-2000000}
+[ $# -gt 0 ] && shift
+make -s polity || exit 1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$lines" 'BEGIN { for (i = 0; i < n; i++) printf "%d,customer %d,lorem ipsum dolor\n", i, i % 977 }' > "$dir/input.txt"
+cat > "$dir/last.np" <<'EOF'
+var count = 0;
+var last = nil;
+if (line != nil) {
+    count = count + 1;
+    last = line;
+} else {
+    print count;
+    print last;
+}
+EOF
+
+start=$(date +%s%N)
+./polity --no-cache --memory-stats -n "$@" "$dir/last.np" < "$dir/input.txt" 2>"$dir/stats" | tail -2
+end=$(date +%s%N)
+echo "polity -n  $(( (end - start) / 1000000 )) ms  peak $(awk '$1 == "total" { print $5 }' "$dir/stats") bytes"
+
+start=$(date +%s%N)
+awk '{ count++; last = $0 } END { print count; print last }' < "$dir/input.txt"
+end=$(date +%s%N)
+echo "awk        $(( (end - start) / 1000000 )) ms"
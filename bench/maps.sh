@@ -0,0 +1,41 @@
+#!/bin/sh
+# Map throughput: number keys from bench/maps.np, then a million distinct
+# string keys counted under -n, next to awk's associative arrays.
+# usage: bench/maps.sh [lines] [engine flags...]
+lines=${1:-1000000}
+[ $# -gt 0 ] && shift
+make -s polity || exit 1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+echo "== number keys"
+./polity --no-cache "$@" bench/maps.np | grep -v -E '^[0-9]{4} |^ +\||^== code ==$|^max stack depth' | paste - - -
+
+awk -v n="$lines" 'BEGIN { for (i = 0; i < n; i++) printf "customer %d\n", (i * 7919) % n }' > "$dir/input.txt"
+cat > "$dir/count.np" <<'NP'
+var seen = {};
+if (line != nil) {
+    var count = seen[line];
+    if (count == nil) seen[line] = 1; else seen[line] = count + 1;
+} else {
+    var hits = 0;
+    var key = next(seen, nil);
+    while (key != nil) {
+        hits = hits + seen[key];
+        key = next(seen, key);
+    }
+    print len(seen);
+    print hits;
+}
+NP
+
+echo "== string keys"
+start=$(date +%s%N)
+./polity --no-cache --memory-stats -n "$@" "$dir/count.np" < "$dir/input.txt" 2>"$dir/stats" | tail -2 | paste - -
+end=$(date +%s%N)
+echo "polity -n  $(( (end - start) / 1000000 )) ms  maps peak $(awk '$1 == "maps" { print $5 }' "$dir/stats") bytes"
+
+start=$(date +%s%N)
+awk '{ seen[$0]++ } END { for (key in seen) hits += seen[key]; print length(seen); print hits }' < "$dir/input.txt" | paste - -
+end=$(date +%s%N)
+echo "awk        $(( (end - start) / 1000000 )) ms"
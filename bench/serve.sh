@@ -0,0 +1,26 @@
+#!/bin/sh
+# Per-request latency of cold runs against a warm --serve daemon.
+# usage: bench/serve.sh [runs] [script.np]
+runs=${1:-200}
+script=${2:-bench/startup.np}
+socket=/tmp/polity-bench.$$.sock
+
+./polity --serve "$socket" >/dev/null 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT
+while [ ! -S "$socket" ]; do sleep 0.01; done
+
+time_runs() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$@" >/dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo "$(( (end - start) / runs / 1000 )) us/run"
+}
+
+printf "cold  (--no-cache)  "; time_runs ./polity --no-cache "$script"
+printf "cold  (.npc cache)  "; time_runs ./polity "$script"
+printf "warm  (--client)    "; time_runs ./polity --client "$socket" "$script"
@@ -8,30 +8,46 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #define DEBUG
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #define AS_BOOL(val)      ((val).as.boolean)
 #define AS_NUMBER(val)    ((val).as.number)
+#define AS_INT(val)       ((val).as.integer)
 #define AS_OBJ(val)       ((val).as.obj)
 #define AS_STRING(val)    ((obj_string*)AS_OBJ(val))
 #define AS_CSTRING(val)   (((obj_string*)AS_OBJ(val))->chars)
 #define AS_FUNCTION(val)  ((obj_function*)AS_OBJ(val))
+#define AS_NATIVE(val)    ((obj_native*)AS_OBJ(val))
+#define AS_ARRAY(val)     ((obj_array*)AS_OBJ(val))
+#define AS_NUMBER_ARRAY(val) ((obj_number_array*)AS_OBJ(val))
+#define AS_MAP(val)       ((obj_map*)AS_OBJ(val))
 
 #define IS_BOOL(val)      ((val).type == VAL_BOOL)
 #define IS_NIL(val)       ((val).type == VAL_NIL)
 #define IS_NUMBER(val)    ((val).type == VAL_NUMBER)
+#define IS_INT(val)       ((val).type == VAL_INT)
+#define IS_NUMERIC(val)   (IS_NUMBER(val) || IS_INT(val))
 #define IS_OBJ(val)       ((val).type == VAL_OBJ)
-#define IS_STRING(val)    IS_OBJ(val) && AS_OBJ(val)->type == OBJ_STRING
+#define IS_STRING(val)    (IS_OBJ(val) && AS_OBJ(val)->type == OBJ_STRING)
 #define IS_FUNCTION(val)  IS_OBJ(val) && AS_OBJ(val)->type == OBJ_FUNCTION
+#define IS_NATIVE(val)    (IS_OBJ(val) && AS_OBJ(val)->type == OBJ_NATIVE)
+#define IS_ARRAY(val)     (IS_OBJ(val) && AS_OBJ(val)->type == OBJ_ARRAY)
+#define IS_NUMBER_ARRAY(val) (IS_OBJ(val) && AS_OBJ(val)->type == OBJ_NUMBER_ARRAY)
+#define IS_MAP(val)       (IS_OBJ(val) && AS_OBJ(val)->type == OBJ_MAP)
 
 #define BOOL_VAL(val)     ((value){VAL_BOOL, {.boolean = val}})
 #define NIL_VAL             ((value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(val)   ((value){VAL_NUMBER, {.number = val}})
+#define INT_VAL(val)      ((value){VAL_INT, {.integer = val}})
 #define OBJ_VAL(object)     ((value){VAL_OBJ, {.obj = (struct obj*)object}})
 #define OBJ_TYPE(val)     (AS_OBJ(val)->type)
 
+/* Either kind of number as a double */
+#define TO_NUMBER(val)    (IS_INT(val) ? (double)AS_INT(val) : AS_NUMBER(val))
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_SCRIPT
@@ -41,7 +57,8 @@ typedef enum {
     /* Single-character tokens */
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-    TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+    TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
     /* One or two character tokens */
     TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -51,10 +68,10 @@ typedef enum {
     /* Literals */
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
     /* Keywords */
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+    TOKEN_AND, TOKEN_CLASS, TOKEN_DELETE, TOKEN_ELSE, TOKEN_FALSE,
+    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR,
     TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-    TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
     TOKEN_ERROR,
     TOKEN_EOF
 } token_type;
@@ -83,9 +100,78 @@ typedef enum {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_CALL,
+    OP_ARRAY,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    OP_MAP,
+    OP_DELETE_INDEX,
+    OP_YIELD,
     OP_RETURN,
+    /* Specialized forms the VM rewrites generic instructions into */
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    OP_GREATER_INT,
+    OP_LESS_INT,
 } op_code;
 
+/* Register instructions: a is the destination, b and c are register or
+ * constant operands (see RK_CONSTANT). */
+typedef enum {
+    REG_MOVE,
+    REG_GET_GLOBAL,
+    REG_DEFINE_GLOBAL,
+    REG_SET_GLOBAL,
+    REG_EQUAL,
+    REG_GREATER,
+    REG_LESS,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_NOT,
+    REG_NEGATE,
+    REG_PRINT,
+    REG_JUMP,
+    REG_JUMP_IF_FALSE,
+    REG_LOOP,
+    REG_CALL,
+    REG_ARRAY, /* a = [a .. a+b-1] */
+    REG_GET_INDEX,
+    REG_SET_INDEX, /* a[a+1] = a+2, leaving the value in a */
+    REG_MAP, /* a = {a: a+1, ...}, b pairs */
+    REG_DELETE_INDEX,
+    REG_YIELD,
+    REG_RETURN,
+} reg_op_code;
+
+typedef enum {
+    ENGINE_STACK,
+    ENGINE_REGISTER,
+    ENGINE_JIT
+} execution_engine;
+
+typedef enum {
+    IO_URING, /* falls back to IO_THREADS where the kernel refuses */
+    IO_THREADS,
+    IO_BLOCKING
+} io_backend;
+
+typedef enum {
+    SIMD_AUTO, /* the widest the CPU has */
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX
+} simd_level;
+
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT, // =
@@ -103,18 +189,24 @@ typedef enum {
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD /* out of fuel; resume_chunk() carries on */
 } interpret_result;
 
 typedef enum {
     OBJ_FUNCTION,
+    OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_ARRAY,
+    OBJ_NUMBER_ARRAY,
+    OBJ_MAP,
 } obj_type;
 
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER,
+    VAL_NUMBER, /* double */
+    VAL_INT,    /* 64-bit integer; overflowing arithmetic yields a double */
     VAL_OBJ
 } value_type;
 
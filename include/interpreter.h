@@ -3,9 +3,13 @@
 
 #include "common.h"
 
-#define STACK_MAX 256
+#define STACK_INITIAL 64
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define TABLE_MAX_LOAD 0.75
+#define RK_CONSTANT 0x8000 /* set on register operands that name a constant */
+#define HOT_LOOP 1000 /* back edges before --jit compiles a loop */
+#define POLITY_VERSION "0.5"
+#define NPC_FORMAT 5 /* bump whenever the bytecode or .npc layout changes */
 
 typedef struct {
     char* start;
@@ -25,6 +29,7 @@ typedef struct {
     token previous;
     bool had_error;
     bool panic_mode;
+    FILE* err; /* where compile errors are reported */
 } parser;
 
 typedef struct {
@@ -34,6 +39,7 @@ typedef struct {
 
 struct obj {
     obj_type type;
+    bool marked; /* reachable, while free_unreachable() runs */
     struct obj* next;
 };
 
@@ -42,6 +48,7 @@ typedef struct {
     int length;
     char* chars;
     uint32_t hash;
+    bool borrowed; /* chars lie in a buffer the string does not own, and it is not interned */
 } obj_string;
 
 typedef struct {
@@ -49,6 +56,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         struct obj* obj;
     } as;
 } value;
@@ -59,12 +67,26 @@ typedef struct {
     value* values;
 } value_array;
 
+/* Remembers where a global lived the last time an instruction looked it up.
+ * Valid while version matches the globals table's version. */
+typedef struct {
+    uint32_t version;
+    int index;
+} global_cache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     value_array constants;
+    int max_stack; /* deepest operand stack the code can reach */
+    int cache_count;
+    global_cache* caches; /* one per global access instruction */
+    uint32_t* back_edges; /* OP_LOOP executions per loop header, for tiering */
+    struct jit_code* jit; /* machine code once a loop got hot */
+    void* image; /* mapping code and lines live in, for chunks run from a .npi */
+    size_t image_size;
 } chunk;
 
 typedef struct {
@@ -74,12 +96,98 @@ typedef struct {
     obj_string* name;
 } obj_function;
 
+typedef struct {
+    uint16_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} reg_instruction;
+
+/* A chunk translated for the register engine. Registers are the slots of
+ * the VM stack, so locals keep the numbers the compiler gave them. */
+typedef struct {
+    int count;
+    int capacity;
+    reg_instruction* code;
+    int* origins; /* offset of the stack instruction each one came from */
+    value_array constants; /* the chunk's constants, then nil, true, false */
+} reg_chunk;
+
+typedef enum {
+    JIT_DONE,  /* reached OP_RETURN */
+    JIT_ERROR, /* a runtime error was reported */
+    JIT_EXIT,  /* left compiled code; run() resumes at vm->ip */
+    JIT_DEOPT  /* as JIT_EXIT, after a speculation failed; recompile later */
+} jit_status;
+
+/* Machine code for a chunk. entries maps each jump target's bytecode
+ * offset to its position in memory, -1 for every other offset. */
+typedef struct jit_code {
+    uint8_t* memory;
+    size_t size;
+    int* entries;
+} jit_code;
+
+typedef struct {
+    uint64_t executed[UINT8_COUNT];
+    uint64_t deopts[UINT8_COUNT];
+} profile_stats;
+
+struct VM;
+
+/* Host functions receive their arguments as a pointer into the VM stack and
+ * store their return value in result. Returning false signals a runtime error
+ * that was already reported through native_error(). */
+typedef bool (*native_fn)(struct VM* vm, int arg_count, value* args, value* result);
+
+typedef struct {
+    struct obj obj;
+    int arity; /* -1 accepts any number of arguments */
+    native_fn function;
+    obj_string* name;
+} obj_native;
+
+typedef struct {
+    struct obj obj;
+    int count;
+    int capacity;
+    value* values;
+} obj_array;
+
+/* An array of numbers kept as raw doubles, for the bulk natives */
+typedef struct {
+    struct obj obj;
+    int count;
+    int capacity;
+    double* numbers;
+} obj_number_array;
+
+typedef struct {
+    value key; /* nil once deleted */
+    value value;
+    uint32_t hash;
+} map_entry;
+
+/* A hash map over number and string keys that keeps insertion order */
+typedef struct {
+    struct obj obj;
+    int count; /* live entries */
+    int used; /* entries taken, deleted ones included */
+    int capacity;
+    map_entry* entries;
+    int32_t* slots; /* positions in entries, or MAP_EMPTY or MAP_TOMBSTONE */
+    int slot_count;
+} obj_map;
+
 typedef struct {
     obj_function* function;
     function_type type;
     local locals[UINT8_COUNT];
     int local_count;
     int scope_depth;
+    int stack_depth; /* operand stack depth after the last emitted byte */
+    int operand_bytes; /* operand bytes still owed by the last opcode */
+    uint8_t last_op;
 } compiler;
 
 typedef struct {
@@ -91,18 +199,81 @@ typedef struct {
     int count;
     int capacity;
     entry* entries;
+    uint32_t version; /* bumped whenever existing entries move or vanish */
 } table;
 
+typedef enum {
+    MEMORY_STRINGS, /* string objects and their characters */
+    MEMORY_TABLES,  /* hash table entries: globals, interned strings, builtins */
+    MEMORY_CHUNKS,  /* bytecode, line numbers, constants and global caches */
+    MEMORY_ARRAYS,  /* array objects and their elements */
+    MEMORY_MAPS,    /* map objects, their entries and slots */
+    MEMORY_STACKS,  /* value stacks of the VM and its fibers */
+    MEMORY_FILES,   /* file streams, their blocks and line buffers */
+    MEMORY_CATEGORY_COUNT
+} memory_category;
+
+/* Bytes a VM holds through reallocate(), by category */
 typedef struct {
+    size_t current[MEMORY_CATEGORY_COUNT];
+    size_t peak[MEMORY_CATEGORY_COUNT];
+    size_t allocations[MEMORY_CATEGORY_COUNT]; /* blocks allocated, not counting resizes */
+    size_t total;
+    size_t peak_total;
+    size_t limit; /* running scripts may not grow total past this, 0 for no limit */
+} memory_stats;
+
+#define ALLOCATE(vm, category, type, count) \
+    (type*)reallocate(vm, category, NULL, 0, sizeof(type) * (count))
+#define GROW_ARRAY(vm, category, type, pointer, old_count, new_count) \
+    (type*)reallocate(vm, category, pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define FREE_ARRAY(vm, category, type, pointer, count) \
+    reallocate(vm, category, pointer, sizeof(type) * (count), 0)
+#define FREE(vm, category, type, pointer) FREE_ARRAY(vm, category, type, pointer, 1)
+
+typedef struct VM {
     chunk* chunk;
     uint8_t* ip; /* instruction pointer */
-    value stack[STACK_MAX];
+    value* stack;
     value* stack_top;
+    int stack_capacity;
     table globals;
     table strings;
     struct obj* objects;
+    profile_stats* profile; /* NULL unless --profile was given */
+    execution_engine engine;
+    bool trace_tiers; /* log tier-ups and side exits to stderr */
+    bool optimize; /* run the -O pipeline on compiled chunks */
+    int jobs; /* threads for --batch and module compilation, 0 for one per CPU */
+    FILE* out; /* print statements and the disassembly */
+    FILE* err; /* runtime errors and tier traces */
+    int64_t budget; /* back edges and calls per run or resume, 0 for no limit */
+    int64_t fuel; /* left before the running chunk yields */
+    reg_chunk* suspended; /* register code of a yielded run, NULL otherwise */
+    int suspended_at; /* the instruction it yielded before */
+    memory_stats memory;
+    io_backend io_backend; /* how file natives reach the disk */
+    struct io_context* io; /* open files, NULL until the first is opened */
+    bool keep_globals; /* var leaves a global that exists alone, under -n */
+    simd_level simd; /* kernels the bulk array natives use */
+    value* remembered; /* objects stored in arrays since the last free_unreachable(), under -n */
+    int remembered_count;
+    int remembered_capacity;
 } VM;
 
+/* A run of a chunk with its own value stack, parked while it is not on
+ * the VM. The fields are those of VM that belong to a single run. */
+typedef struct {
+    chunk* chunk;
+    uint8_t* ip;
+    value* stack;
+    value* stack_top;
+    int stack_capacity;
+    reg_chunk* suspended;
+    int suspended_at;
+    interpret_result status; /* INTERPRET_YIELD until it finishes */
+} fiber;
+
 typedef struct {
 	VM* vm;
     chunk* chunk;
@@ -110,10 +281,18 @@ typedef struct {
     compiler* compiler;
     parser* parser;
     bool can_assign;
+    const char* path; /* script being compiled, NULL for the working directory */
+    char** imports; /* module paths named by import statements, as written */
+    int import_count;
+    bool module; /* compiling an imported module; its caller links it */
+    bool line_mode; /* -n: run the script once per line of standard input */
 } polity_interpreter;
 
 typedef void (*parse_fn)(polity_interpreter* interpreter);
 
+extern const int8_t stack_effect[UINT8_COUNT];
+extern const uint8_t operand_length[UINT8_COUNT];
+
 typedef struct {
     parse_fn prefix;
     parse_fn infix;
@@ -122,21 +301,88 @@ typedef struct {
 
 VM* init_vm();
 void free_vm();
+void reset_vm(VM* vm, struct obj* mark, table* builtins);
+size_t free_unreachable(VM* vm, struct obj* mark);
+interpret_result run_chunk(VM* vm, chunk* chunk);
+interpret_result resume_chunk(VM* vm);
+interpret_result run_translated(VM* vm, chunk* chunk, reg_chunk* code);
+void init_fiber(VM* vm, fiber* fiber, chunk* chunk);
+interpret_result resume_fiber(VM* vm, fiber* fiber);
+void free_fiber(VM* vm, fiber* fiber);
 interpret_result interpret(polity_interpreter* interpreter, char* source);
-void disassemble_chunk(chunk* chunk, const char* name);
-int disassemble_instruction(chunk* chunk, int offset);
+void disassemble_chunk(FILE* out, chunk* chunk, const char* name);
+int disassemble_instruction(FILE* out, chunk* chunk, int offset);
 scanner* init_scanner(char* source);
 token scan_token(scanner* s);
 bool compile(char* source, polity_interpreter* interpreter);
 obj_string* allocate_string(VM* vm, char* chars, int length, uint32_t hash);
 uint32_t hash_string(const char* key, int length);
 bool table_get(table* table, obj_string* key, value* value);
-bool table_set(table* table, obj_string* key, value value);
+entry* table_lookup(table* table, obj_string* key);
+bool table_set(VM* vm, table* table, obj_string* key, value value);
+void free_table(VM* vm, table* table);
 bool table_delete(table* table, obj_string* key);
+void define_global(VM* vm, obj_string* name, value value);
 obj_string* table_find_string(table* table, const char* chars, int length, uint32_t hash);
-void write_chunk(chunk* chunk, uint8_t byte, int line);
-void free_chunk(chunk* chunk);
-int add_constant(chunk* chunk, value value);
+void write_chunk(VM* vm, chunk* chunk, uint8_t byte, int line);
+void free_chunk(VM* vm, chunk* chunk);
+int add_constant(VM* vm, chunk* chunk, value value);
 obj_function* new_function();
+obj_string* copy_string(VM* vm, const char* chars, int length);
+obj_string* borrow_string(VM* vm, char* chars, int length);
+void define_native(VM* vm, const char* name, int arity, native_fn function);
+void native_error(VM* vm, const char* format, ...);
+void define_builtins(VM* vm);
+void print_profile(VM* vm);
+bool ensure_stack(VM* vm, int needed);
+interpret_result runtime_error(VM* vm, const char* format, ...);
+interpret_result out_of_memory(VM* vm);
+bool values_equal(value a, value b);
+value number_arithmetic(uint8_t op, value a, value b);
+bool number_less(value a, value b);
+value number_negate(value a);
+void print_value(FILE* out, value val);
+obj_string* concatenate_strings(VM* vm, obj_string* a, obj_string* b);
+reg_chunk* compile_registers(chunk* chunk);
+void free_reg_chunk(reg_chunk* code);
+void disassemble_registers(FILE* out, reg_chunk* code, const char* name);
+interpret_result run_registers(VM* vm, reg_chunk* code, int start);
+jit_code* jit_compile(chunk* chunk);
+jit_status jit_run(VM* vm, jit_code* code, int offset);
+void free_jit_code(jit_code* code);
+void optimize_chunk(VM* vm, chunk* chunk);
+chunk* load_cached_chunk(VM* vm, const char* path, const char* source, bool optimized);
+void save_cached_chunk(chunk* chunk, const char* path, const char* source, bool optimized);
+interpret_result interpret_cached(polity_interpreter* interpreter, char* source, const char* cache_path);
+bool save_image(chunk* chunk, const char* path);
+chunk* load_image(VM* vm, const char* path);
+void free_image(chunk* chunk);
+interpret_result compile_image(polity_interpreter* interpreter, char* source, const char* image_path);
+interpret_result interpret_image(polity_interpreter* interpreter, const char* image_path);
+char* read_file(const char* path);
+int serve(polity_interpreter* interpreter, const char* socket_path);
+int run_client(const char* socket_path, const char* script_path);
+int run_batch(VM* settings, const char* directory, int jobs, bool use_cache);
+bool link_imports(polity_interpreter* interpreter);
+void* reallocate(VM* vm, memory_category category, void* pointer, size_t old_size, size_t new_size);
+bool memory_available(VM* vm, size_t size);
+void print_memory(VM* vm);
+void define_file_natives(VM* vm);
+void close_files(VM* vm);
+void free_io(VM* vm);
+interpret_result run_lines(VM* vm, chunk* chunk, int fd);
+bool make_array(VM* vm, value* items, int count, value* result);
+bool get_index(VM* vm, value container, value index, value* result);
+bool set_index(VM* vm, value container, value index, value val);
+void print_array(FILE* out, struct obj* array);
+void remember_value(VM* vm, value val);
+void forget_writes(VM* vm);
+void define_array_natives(VM* vm);
+bool make_map(VM* vm, value* items, int pair_count, value* result);
+bool map_get(VM* vm, obj_map* map, value key, value* result);
+bool map_set(VM* vm, obj_map* map, value key, value val);
+bool delete_index(VM* vm, value container, value key, value* result);
+void print_map(FILE* out, struct obj* map);
+void define_map_natives(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+#ifndef polity_h
+#define polity_h
+
+/* Embedding interface. A polity_vm compiles scripts into programs that can
+ * run any number of times, and resets between runs without giving back
+ * its interned strings or table storage.
+ *
+ *     polity_vm* vm = polity_new(NULL);
+ *     polity_program* program = polity_compile(vm, "print 1 + 2;", NULL, NULL);
+ *     for (...) {
+ *         polity_run(vm, program, &io);
+ *         polity_reset(vm);
+ *     }
+ *     polity_free_program(vm, program);
+ *     polity_free(vm);
+ *
+ * A VM and its programs belong to one thread at a time. Separate VMs may
+ * run on separate threads. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct polity_vm polity_vm;
+typedef struct polity_program polity_program;
+typedef struct polity_fiber polity_fiber;
+
+typedef enum {
+    POLITY_OK,
+    POLITY_COMPILE_ERROR,
+    POLITY_RUNTIME_ERROR,
+    POLITY_YIELD /* the run spent its fuel; polity_resume() continues it */
+} polity_status;
+
+typedef enum {
+    POLITY_ENGINE_STACK,
+    POLITY_ENGINE_REGISTER,
+    POLITY_ENGINE_JIT
+} polity_engine;
+
+typedef struct {
+    polity_engine engine;
+    bool optimize; /* as -O */
+    int jobs; /* threads compiling imported modules, 0 for one per CPU */
+    long long fuel; /* loop iterations and calls per run or resume, 0 for no limit */
+    size_t memory_limit; /* bytes a run may grow the VM to, 0 for no limit */
+} polity_options;
+
+typedef struct {
+    size_t current;
+    size_t peak;
+    size_t allocations; /* blocks allocated over the VM's life */
+} polity_memory_usage;
+
+/* Bytes a VM holds, by what they are for */
+typedef struct {
+    polity_memory_usage strings;
+    polity_memory_usage tables; /* globals and the string intern table */
+    polity_memory_usage chunks; /* compiled programs */
+    polity_memory_usage arrays;
+    polity_memory_usage maps;
+    polity_memory_usage stacks; /* value stacks of the VM and its fibers */
+    polity_memory_usage files; /* open file streams and line buffers */
+    polity_memory_usage total;
+} polity_memory;
+
+/* Receives everything a call prints, in pieces of any size */
+typedef void (*polity_write_fn)(void* user_data, const char* text, size_t length);
+
+/* Where one call's output and errors go. A NULL polity_io, or a NULL
+ * callback, writes to stdout or stderr. */
+typedef struct {
+    polity_write_fn output; /* print statements */
+    polity_write_fn errors; /* compile and runtime errors */
+    void* user_data;
+} polity_io;
+
+/* NULL options selects the stack engine without -O */
+polity_vm* polity_new(const polity_options* options);
+void polity_free(polity_vm* vm);
+
+/* Compile source, resolving imports against path (NULL for the working
+ * directory). Returns NULL after reporting errors through io. */
+polity_program* polity_compile(polity_vm* vm, const char* source, const char* path, const polity_io* io);
+void polity_free_program(polity_vm* vm, polity_program* program);
+
+/* Run a program compiled by this VM. Globals persist from run to run
+ * until polity_reset(). */
+polity_status polity_run(polity_vm* vm, polity_program* program, const polity_io* io);
+
+/* Continue the run that last returned POLITY_YIELD, with a fresh supply
+ * of fuel. Hosts can interleave many VMs on one thread this way:
+ *
+ *     polity_status status = polity_run(vm, program, &io);
+ *     while (status == POLITY_YIELD)
+ *         status = polity_resume(vm, &io);
+ *
+ * Returns POLITY_OK if no run is waiting. The program must stay alive
+ * until its run finishes or the VM is reset. */
+polity_status polity_resume(polity_vm* vm, const polity_io* io);
+
+/* Fibers run programs side by side on one VM and one thread, sharing its
+ * globals. A fiber gives control back to its host at each `yield;` and
+ * whenever it spends its fuel, so an event loop can keep many scripts
+ * waiting on I/O in flight:
+ *
+ *     polity_fiber* fiber = polity_fiber_new(vm, program);
+ *     while (polity_fiber_resume(vm, fiber, &io) == POLITY_YIELD)
+ *         wait_for_something();
+ *     polity_fiber_free(vm, fiber);
+ *
+ * A new fiber starts at the top of program on the first resume. Once it
+ * has finished, resuming returns how it finished. Free fibers before
+ * freeing their program or resetting the VM. */
+polity_fiber* polity_fiber_new(polity_vm* vm, polity_program* program);
+polity_status polity_fiber_resume(polity_vm* vm, polity_fiber* fiber, const polity_io* io);
+void polity_fiber_free(polity_vm* vm, polity_fiber* fiber);
+
+/* A run that would pass the memory limit stops with a runtime error */
+void polity_memory_stats(polity_vm* vm, polity_memory* memory);
+
+/* Return the globals to the builtins and free every object allocated
+ * since the VM's most recent compile or reset, abandoning a yielded run. Compiled programs, the
+ * string intern table and table storage are kept. */
+void polity_reset(polity_vm* vm);
+
+#endif
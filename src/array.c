@@ -0,0 +1,638 @@
+#include "interpreter.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define VECTOR_KERNELS
+#endif
+
+/* ARRAYS
+ *
+ * [a, b, c] builds an obj_array: a growable buffer of values. numbers(n)
+ * builds an obj_number_array, which keeps its elements as raw doubles so
+ * sum(), min(), max(), scale() and dot() can run over them with SSE2 or
+ * AVX. Both index the same way, and both grow with push(). */
+
+static bool reserve_values(VM* vm, obj_array* array, int needed)
+{
+    if (needed <= array->capacity)
+        return true;
+    int capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+    if (!memory_available(vm, sizeof(value) * (capacity - array->capacity)))
+        return false;
+    array->values = GROW_ARRAY(vm, MEMORY_ARRAYS, value, array->values, array->capacity, capacity);
+    array->capacity = capacity;
+    return true;
+}
+
+static bool reserve_numbers(VM* vm, obj_number_array* array, int needed)
+{
+    if (needed <= array->capacity)
+        return true;
+    int capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+    if (!memory_available(vm, sizeof(double) * (capacity - array->capacity)))
+        return false;
+    array->numbers = GROW_ARRAY(vm, MEMORY_ARRAYS, double, array->numbers, array->capacity, capacity);
+    array->capacity = capacity;
+    return true;
+}
+
+static struct obj* new_object(VM* vm, obj_type type, size_t size)
+{
+    struct obj* object = (struct obj*)reallocate(vm, MEMORY_ARRAYS, NULL, 0, size);
+    memset(object, 0, size);
+    object->type = type;
+    object->next = vm->objects;
+    vm->objects = object;
+    return object;
+}
+
+/* Under -n, free_unreachable() stops at objects older than the line, so
+ * an object stored in an array is remembered as a root in case the array
+ * is one of those */
+void remember_value(VM* vm, value val)
+{
+    if (!vm->keep_globals || !IS_OBJ(val))
+        return;
+    if (vm->remembered_count == vm->remembered_capacity) {
+        int capacity = vm->remembered_capacity < 8 ? 8 : vm->remembered_capacity * 2;
+        vm->remembered = GROW_ARRAY(vm, MEMORY_ARRAYS, value, vm->remembered, vm->remembered_capacity, capacity);
+        vm->remembered_capacity = capacity;
+    }
+    vm->remembered[vm->remembered_count++] = val;
+}
+
+void forget_writes(VM* vm)
+{
+    vm->remembered_count = 0;
+}
+
+/* OP_ARRAY: a new array holding count items. result may alias items, and
+ * items may be NULL for the caller to fill the array in. */
+bool make_array(VM* vm, value* items, int count, value* result)
+{
+    if (!memory_available(vm, sizeof(obj_array) + sizeof(value) * count)) {
+        out_of_memory(vm);
+        return false;
+    }
+    obj_array* array = (obj_array*)new_object(vm, OBJ_ARRAY, sizeof(obj_array));
+    if (count > 0) {
+        reserve_values(vm, array, count);
+        if (items != NULL)
+            memcpy(array->values, items, sizeof(value) * count);
+    }
+    array->count = count;
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+/* Check that index is a whole number within count. Only doubles inside
+ * the int64_t range are cast, since casting NaN, infinities or anything
+ * past 2^63 is undefined; those past it are out of range anyway. */
+static bool to_index(VM* vm, value index, int count, int* result)
+{
+    double number = TO_NUMBER(index);
+    if (!IS_NUMERIC(index) || number != number
+            || (number > -9.2e18 && number < 9.2e18 && number != (double)(int64_t)number)) {
+        runtime_error(vm, "Index must be an integer");
+        return false;
+    }
+    if (number < 0 || number >= count) {
+        runtime_error(vm, "Index %.0f is out of range for length %d", number, count);
+        return false;
+    }
+    *result = (int)number;
+    return true;
+}
+
+bool get_index(VM* vm, value container, value index, value* result)
+{
+    int i;
+    if (IS_ARRAY(container)) {
+        obj_array* array = AS_ARRAY(container);
+        if (!to_index(vm, index, array->count, &i))
+            return false;
+        *result = array->values[i];
+        return true;
+    }
+    if (IS_MAP(container))
+        return map_get(vm, AS_MAP(container), index, result);
+    if (IS_NUMBER_ARRAY(container)) {
+        obj_number_array* array = AS_NUMBER_ARRAY(container);
+        if (!to_index(vm, index, array->count, &i))
+            return false;
+        *result = NUMBER_VAL(array->numbers[i]);
+        return true;
+    }
+    runtime_error(vm, "Can only index arrays and maps");
+    return false;
+}
+
+bool set_index(VM* vm, value container, value index, value val)
+{
+    int i;
+    if (IS_ARRAY(container)) {
+        obj_array* array = AS_ARRAY(container);
+        if (!to_index(vm, index, array->count, &i))
+            return false;
+        array->values[i] = val;
+        remember_value(vm, val);
+        return true;
+    }
+    if (IS_MAP(container))
+        return map_set(vm, AS_MAP(container), index, val);
+    if (IS_NUMBER_ARRAY(container)) {
+        obj_number_array* array = AS_NUMBER_ARRAY(container);
+        if (!to_index(vm, index, array->count, &i))
+            return false;
+        if (!IS_NUMERIC(val)) {
+            runtime_error(vm, "Number arrays can only hold numbers");
+            return false;
+        }
+        array->numbers[i] = TO_NUMBER(val);
+        return true;
+    }
+    runtime_error(vm, "Can only index arrays and maps");
+    return false;
+}
+
+/* Arrays print their elements in brackets. One that contains itself
+ * prints as [...] inside, using the mark bit free_unreachable() clears. */
+void print_array(FILE* out, struct obj* object)
+{
+    if (object->marked) {
+        fputs("[...]", out);
+        return;
+    }
+
+    fputc('[', out);
+    if (object->type == OBJ_NUMBER_ARRAY) {
+        obj_number_array* array = (obj_number_array*)object;
+        for (int i = 0; i < array->count; i++)
+            fprintf(out, i ? ", %g" : "%g", array->numbers[i]);
+    } else {
+        obj_array* array = (obj_array*)object;
+        object->marked = true;
+        for (int i = 0; i < array->count; i++) {
+            if (i)
+                fputs(", ", out);
+            print_value(out, array->values[i]);
+        }
+        object->marked = false;
+    }
+    fputc(']', out);
+}
+
+/* KERNELS
+ *
+ * Each bulk operation has a scalar loop and, on x86-64, SSE2 and AVX
+ * versions that keep two vectors of partial results to hide the add
+ * latency. Vector sums add in a different order from the scalar loop, so
+ * they can differ from it in the last bits. */
+
+typedef struct {
+    double (*sum)(const double* x, int n);
+    double (*min)(const double* x, int n);
+    double (*max)(const double* x, int n);
+    void (*scale)(double* x, int n, double factor);
+    double (*dot)(const double* x, const double* y, int n);
+} number_kernels;
+
+static double sum_scalar(const double* x, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += x[i];
+    return sum;
+}
+
+static double min_scalar(const double* x, int n)
+{
+    double min = x[0];
+    for (int i = 1; i < n; i++)
+        if (x[i] < min)
+            min = x[i];
+    return min;
+}
+
+static double max_scalar(const double* x, int n)
+{
+    double max = x[0];
+    for (int i = 1; i < n; i++)
+        if (x[i] > max)
+            max = x[i];
+    return max;
+}
+
+static void scale_scalar(double* x, int n, double factor)
+{
+    for (int i = 0; i < n; i++)
+        x[i] *= factor;
+}
+
+static double dot_scalar(const double* x, const double* y, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+static const number_kernels scalar_kernels = {sum_scalar, min_scalar, max_scalar, scale_scalar, dot_scalar};
+
+#ifdef VECTOR_KERNELS
+static double sum_sse2(const double* x, int n)
+{
+    __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_add_pd(a, _mm_loadu_pd(x + i));
+        b = _mm_add_pd(b, _mm_loadu_pd(x + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+    return lanes[0] + lanes[1] + sum_scalar(x + i, n - i);
+}
+
+static double min_sse2(const double* x, int n)
+{
+    if (n < 4)
+        return min_scalar(x, n);
+    __m128d a = _mm_loadu_pd(x), b = _mm_loadu_pd(x + 2);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_min_pd(a, _mm_loadu_pd(x + i));
+        b = _mm_min_pd(b, _mm_loadu_pd(x + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(a, b));
+    double min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    for (; i < n; i++)
+        if (x[i] < min)
+            min = x[i];
+    return min;
+}
+
+static double max_sse2(const double* x, int n)
+{
+    if (n < 4)
+        return max_scalar(x, n);
+    __m128d a = _mm_loadu_pd(x), b = _mm_loadu_pd(x + 2);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_max_pd(a, _mm_loadu_pd(x + i));
+        b = _mm_max_pd(b, _mm_loadu_pd(x + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_max_pd(a, b));
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < n; i++)
+        if (x[i] > max)
+            max = x[i];
+    return max;
+}
+
+static void scale_sse2(double* x, int n, double factor)
+{
+    __m128d k = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), k));
+    scale_scalar(x + i, n - i, factor);
+}
+
+static double dot_sse2(const double* x, const double* y, int n)
+{
+    __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+        b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+    return lanes[0] + lanes[1] + dot_scalar(x + i, y + i, n - i);
+}
+
+#define AVX __attribute__((target("avx")))
+
+/* The four lanes of v, stored for a scalar reduction */
+AVX static void lanes_avx(__m256d v, double lanes[4])
+{
+    _mm256_storeu_pd(lanes, v);
+}
+
+AVX static double sum_avx(const double* x, int n)
+{
+    __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a = _mm256_add_pd(a, _mm256_loadu_pd(x + i));
+        b = _mm256_add_pd(b, _mm256_loadu_pd(x + i + 4));
+    }
+    double lanes[4];
+    lanes_avx(_mm256_add_pd(a, b), lanes);
+    return sum_scalar(lanes, 4) + sum_scalar(x + i, n - i);
+}
+
+AVX static double min_avx(const double* x, int n)
+{
+    if (n < 8)
+        return min_scalar(x, n);
+    __m256d a = _mm256_loadu_pd(x), b = _mm256_loadu_pd(x + 4);
+    int i = 8;
+    for (; i + 8 <= n; i += 8) {
+        a = _mm256_min_pd(a, _mm256_loadu_pd(x + i));
+        b = _mm256_min_pd(b, _mm256_loadu_pd(x + i + 4));
+    }
+    double lanes[4];
+    lanes_avx(_mm256_min_pd(a, b), lanes);
+    double min = min_scalar(lanes, 4);
+    for (; i < n; i++)
+        if (x[i] < min)
+            min = x[i];
+    return min;
+}
+
+AVX static double max_avx(const double* x, int n)
+{
+    if (n < 8)
+        return max_scalar(x, n);
+    __m256d a = _mm256_loadu_pd(x), b = _mm256_loadu_pd(x + 4);
+    int i = 8;
+    for (; i + 8 <= n; i += 8) {
+        a = _mm256_max_pd(a, _mm256_loadu_pd(x + i));
+        b = _mm256_max_pd(b, _mm256_loadu_pd(x + i + 4));
+    }
+    double lanes[4];
+    lanes_avx(_mm256_max_pd(a, b), lanes);
+    double max = max_scalar(lanes, 4);
+    for (; i < n; i++)
+        if (x[i] > max)
+            max = x[i];
+    return max;
+}
+
+AVX static void scale_avx(double* x, int n, double factor)
+{
+    __m256d k = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), k));
+    scale_scalar(x + i, n - i, factor);
+}
+
+AVX static double dot_avx(const double* x, const double* y, int n)
+{
+    __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    double lanes[4];
+    lanes_avx(_mm256_add_pd(a, b), lanes);
+    return sum_scalar(lanes, 4) + dot_scalar(x + i, y + i, n - i);
+}
+
+static const number_kernels sse2_kernels = {sum_sse2, min_sse2, max_sse2, scale_sse2, dot_sse2};
+static const number_kernels avx_kernels = {sum_avx, min_avx, max_avx, scale_avx, dot_avx};
+#endif
+
+/* The kernels --simd asks for, or the widest this CPU runs */
+static const number_kernels* kernels(VM* vm)
+{
+#ifdef VECTOR_KERNELS
+    switch (vm->simd) {
+        case SIMD_SCALAR:
+            return &scalar_kernels;
+        case SIMD_SSE2:
+            return &sse2_kernels;
+        default:
+            return __builtin_cpu_supports("avx") ? &avx_kernels : &sse2_kernels;
+    }
+#else
+    return &scalar_kernels;
+#endif
+}
+
+/* ARRAY NATIVES */
+static bool numbers_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    double count = IS_NUMERIC(args[0]) ? TO_NUMBER(args[0]) : -1;
+    if (!(count >= 0 && count <= INT32_MAX) || count != (double)(int64_t)count) {
+        native_error(vm, "Expected a length");
+        return false;
+    }
+    if (!memory_available(vm, sizeof(obj_number_array) + sizeof(double) * (size_t)count)) {
+        native_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+        return false;
+    }
+
+    obj_number_array* array = (obj_number_array*)new_object(vm, OBJ_NUMBER_ARRAY, sizeof(obj_number_array));
+    if (count > 0) {
+        reserve_numbers(vm, array, (int)count);
+        memset(array->numbers, 0, sizeof(double) * (size_t)count);
+    }
+    array->count = (int)count;
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool len_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (IS_ARRAY(args[0]))
+        *result = INT_VAL(AS_ARRAY(args[0])->count);
+    else if (IS_NUMBER_ARRAY(args[0]))
+        *result = INT_VAL(AS_NUMBER_ARRAY(args[0])->count);
+    else if (IS_MAP(args[0]))
+        *result = INT_VAL(AS_MAP(args[0])->count);
+    else if (IS_STRING(args[0]))
+        *result = INT_VAL(AS_STRING(args[0])->length);
+    else {
+        native_error(vm, "Expected an array, a map or a string");
+        return false;
+    }
+    return true;
+}
+
+static bool push_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    bool reserved;
+    if (IS_ARRAY(args[0])) {
+        obj_array* array = AS_ARRAY(args[0]);
+        reserved = reserve_values(vm, array, array->count + 1);
+        if (reserved) {
+            array->values[array->count++] = args[1];
+            remember_value(vm, args[1]);
+        }
+    } else if (IS_NUMBER_ARRAY(args[0])) {
+        obj_number_array* array = AS_NUMBER_ARRAY(args[0]);
+        if (!IS_NUMERIC(args[1])) {
+            native_error(vm, "Number arrays can only hold numbers");
+            return false;
+        }
+        reserved = reserve_numbers(vm, array, array->count + 1);
+        if (reserved)
+            array->numbers[array->count++] = TO_NUMBER(args[1]);
+    } else {
+        native_error(vm, "Expected an array");
+        return false;
+    }
+
+    if (!reserved) {
+        native_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+        return false;
+    }
+    *result = NIL_VAL;
+    return true;
+}
+
+/* The bulk natives take a number array, or an array that holds only
+ * numbers, which they go through one value at a time */
+static bool check_numbers(VM* vm, value val)
+{
+    if (IS_NUMBER_ARRAY(val))
+        return true;
+    if (IS_ARRAY(val)) {
+        obj_array* array = AS_ARRAY(val);
+        for (int i = 0; i < array->count; i++) {
+            if (!IS_NUMERIC(array->values[i])) {
+                native_error(vm, "Expected an array of numbers");
+                return false;
+            }
+        }
+        return true;
+    }
+    native_error(vm, "Expected an array of numbers");
+    return false;
+}
+
+static int count_of(value val)
+{
+    return IS_NUMBER_ARRAY(val) ? AS_NUMBER_ARRAY(val)->count : AS_ARRAY(val)->count;
+}
+
+static double number_at(value val, int i)
+{
+    return IS_NUMBER_ARRAY(val) ? AS_NUMBER_ARRAY(val)->numbers[i] : TO_NUMBER(AS_ARRAY(val)->values[i]);
+}
+
+static bool sum_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!check_numbers(vm, args[0]))
+        return false;
+    if (IS_NUMBER_ARRAY(args[0])) {
+        obj_number_array* array = AS_NUMBER_ARRAY(args[0]);
+        *result = NUMBER_VAL(kernels(vm)->sum(array->numbers, array->count));
+        return true;
+    }
+
+    /* Generic arrays add as + does, keeping integer sums integers */
+    value sum = INT_VAL(0);
+    for (int i = 0; i < AS_ARRAY(args[0])->count; i++)
+        sum = number_arithmetic(OP_ADD, sum, AS_ARRAY(args[0])->values[i]);
+    *result = sum;
+    return true;
+}
+
+static bool extreme(VM* vm, value val, bool want_max, value* result)
+{
+    if (!check_numbers(vm, val))
+        return false;
+    int count = count_of(val);
+    if (count == 0) {
+        *result = NIL_VAL;
+        return true;
+    }
+    if (IS_NUMBER_ARRAY(val)) {
+        obj_number_array* array = AS_NUMBER_ARRAY(val);
+        const number_kernels* k = kernels(vm);
+        *result = NUMBER_VAL(want_max ? k->max(array->numbers, count) : k->min(array->numbers, count));
+        return true;
+    }
+
+    value best = AS_ARRAY(val)->values[0];
+    for (int i = 1; i < count; i++) {
+        value next = AS_ARRAY(val)->values[i];
+        if (want_max ? number_less(best, next) : number_less(next, best))
+            best = next;
+    }
+    *result = best;
+    return true;
+}
+
+static bool min_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return extreme(vm, args[0], false, result);
+}
+
+static bool max_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return extreme(vm, args[0], true, result);
+}
+
+/* Multiply every element by a factor in place, returning the array */
+static bool scale_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!check_numbers(vm, args[0]))
+        return false;
+    if (!IS_NUMERIC(args[1])) {
+        native_error(vm, "Expected a number to scale by");
+        return false;
+    }
+    if (IS_NUMBER_ARRAY(args[0])) {
+        obj_number_array* array = AS_NUMBER_ARRAY(args[0]);
+        kernels(vm)->scale(array->numbers, array->count, TO_NUMBER(args[1]));
+    } else {
+        obj_array* array = AS_ARRAY(args[0]);
+        for (int i = 0; i < array->count; i++)
+            array->values[i] = number_arithmetic(OP_MULTIPLY, array->values[i], args[1]);
+    }
+    *result = args[0];
+    return true;
+}
+
+static bool dot_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!check_numbers(vm, args[0]) || !check_numbers(vm, args[1]))
+        return false;
+    int count = count_of(args[0]);
+    if (count_of(args[1]) != count) {
+        native_error(vm, "Expected arrays of the same length");
+        return false;
+    }
+    if (IS_NUMBER_ARRAY(args[0]) && IS_NUMBER_ARRAY(args[1])) {
+        *result = NUMBER_VAL(kernels(vm)->dot(AS_NUMBER_ARRAY(args[0])->numbers, AS_NUMBER_ARRAY(args[1])->numbers, count));
+        return true;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += number_at(args[0], i) * number_at(args[1], i);
+    *result = NUMBER_VAL(sum);
+    return true;
+}
+
+void define_array_natives(VM* vm)
+{
+    define_native(vm, "numbers", 1, numbers_native);
+    define_native(vm, "len", 1, len_native);
+    define_native(vm, "push", 2, push_native);
+    define_native(vm, "sum", 1, sum_native);
+    define_native(vm, "min", 1, min_native);
+    define_native(vm, "max", 1, max_native);
+    define_native(vm, "scale", 2, scale_native);
+    define_native(vm, "dot", 2, dot_native);
+}
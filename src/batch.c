@@ -0,0 +1,249 @@
+#define _GNU_SOURCE /* open_memstream */
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+
+/* BATCH EXECUTION
+ *
+ * polity --batch dir/ -j N runs every .np file in dir on N worker threads.
+ * Each worker owns a VM, reset between scripts, and each script prints
+ * into its own memory streams; the main thread writes those out in path
+ * order as scripts finish, so the output matches running the scripts one
+ * after another.
+ *
+ * Scripts are dealt out as contiguous ranges, one deque per worker.
+ * Workers take from the front of their own range, in the order the
+ * output is written, and steal from the back of another worker's range
+ * once theirs is empty. */
+
+typedef struct {
+    char* path;
+    char* output;
+    size_t output_size;
+    char* errors;
+    size_t errors_size;
+    int status;
+    bool done;
+} batch_script;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int top;    /* next script the owner runs */
+    int bottom; /* one past the last script left in the range */
+} batch_deque;
+
+typedef struct {
+    VM* settings; /* engine and flags every worker VM copies */
+    bool use_cache;
+    batch_script* scripts;
+    int count;
+    batch_deque* deques;
+    int jobs;
+    pthread_mutex_t lock; /* guards done */
+    pthread_cond_t finished;
+} batch;
+
+typedef struct {
+    batch* batch;
+    int id;
+    pthread_t thread;
+} batch_worker;
+
+static int next_script(batch* b, int id)
+{
+    for (int i = 0; i < b->jobs; i++) {
+        batch_deque* deque = &b->deques[(id + i) % b->jobs];
+        int script = -1;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->top < deque->bottom)
+            script = i == 0 ? deque->top++ : --deque->bottom;
+        pthread_mutex_unlock(&deque->lock);
+        if (script >= 0)
+            return script;
+    }
+    return -1;
+}
+
+static void run_script(batch* b, polity_interpreter* interpreter, table* builtins, batch_script* script)
+{
+    VM* vm = interpreter->vm;
+    vm->out = open_memstream(&script->output, &script->output_size);
+    vm->err = open_memstream(&script->errors, &script->errors_size);
+    struct obj* mark = vm->objects;
+
+    char* source = read_file(script->path);
+    if (!source) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", script->path);
+        script->status = 74;
+    } else {
+        interpret_result result;
+        interpreter->path = script->path;
+        if (b->use_cache) {
+            char* cache_path = (char*)malloc(strlen(script->path) + 2);
+            sprintf(cache_path, "%sc", script->path);
+            result = interpret_cached(interpreter, source, cache_path);
+            free(cache_path);
+        } else
+            result = interpret(interpreter, source);
+        free(source);
+
+        script->status = 0;
+        if (result == INTERPRET_COMPILE_ERROR) {
+            fprintf(vm->out, "Compile error\n");
+            script->status = 65;
+        } else if (result == INTERPRET_RUNTIME_ERROR) {
+            fprintf(vm->out, "Runtime error\n");
+            script->status = 70;
+        }
+    }
+
+    reset_vm(vm, mark, builtins);
+    fclose(vm->out);
+    fclose(vm->err);
+    vm->out = stdout;
+    vm->err = stderr;
+}
+
+static void* run_worker(void* argument)
+{
+    batch_worker* worker = (batch_worker*)argument;
+    batch* b = worker->batch;
+
+    polity_interpreter interpreter = {0};
+    VM* vm = interpreter.vm = init_vm();
+    vm->engine = b->settings->engine;
+    vm->optimize = b->settings->optimize;
+    vm->trace_tiers = b->settings->trace_tiers;
+    vm->budget = b->settings->budget;
+    vm->memory.limit = b->settings->memory.limit;
+    vm->io_backend = b->settings->io_backend;
+    vm->simd = b->settings->simd;
+    vm->jobs = 1; /* the batch already keeps every core busy */
+
+    table builtins = {0};
+    for (int i = 0; i < vm->globals.capacity; i++)
+        if (vm->globals.entries[i].key)
+            table_set(vm, &builtins, vm->globals.entries[i].key, vm->globals.entries[i].value);
+
+    for (int i = next_script(b, worker->id); i >= 0; i = next_script(b, worker->id)) {
+        run_script(b, &interpreter, &builtins, &b->scripts[i]);
+        pthread_mutex_lock(&b->lock);
+        b->scripts[i].done = true;
+        pthread_cond_broadcast(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    free_table(vm, &builtins);
+    free_vm(vm);
+    return NULL;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+    return strcmp(((const batch_script*)a)->path, ((const batch_script*)b)->path);
+}
+
+/* Collect the .np files directly inside directory, sorted by name. count
+ * is -1 if the directory cannot be read. */
+static batch_script* list_scripts(const char* directory, int* count)
+{
+    DIR* dir = opendir(directory);
+    *count = -1;
+    if (!dir)
+        return NULL;
+
+    int capacity = 0;
+    batch_script* scripts = NULL;
+    *count = 0;
+    struct dirent* file;
+    while ((file = readdir(dir))) {
+        size_t length = strlen(file->d_name);
+        if (length < 3 || strcmp(&file->d_name[length - 3], ".np"))
+            continue;
+        if (capacity < *count + 1) {
+            capacity = capacity < 8 ? 8 : capacity * 2;
+            scripts = (batch_script*)realloc(scripts, sizeof(batch_script) * capacity);
+        }
+        batch_script* script = &scripts[(*count)++];
+        memset(script, 0, sizeof(batch_script));
+        script->path = (char*)malloc(strlen(directory) + length + 2);
+        sprintf(script->path, "%s/%s", directory, file->d_name);
+    }
+    closedir(dir);
+
+    qsort(scripts, *count, sizeof(batch_script), compare_paths);
+    return scripts;
+}
+
+/* Run every script in directory on jobs threads, writing each script's
+ * output in path order. Returns the exit status of the first script that
+ * failed, or 0. */
+int run_batch(VM* settings, const char* directory, int jobs, bool use_cache)
+{
+    batch b = {0};
+    b.settings = settings;
+    b.use_cache = use_cache;
+    b.scripts = list_scripts(directory, &b.count);
+    if (b.count < 0) {
+        fprintf(stderr, "Could not open directory \"%s\".\n", directory);
+        return 74;
+    }
+
+    if (jobs < 1)
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > b.count)
+        jobs = b.count;
+    if (jobs < 1)
+        jobs = 1;
+    b.jobs = jobs;
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.finished, NULL);
+    b.deques = (batch_deque*)calloc(jobs, sizeof(batch_deque));
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_init(&b.deques[i].lock, NULL);
+        b.deques[i].top = (int)((long long)b.count * i / jobs);
+        b.deques[i].bottom = (int)((long long)b.count * (i + 1) / jobs);
+    }
+
+    batch_worker* workers = (batch_worker*)calloc(jobs, sizeof(batch_worker));
+    for (int i = 0; i < jobs; i++) {
+        workers[i].batch = &b;
+        workers[i].id = i;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+
+    int status = 0;
+    for (int i = 0; i < b.count; i++) {
+        batch_script* script = &b.scripts[i];
+        pthread_mutex_lock(&b.lock);
+        while (!script->done)
+            pthread_cond_wait(&b.finished, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+
+        fwrite(script->output, 1, script->output_size, stdout);
+        fflush(stdout);
+        fwrite(script->errors, 1, script->errors_size, stderr);
+        if (status == 0)
+            status = script->status;
+        free(script->output);
+        free(script->errors);
+        free(script->path);
+    }
+
+    for (int i = 0; i < jobs; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_destroy(&b.deques[i].lock);
+    pthread_cond_destroy(&b.finished);
+    pthread_mutex_destroy(&b.lock);
+    free(workers);
+    free(b.deques);
+    free(b.scripts);
+    return status;
+}
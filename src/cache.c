@@ -0,0 +1,578 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+
+/* BYTECODE CACHE
+ *
+ * A compiled chunk is saved next to its script as a .npc file:
+ *
+ *   header   magic, format, interpreter version, flags, source hash
+ *   body     max_stack, cache_count, code, lines, constants
+ *   trailer  hash of the body
+ *
+ * Integers are stored little-endian at fixed widths. A cache is only used
+ * when every header field matches this build and the source being run,
+ * the body hashes to the trailer and every instruction decodes within
+ * bounds. Anything else counts as a miss and the script is compiled.
+ *
+ * Images (.npi, see below) hold the same chunk laid out to be mapped and
+ * run in place instead. */
+
+#define NPC_MAGIC "NPC\x1A"
+#define NPC_FLAG_OPTIMIZED 1
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} npc_writer;
+
+typedef struct {
+    const uint8_t* bytes;
+    size_t count;
+    size_t position;
+    bool failed; /* a read ran past the end */
+} npc_reader;
+
+/* FNV-1a over length bytes, carrying on from hash */
+static uint64_t hash_more(uint64_t hash, const uint8_t* bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t hash_bytes(const uint8_t* bytes, size_t length)
+{
+    return hash_more(14695981039346656037ull, bytes, length);
+}
+
+/* WRITING */
+static void write_bytes(npc_writer* w, const void* bytes, size_t length)
+{
+    if (w->capacity < w->count + length) {
+        while (w->capacity < w->count + length)
+            w->capacity = w->capacity < 256 ? 256 : w->capacity * 2;
+        w->bytes = (uint8_t*)realloc(w->bytes, w->capacity);
+    }
+    memcpy(w->bytes + w->count, bytes, length);
+    w->count += length;
+}
+
+static void write_u8(npc_writer* w, uint8_t byte)
+{
+    write_bytes(w, &byte, 1);
+}
+
+static void write_u32(npc_writer* w, uint32_t word)
+{
+    for (int i = 0; i < 4; i++)
+        write_u8(w, (uint8_t)(word >> (8 * i)));
+}
+
+static void write_u64(npc_writer* w, uint64_t word)
+{
+    for (int i = 0; i < 8; i++)
+        write_u8(w, (uint8_t)(word >> (8 * i)));
+}
+
+static bool write_constant(npc_writer* w, value val)
+{
+    write_u8(w, (uint8_t)val.type);
+    switch (val.type) {
+        case VAL_NIL:
+            return true;
+        case VAL_BOOL:
+            write_u8(w, AS_BOOL(val));
+            return true;
+        case VAL_NUMBER:
+        case VAL_INT: {
+            uint64_t bits;
+            memcpy(&bits, &val.as, sizeof(bits));
+            write_u64(w, bits);
+            return true;
+        }
+        case VAL_OBJ:
+            if (!IS_STRING(val))
+                return false;
+            write_u32(w, (uint32_t)AS_STRING(val)->length);
+            write_bytes(w, AS_CSTRING(val), AS_STRING(val)->length);
+            return true;
+    }
+    return false;
+}
+
+static void write_header(npc_writer* w, const char* source, bool optimized)
+{
+    write_bytes(w, NPC_MAGIC, 4);
+    write_u32(w, NPC_FORMAT);
+    write_u8(w, (uint8_t)strlen(POLITY_VERSION));
+    write_bytes(w, POLITY_VERSION, strlen(POLITY_VERSION));
+    write_u8(w, optimized ? NPC_FLAG_OPTIMIZED : 0);
+    write_u64(w, hash_bytes((const uint8_t*)source, strlen(source)));
+}
+
+/* Save a freshly compiled chunk, before run() quickens any of it. The file
+ * is written under a temporary name and renamed into place, so concurrent
+ * runs of the same script never read half a cache. Failure is silent; the
+ * next run simply compiles again. */
+void save_cached_chunk(chunk* chunk, const char* path, const char* source, bool optimized)
+{
+    npc_writer w = {0};
+    write_header(&w, source, optimized);
+
+    size_t body = w.count;
+    write_u32(&w, (uint32_t)chunk->max_stack);
+    write_u32(&w, (uint32_t)chunk->cache_count);
+    write_u32(&w, (uint32_t)chunk->count);
+    write_bytes(&w, chunk->code, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        write_u32(&w, (uint32_t)chunk->lines[i]);
+    write_u32(&w, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!write_constant(&w, chunk->constants.values[i])) {
+            free(w.bytes);
+            return;
+        }
+    }
+    write_u64(&w, hash_bytes(w.bytes + body, w.count - body));
+
+    char* temporary = (char*)malloc(strlen(path) + 32);
+    sprintf(temporary, "%s.%ld.tmp", path, (long)getpid());
+    FILE* file = fopen(temporary, "wb");
+    if (file) {
+        bool written = fwrite(w.bytes, 1, w.count, file) == w.count;
+        if (fclose(file) != 0 || !written || rename(temporary, path) != 0)
+            remove(temporary);
+    }
+
+    free(temporary);
+    free(w.bytes);
+}
+
+/* READING */
+static const uint8_t* read_bytes(npc_reader* r, size_t length)
+{
+    if (r->failed || r->count - r->position < length) {
+        r->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = r->bytes + r->position;
+    r->position += length;
+    return bytes;
+}
+
+static uint8_t read_u8(npc_reader* r)
+{
+    const uint8_t* bytes = read_bytes(r, 1);
+    return bytes ? bytes[0] : 0;
+}
+
+static uint32_t read_u32(npc_reader* r)
+{
+    const uint8_t* bytes = read_bytes(r, 4);
+    uint32_t word = 0;
+    for (int i = 0; bytes && i < 4; i++)
+        word |= (uint32_t)bytes[i] << (8 * i);
+    return word;
+}
+
+static uint64_t read_u64(npc_reader* r)
+{
+    const uint8_t* bytes = read_bytes(r, 8);
+    uint64_t word = 0;
+    for (int i = 0; bytes && i < 8; i++)
+        word |= (uint64_t)bytes[i] << (8 * i);
+    return word;
+}
+
+static bool read_constant(VM* vm, npc_reader* r, value* val)
+{
+    uint8_t type = read_u8(r);
+    switch (type) {
+        case VAL_NIL:
+            *val = NIL_VAL;
+            break;
+        case VAL_BOOL:
+            *val = BOOL_VAL(read_u8(r) != 0);
+            break;
+        case VAL_NUMBER:
+        case VAL_INT: {
+            uint64_t bits = read_u64(r);
+            val->type = (value_type)type;
+            memcpy(&val->as, &bits, sizeof(bits));
+            break;
+        }
+        case VAL_OBJ: {
+            uint32_t length = read_u32(r);
+            const uint8_t* chars = read_bytes(r, length);
+            if (!chars || length > INT32_MAX)
+                return false;
+            *val = OBJ_VAL(copy_string(vm, (const char*)chars, (int)length));
+            break;
+        }
+        default:
+            return false;
+    }
+    return !r->failed;
+}
+
+/* Whether every instruction is a generic opcode whose operands stay inside
+ * the chunk: constants, inline caches, stack slots and jump targets */
+static bool verify_code(chunk* chunk)
+{
+    uint8_t* code = chunk->code;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = code[offset];
+        if (op > OP_RETURN || offset + 1 + operand_length[op] > chunk->count)
+            return false;
+
+        uint8_t* ip = &code[offset + 1];
+        switch (op) {
+            case OP_CONSTANT:
+                if (ip[0] >= chunk->constants.count)
+                    return false;
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                if (((ip[1] << 8) | ip[2]) >= chunk->cache_count)
+                    return false;
+                /* fall through */
+            case OP_DEFINE_GLOBAL:
+                if (ip[0] >= chunk->constants.count || !IS_STRING(chunk->constants.values[ip[0]]))
+                    return false;
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                if (ip[0] >= chunk->max_stack)
+                    return false;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP: {
+                int jump = (ip[0] << 8) | ip[1];
+                int target = offset + 3 + (op == OP_LOOP ? -jump : jump);
+                if (target < 0 || target >= chunk->count)
+                    return false;
+                break;
+            }
+        }
+        offset += 1 + operand_length[op];
+    }
+    return chunk->count > 0 && code[chunk->count - 1] == OP_RETURN;
+}
+
+/* Load the chunk cached at path if it was compiled from this source by
+ * this build with the same options, or return NULL */
+chunk* load_cached_chunk(VM* vm, const char* path, const char* source, bool optimized)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size <= 0) {
+        fclose(file);
+        return NULL;
+    }
+    uint8_t* bytes = (uint8_t*)malloc(size);
+    bool complete = fread(bytes, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    npc_writer expected = {0};
+    write_header(&expected, source, optimized);
+    if (!complete || (size_t)size < expected.count + 8 || memcmp(bytes, expected.bytes, expected.count) != 0) {
+        free(expected.bytes);
+        free(bytes);
+        return NULL;
+    }
+
+    npc_reader r = {bytes, (size_t)size - 8, expected.count, false};
+    npc_reader trailer = {bytes, (size_t)size, (size_t)size - 8, false};
+    bool intact = read_u64(&trailer) == hash_bytes(bytes + expected.count, r.count - expected.count);
+    free(expected.bytes);
+    if (!intact) {
+        free(bytes);
+        return NULL;
+    }
+
+    chunk* loaded = (chunk*)calloc(1, sizeof(chunk));
+    loaded->max_stack = (int)read_u32(&r);
+    loaded->cache_count = (int)read_u32(&r);
+    uint32_t count = read_u32(&r);
+    const uint8_t* code = read_bytes(&r, count);
+    if (code && count < INT32_MAX && loaded->max_stack >= 0 && loaded->cache_count >= 0
+            && loaded->cache_count <= UINT16_MAX + 1) {
+        loaded->count = (int)count;
+        loaded->capacity = (int)count + 1;
+        loaded->code = ALLOCATE(vm, MEMORY_CHUNKS, uint8_t, loaded->capacity);
+        loaded->lines = ALLOCATE(vm, MEMORY_CHUNKS, int, loaded->capacity);
+        memcpy(loaded->code, code, count);
+        for (uint32_t i = 0; i < count; i++)
+            loaded->lines[i] = (int)read_u32(&r);
+    }
+
+    uint32_t constant_count = read_u32(&r);
+    bool valid = !r.failed && loaded->code && constant_count <= UINT8_COUNT;
+    for (uint32_t i = 0; valid && i < constant_count; i++) {
+        value val;
+        valid = read_constant(vm, &r, &val);
+        if (valid)
+            add_constant(vm, loaded, val);
+    }
+    free(bytes);
+
+    if (!valid || r.position != r.count || !verify_code(loaded)) {
+        free_chunk(vm, loaded);
+        return NULL;
+    }
+    loaded->caches = ALLOCATE(vm, MEMORY_CHUNKS, global_cache, loaded->cache_count);
+    if (loaded->cache_count > 0)
+        memset(loaded->caches, 0, sizeof(global_cache) * loaded->cache_count);
+    return loaded;
+}
+
+/* BYTECODE IMAGES
+ *
+ * An image is a chunk laid out so it can be mapped and run without being
+ * read into the heap:
+ *
+ *   header     npi_header
+ *   lines      int32 per code byte
+ *   code       bytecode, quickened in place through a private mapping
+ *   constants  16-byte records: type, then the payload; a string's
+ *              payload is the image offset of its string record
+ *   strings    length, hash and characters of each string constant
+ *
+ * Every reference inside the image is an offset from its start, so the
+ * file maps at any address. The header holds a hash of the whole image,
+ * taken with the hash field zeroed, which is checked before anything in
+ * the image is used, as the .npc trailer is. Pages stay shared between processes until
+ * run() quickens an instruction on them. Strings are interned as they are
+ * mapped, using the stored hash; the pool holds at most 256 constants.
+ * Fields are stored in host byte order, which the header records. */
+
+#define NPI_MAGIC "NPI\x1A"
+#define NPI_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[4];
+    uint32_t format;
+    char version[8];
+    uint32_t byte_order;
+    uint32_t size;
+    uint32_t max_stack;
+    uint32_t cache_count;
+    uint32_t code_count;
+    uint32_t code_offset;
+    uint32_t lines_offset;
+    uint32_t constant_count;
+    uint32_t constants_offset;
+    uint32_t reserved;
+    uint64_t hash; /* of the image with this field zeroed */
+} npi_header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t payload;
+} npi_constant;
+
+typedef struct {
+    uint32_t length;
+    uint32_t hash;
+    /* characters follow */
+} npi_string;
+
+_Static_assert(sizeof(npi_header) == 64, "image header layout");
+_Static_assert(sizeof(npi_constant) == 16, "image constant layout");
+
+static uint64_t hash_image(const uint8_t* image, size_t size)
+{
+    npi_header header;
+    memcpy(&header, image, sizeof(header));
+    header.hash = 0;
+    uint64_t hash = hash_bytes((const uint8_t*)&header, sizeof(header));
+    return hash_more(hash, image + sizeof(header), size - sizeof(header));
+}
+
+static void align_writer(npc_writer* w, size_t alignment)
+{
+    static const uint8_t zeros[16] = {0};
+    write_bytes(w, zeros, (alignment - w->count % alignment) % alignment);
+}
+
+/* Write a freshly compiled chunk as an image. Returns false if it holds a
+ * constant images cannot represent or the file cannot be written. */
+bool save_image(chunk* chunk, const char* path)
+{
+    npi_header header = {0};
+    memcpy(header.magic, NPI_MAGIC, 4);
+    header.format = NPC_FORMAT;
+    strncpy(header.version, POLITY_VERSION, sizeof(header.version));
+    header.byte_order = NPI_BYTE_ORDER;
+    header.max_stack = (uint32_t)chunk->max_stack;
+    header.cache_count = (uint32_t)chunk->cache_count;
+    header.code_count = (uint32_t)chunk->count;
+    header.constant_count = (uint32_t)chunk->constants.count;
+
+    npc_writer w = {0};
+    write_bytes(&w, &header, sizeof(header));
+    header.lines_offset = (uint32_t)w.count;
+    for (int i = 0; i < chunk->count; i++) {
+        int32_t line = chunk->lines[i];
+        write_bytes(&w, &line, sizeof(line));
+    }
+    header.code_offset = (uint32_t)w.count;
+    write_bytes(&w, chunk->code, chunk->count);
+
+    align_writer(&w, sizeof(npi_constant));
+    header.constants_offset = (uint32_t)w.count;
+    size_t string_offset = w.count + sizeof(npi_constant) * chunk->constants.count;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        value val = chunk->constants.values[i];
+        npi_constant record = {(uint32_t)val.type, 0, 0};
+        if (IS_OBJ(val)) {
+            if (!IS_STRING(val)) {
+                free(w.bytes);
+                return false;
+            }
+            record.payload = string_offset;
+            string_offset += sizeof(npi_string) + AS_STRING(val)->length;
+            string_offset += (4 - string_offset % 4) % 4;
+        } else
+            memcpy(&record.payload, &val.as, sizeof(record.payload));
+        write_bytes(&w, &record, sizeof(record));
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        value val = chunk->constants.values[i];
+        if (!IS_OBJ(val))
+            continue;
+        npi_string string = {(uint32_t)AS_STRING(val)->length, AS_STRING(val)->hash};
+        write_bytes(&w, &string, sizeof(string));
+        write_bytes(&w, AS_CSTRING(val), string.length);
+        align_writer(&w, 4);
+    }
+
+    header.size = (uint32_t)w.count;
+    memcpy(w.bytes, &header, sizeof(header));
+    header.hash = hash_image(w.bytes, w.count);
+    memcpy(w.bytes, &header, sizeof(header));
+
+    FILE* file = fopen(path, "wb");
+    bool written = file && fwrite(w.bytes, 1, w.count, file) == w.count;
+    if (file && fclose(file) != 0)
+        written = false;
+    free(w.bytes);
+    return written;
+}
+
+static bool within(const npi_header* header, uint64_t offset, uint64_t length)
+{
+    return offset <= header->size && length <= header->size - offset;
+}
+
+/* Map the image at path and return a chunk that runs from the mapping, or
+ * NULL if it is not an image this build can run */
+chunk* load_image(VM* vm, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    if (size < (long)sizeof(npi_header)) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint8_t* image = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    char version[8] = {0};
+    strncpy(version, POLITY_VERSION, sizeof(version));
+    const npi_header* header = (const npi_header*)image;
+    bool valid = memcmp(header->magic, NPI_MAGIC, 4) == 0 && header->format == NPC_FORMAT
+            && memcmp(header->version, version, sizeof(version)) == 0
+            && header->byte_order == NPI_BYTE_ORDER && header->size == (uint64_t)size
+            && header->code_count <= INT32_MAX && header->constant_count <= UINT8_COUNT
+            && header->cache_count <= UINT16_MAX + 1 && header->max_stack <= INT32_MAX
+            && header->lines_offset % sizeof(int32_t) == 0
+            && header->constants_offset % sizeof(npi_constant) == 0
+            && within(header, header->code_offset, header->code_count)
+            && within(header, header->lines_offset, (uint64_t)header->code_count * sizeof(int32_t))
+            && within(header, header->constants_offset, (uint64_t)header->constant_count * sizeof(npi_constant))
+            && header->hash == hash_image(image, (size_t)size);
+    if (!valid) {
+        munmap(image, size);
+        return NULL;
+    }
+
+    chunk* loaded = (chunk*)calloc(1, sizeof(chunk));
+    loaded->image = image;
+    loaded->image_size = (size_t)size;
+    loaded->code = image + header->code_offset;
+    loaded->lines = (int*)(image + header->lines_offset);
+    loaded->count = loaded->capacity = (int)header->code_count;
+    loaded->max_stack = (int)header->max_stack;
+    loaded->cache_count = (int)header->cache_count;
+
+    const npi_constant* records = (const npi_constant*)(image + header->constants_offset);
+    for (uint32_t i = 0; valid && i < header->constant_count; i++) {
+        value val;
+        switch (records[i].type) {
+            case VAL_NIL:
+            case VAL_BOOL:
+            case VAL_NUMBER:
+            case VAL_INT:
+                val.type = (value_type)records[i].type;
+                memcpy(&val.as, &records[i].payload, sizeof(records[i].payload));
+                if (IS_BOOL(val))
+                    val = BOOL_VAL(records[i].payload != 0);
+                break;
+            case VAL_OBJ: {
+                valid = records[i].payload % 4 == 0 && within(header, records[i].payload, sizeof(npi_string));
+                if (!valid)
+                    break;
+                const npi_string* string = (const npi_string*)(image + records[i].payload);
+                const char* chars = (const char*)(string + 1);
+                valid = string->length <= INT32_MAX
+                        && within(header, records[i].payload + sizeof(npi_string), string->length)
+                        && hash_string(chars, (int)string->length) == string->hash;
+                if (!valid)
+                    break;
+                obj_string* interned = table_find_string(&vm->strings, chars, (int)string->length, string->hash);
+                if (!interned)
+                    interned = copy_string(vm, chars, (int)string->length);
+                val = OBJ_VAL(interned);
+                break;
+            }
+            default:
+                valid = false;
+                break;
+        }
+        if (valid)
+            add_constant(vm, loaded, val);
+    }
+
+    if (!valid || !verify_code(loaded)) {
+        free_chunk(vm, loaded);
+        return NULL;
+    }
+    loaded->caches = ALLOCATE(vm, MEMORY_CHUNKS, global_cache, loaded->cache_count);
+    if (loaded->cache_count > 0)
+        memset(loaded->caches, 0, sizeof(global_cache) * loaded->cache_count);
+    return loaded;
+}
+
+void free_image(chunk* chunk)
+{
+    munmap(chunk->image, chunk->image_size);
+}
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE /* fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "interpreter.h"
+#include "polity.h"
+
+/* EMBEDDING INTERFACE
+ *
+ * polity.h wraps a VM, its compiler state and a snapshot of its builtins.
+ * Each call's callbacks are adapted to the FILE* streams the VM writes
+ * through, and closed (so flushed) before the call returns. */
+
+struct polity_vm {
+    polity_interpreter interpreter;
+    table builtins; /* the globals polity_reset() restores */
+    struct obj* mark; /* objects older than this stay across resets */
+    bool yielded; /* a run is waiting for polity_resume() */
+};
+
+struct polity_program {
+    chunk* chunk;
+};
+
+struct polity_fiber {
+    fiber fiber;
+};
+
+typedef struct {
+    polity_write_fn write;
+    void* user_data;
+} polity_stream;
+
+static ssize_t write_stream(void* cookie, const char* text, size_t length)
+{
+    polity_stream* stream = (polity_stream*)cookie;
+    stream->write(stream->user_data, text, length);
+    return (ssize_t)length;
+}
+
+static int close_stream(void* cookie)
+{
+    free(cookie);
+    return 0;
+}
+
+/* A stream that hands what it is given to write, or fallback without one */
+static FILE* open_stream(polity_write_fn write, void* user_data, FILE* fallback)
+{
+    if (!write)
+        return fallback;
+
+    polity_stream* stream = (polity_stream*)malloc(sizeof(polity_stream));
+    stream->write = write;
+    stream->user_data = user_data;
+    cookie_io_functions_t functions = {NULL, write_stream, NULL, close_stream};
+    return fopencookie(stream, "w", functions);
+}
+
+static void begin_call(polity_vm* vm, const polity_io* io)
+{
+    VM* machine = vm->interpreter.vm;
+    machine->out = open_stream(io ? io->output : NULL, io ? io->user_data : NULL, stdout);
+    machine->err = open_stream(io ? io->errors : NULL, io ? io->user_data : NULL, stderr);
+}
+
+static void end_call(polity_vm* vm)
+{
+    VM* machine = vm->interpreter.vm;
+    if (machine->out != stdout)
+        fclose(machine->out);
+    if (machine->err != stderr)
+        fclose(machine->err);
+    machine->out = stdout;
+    machine->err = stderr;
+}
+
+polity_vm* polity_new(const polity_options* options)
+{
+    polity_vm* vm = (polity_vm*)calloc(1, sizeof(polity_vm));
+    VM* machine = vm->interpreter.vm = init_vm();
+    if (options) {
+        static const execution_engine engines[] = {
+            [POLITY_ENGINE_STACK] = ENGINE_STACK,
+            [POLITY_ENGINE_REGISTER] = ENGINE_REGISTER,
+            [POLITY_ENGINE_JIT] = ENGINE_JIT,
+        };
+        machine->engine = engines[options->engine];
+        machine->optimize = options->optimize;
+        machine->jobs = options->jobs;
+        machine->budget = options->fuel;
+        machine->memory.limit = options->memory_limit;
+    }
+
+    for (int i = 0; i < machine->globals.capacity; i++)
+        if (machine->globals.entries[i].key)
+            table_set(machine, &vm->builtins, machine->globals.entries[i].key, machine->globals.entries[i].value);
+    vm->mark = machine->objects;
+    return vm;
+}
+
+void polity_free(polity_vm* vm)
+{
+    free_table(vm->interpreter.vm, &vm->builtins);
+    free_vm(vm->interpreter.vm);
+    free(vm);
+}
+
+polity_program* polity_compile(polity_vm* vm, const char* source, const char* path, const polity_io* io)
+{
+    polity_interpreter* interpreter = &vm->interpreter;
+    begin_call(vm, io);
+    interpreter->path = path;
+    interpreter->chunk = (chunk*)calloc(1, sizeof(chunk));
+    char* text = strdup(source); /* the scanner takes a mutable buffer */
+    bool compiled = compile(text, interpreter);
+    free(text);
+    end_call(vm);
+
+    /* The program's strings must survive polity_reset() */
+    vm->mark = interpreter->vm->objects;
+    if (!compiled) {
+        free_chunk(interpreter->vm, interpreter->chunk);
+        return NULL;
+    }
+
+    polity_program* program = (polity_program*)malloc(sizeof(polity_program));
+    program->chunk = interpreter->chunk;
+    return program;
+}
+
+void polity_free_program(polity_vm* vm, polity_program* program)
+{
+    free_chunk(vm->interpreter.vm, program->chunk);
+    free(program);
+}
+
+static polity_status to_status(interpret_result result)
+{
+    if (result == INTERPRET_YIELD)
+        return POLITY_YIELD;
+    return result == INTERPRET_OK ? POLITY_OK : POLITY_RUNTIME_ERROR;
+}
+
+static polity_status status_of(polity_vm* vm, interpret_result result)
+{
+    vm->yielded = result == INTERPRET_YIELD;
+    return to_status(result);
+}
+
+polity_status polity_run(polity_vm* vm, polity_program* program, const polity_io* io)
+{
+    VM* machine = vm->interpreter.vm;
+    begin_call(vm, io);
+    machine->stack_top = machine->stack; /* a failed run may have left values behind */
+    interpret_result result = run_chunk(machine, program->chunk);
+    end_call(vm);
+    return status_of(vm, result);
+}
+
+polity_status polity_resume(polity_vm* vm, const polity_io* io)
+{
+    if (!vm->yielded)
+        return POLITY_OK;
+    begin_call(vm, io);
+    interpret_result result = resume_chunk(vm->interpreter.vm);
+    end_call(vm);
+    return status_of(vm, result);
+}
+
+polity_fiber* polity_fiber_new(polity_vm* vm, polity_program* program)
+{
+    polity_fiber* fiber = (polity_fiber*)malloc(sizeof(polity_fiber));
+    init_fiber(vm->interpreter.vm, &fiber->fiber, program->chunk);
+    return fiber;
+}
+
+polity_status polity_fiber_resume(polity_vm* vm, polity_fiber* fiber, const polity_io* io)
+{
+    begin_call(vm, io);
+    interpret_result result = resume_fiber(vm->interpreter.vm, &fiber->fiber);
+    end_call(vm);
+    return to_status(result);
+}
+
+void polity_fiber_free(polity_vm* vm, polity_fiber* fiber)
+{
+    free_fiber(vm->interpreter.vm, &fiber->fiber);
+    free(fiber);
+}
+
+void polity_memory_stats(polity_vm* vm, polity_memory* memory)
+{
+    memory_stats* stats = &vm->interpreter.vm->memory;
+    memory->strings = (polity_memory_usage){stats->current[MEMORY_STRINGS], stats->peak[MEMORY_STRINGS], stats->allocations[MEMORY_STRINGS]};
+    memory->tables = (polity_memory_usage){stats->current[MEMORY_TABLES], stats->peak[MEMORY_TABLES], stats->allocations[MEMORY_TABLES]};
+    memory->chunks = (polity_memory_usage){stats->current[MEMORY_CHUNKS], stats->peak[MEMORY_CHUNKS], stats->allocations[MEMORY_CHUNKS]};
+    memory->arrays = (polity_memory_usage){stats->current[MEMORY_ARRAYS], stats->peak[MEMORY_ARRAYS], stats->allocations[MEMORY_ARRAYS]};
+    memory->maps = (polity_memory_usage){stats->current[MEMORY_MAPS], stats->peak[MEMORY_MAPS], stats->allocations[MEMORY_MAPS]};
+    memory->stacks = (polity_memory_usage){stats->current[MEMORY_STACKS], stats->peak[MEMORY_STACKS], stats->allocations[MEMORY_STACKS]};
+    memory->files = (polity_memory_usage){stats->current[MEMORY_FILES], stats->peak[MEMORY_FILES], stats->allocations[MEMORY_FILES]};
+    memory->total = (polity_memory_usage){stats->total, stats->peak_total, 0};
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+        memory->total.allocations += stats->allocations[i];
+}
+
+void polity_reset(polity_vm* vm)
+{
+    vm->yielded = false;
+    reset_vm(vm->interpreter.vm, vm->mark, &vm->builtins);
+}
@@ -1,7 +1,7 @@
 #include "interpreter.h"
 
 /* COMPILER OPERATIONS */
-static parse_rule *get_rule(token_type type);
+static const parse_rule *get_rule(token_type type);
 static void grouping(polity_interpreter* interpreter);
 static void binary(polity_interpreter* interpreter);
 static void statement(polity_interpreter* interpreter);
@@ -9,6 +9,9 @@ static void declaration(polity_interpreter* interpreter);
 static uint8_t identifier_constant(polity_interpreter* interpreter, token* name);
 static int resolve_local(polity_interpreter* interpreter, token* name);
 static void and_(polity_interpreter* interpreter);
+static void call(polity_interpreter* interpreter);
+static void array_literal(polity_interpreter* interpreter);
+static void subscript(polity_interpreter* interpreter);
 
 static void error_at(parser *parser, token *token, const char *message)
 {
@@ -16,14 +19,14 @@ static void error_at(parser *parser, token *token, const char *message)
         return;
     parser->panic_mode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(parser->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
-        fprintf(stderr, " at end");
+        fprintf(parser->err, " at end");
     else if (token->type != TOKEN_ERROR)
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->err, " at '%.*s'", token->length, token->start);
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(parser->err, ": %s\n", message);
     parser->had_error = true;
 }
 
@@ -34,8 +37,9 @@ static void error(parser *parser, const char *message)
 
 obj_string* allocate_string(VM* vm, char* chars, int length, uint32_t hash)
 {
-    struct obj* obj = (struct obj*)malloc(sizeof(obj_string));
+    struct obj* obj = (struct obj*)ALLOCATE(vm, MEMORY_STRINGS, obj_string, 1);
     obj->type = OBJ_STRING;
+    obj->marked = false;
     obj->next = vm->objects;
     vm->objects = obj;
 
@@ -43,8 +47,9 @@ obj_string* allocate_string(VM* vm, char* chars, int length, uint32_t hash)
     str->length = length;
     str->chars = chars;
     str->hash = hash;
+    str->borrowed = false;
 
-    table_set(&vm->strings, str, NIL_VAL);
+    table_set(vm, &vm->strings, str, NIL_VAL);
 
     return str;
 }
@@ -61,7 +66,7 @@ uint32_t hash_string(const char* key, int length)
     return hash;
 }
 
-obj_string* copy_string(VM* vm, char* chars, int length)
+obj_string* copy_string(VM* vm, const char* chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
     obj_string* interned = table_find_string(&vm->strings, chars, length, hash);
@@ -70,7 +75,29 @@ obj_string* copy_string(VM* vm, char* chars, int length)
         return interned;
     }
 
-    return allocate_string(vm, chars, length, hash);
+    char* heap_chars = ALLOCATE(vm, MEMORY_STRINGS, char, length + 1);
+    memcpy(heap_chars, chars, length);
+    heap_chars[length] = '\0';
+
+    return allocate_string(vm, heap_chars, length, hash);
+}
+
+/* A string over chars, which must stay put and NUL-terminated for as long
+ * as the string is reachable. free_unreachable() gives survivors their own
+ * copy. Borrowed strings compare equal to interned ones by content but are
+ * never used as table keys. */
+obj_string* borrow_string(VM* vm, char* chars, int length)
+{
+    obj_string* str = ALLOCATE(vm, MEMORY_STRINGS, obj_string, 1);
+    str->obj.type = OBJ_STRING;
+    str->obj.marked = false;
+    str->obj.next = vm->objects;
+    vm->objects = (struct obj*)str;
+    str->length = length;
+    str->chars = chars;
+    str->hash = 0;
+    str->borrowed = true;
+    return str;
 }
 
 static void advance(polity_interpreter* interpreter)
@@ -93,7 +120,7 @@ static void consume(polity_interpreter* interpreter, token_type type, const char
         advance(interpreter);
         return;
     }
-    error_at(interpreter->parser, &interpreter->parser->previous, interpreter->parser->current.start);
+    error_at(interpreter->parser, &interpreter->parser->current, message);
 }
 
 static bool match(polity_interpreter* interpreter, token_type type)
@@ -105,9 +132,57 @@ static bool match(polity_interpreter* interpreter, token_type type)
     return true;
 }
 
+/* Net stack effect and operand length of each opcode, used to track the
+ * deepest stack a chunk can reach while it is emitted. */
+const int8_t stack_effect[UINT8_COUNT] = {
+    [OP_CONSTANT] = 1, [OP_NIL] = 1, [OP_TRUE] = 1, [OP_FALSE] = 1,
+    [OP_EQUAL] = -1, [OP_POP] = -1,
+    [OP_GET_LOCAL] = 1, [OP_SET_LOCAL] = 0,
+    [OP_GET_GLOBAL] = 1, [OP_DEFINE_GLOBAL] = -1, [OP_SET_GLOBAL] = 0,
+    [OP_GREATER] = -1, [OP_LESS] = -1,
+    [OP_ADD] = -1, [OP_SUBTRACT] = -1, [OP_MULTIPLY] = -1, [OP_DIVIDE] = -1,
+    [OP_NOT] = 0, [OP_NEGATE] = 0, [OP_PRINT] = -1,
+    [OP_JUMP] = 0, [OP_JUMP_IF_FALSE] = 0, [OP_LOOP] = 0,
+    [OP_CALL] = 0, /* minus the argument count operand */
+    [OP_ARRAY] = 1, /* minus the element count operand */
+    [OP_GET_INDEX] = -1, [OP_SET_INDEX] = -2,
+    [OP_MAP] = 1, /* minus twice the pair count operand */
+    [OP_DELETE_INDEX] = -1,
+    [OP_YIELD] = 0, [OP_RETURN] = 0,
+    [OP_ADD_NUM] = -1, [OP_ADD_STR] = -1, [OP_SUBTRACT_NUM] = -1,
+    [OP_MULTIPLY_NUM] = -1, [OP_DIVIDE_NUM] = -1,
+    [OP_GREATER_NUM] = -1, [OP_LESS_NUM] = -1,
+    [OP_ADD_INT] = -1, [OP_SUBTRACT_INT] = -1, [OP_MULTIPLY_INT] = -1,
+    [OP_GREATER_INT] = -1, [OP_LESS_INT] = -1,
+};
+
+const uint8_t operand_length[UINT8_COUNT] = {
+    [OP_CONSTANT] = 1, [OP_GET_LOCAL] = 1, [OP_SET_LOCAL] = 1,
+    [OP_GET_GLOBAL] = 3, [OP_DEFINE_GLOBAL] = 1, [OP_SET_GLOBAL] = 3,
+    [OP_JUMP] = 2, [OP_JUMP_IF_FALSE] = 2, [OP_LOOP] = 2,
+    [OP_CALL] = 1, [OP_ARRAY] = 1, [OP_MAP] = 1,
+};
+
 static void emit_byte(polity_interpreter* interpreter, uint8_t byte)
 {
-    write_chunk(interpreter->chunk, byte, interpreter->parser->previous.line);
+    compiler* compiler = interpreter->compiler;
+    chunk* chunk = interpreter->chunk;
+
+    if (compiler->operand_bytes > 0) {
+        compiler->operand_bytes--;
+        if (compiler->last_op == OP_CALL || compiler->last_op == OP_ARRAY)
+            compiler->stack_depth -= byte;
+        else if (compiler->last_op == OP_MAP)
+            compiler->stack_depth -= 2 * byte;
+    } else {
+        compiler->last_op = byte;
+        compiler->operand_bytes = operand_length[byte];
+        compiler->stack_depth += stack_effect[byte];
+        if (compiler->stack_depth > chunk->max_stack)
+            chunk->max_stack = compiler->stack_depth;
+    }
+
+    write_chunk(interpreter->vm, chunk, byte, interpreter->parser->previous.line);
 }
 
 static void emit_bytes(polity_interpreter* interpreter, uint8_t byte1, uint8_t byte2)
@@ -116,11 +191,14 @@ static void emit_bytes(polity_interpreter* interpreter, uint8_t byte1, uint8_t b
     emit_byte(interpreter, byte2);
 }
 
+/* Until patch_jump() fills in the real offset, the placeholder operand holds
+ * the stack depth at the jump, which is also the depth at its target. */
 static int emit_jump(polity_interpreter* interpreter, uint8_t instruction)
 {
     emit_byte(interpreter, instruction);
-    emit_byte(interpreter, 0xFF);
-    emit_byte(interpreter, 0xFF);
+    int depth = interpreter->compiler->stack_depth;
+    emit_byte(interpreter, (depth >> 8) & 0xFF);
+    emit_byte(interpreter, depth & 0xFF);
     return interpreter->chunk->count - 2;
 }
 
@@ -144,13 +222,14 @@ static void patch_jump(polity_interpreter* interpreter, int offset)
     if (jump > UINT16_MAX)
         error(interpreter->parser, "Too much code to jump over");
 
+    interpreter->compiler->stack_depth = (chunk->code[offset] << 8) | chunk->code[offset + 1];
     chunk->code[offset] = (jump >> 8) & 0xFF;
     chunk->code[offset + 1] = jump & 0xFF;
 }
 
 static uint8_t make_constant(polity_interpreter* interpreter, value val)
 {
-    int constant = add_constant(interpreter->chunk, val);
+    int constant = add_constant(interpreter->vm, interpreter->chunk, val);
     if (constant > UINT8_MAX) {
         error(interpreter->parser, "Too many constants in one chunk");
         return 0;
@@ -164,10 +243,20 @@ static void emit_constant(polity_interpreter* interpreter, value val)
     emit_bytes(interpreter, OP_CONSTANT, make_constant(interpreter, val));
 }
 
+/* Literals without a fraction are integers unless they overflow int64 */
 static void number(polity_interpreter* interpreter)
 {
-    emit_constant(interpreter,
-            NUMBER_VAL(strtod(interpreter->parser->previous.start, NULL)));
+    token* literal = &interpreter->parser->previous;
+    if (!memchr(literal->start, '.', literal->length)) {
+        errno = 0;
+        long long integer = strtoll(literal->start, NULL, 10);
+        if (errno != ERANGE) {
+            emit_constant(interpreter, INT_VAL(integer));
+            return;
+        }
+    }
+
+    emit_constant(interpreter, NUMBER_VAL(strtod(literal->start, NULL)));
 }
 
 static void parse_precedence(polity_interpreter* interpreter, precedence prec)
@@ -183,12 +272,17 @@ static void parse_precedence(polity_interpreter* interpreter, precedence prec)
     interpreter->can_assign = prec <= PREC_ASSIGNMENT;
     prefix_rule(interpreter);
 
+    /* Rules that parse nested expressions leave can_assign as the last of
+     * those set it, so it is put back before each infix rule */
     while (prec <= get_rule(parser->current.type)->prec) {
         advance(interpreter);
         parse_fn infix_rule = get_rule(parser->previous.type)->infix;
+        interpreter->can_assign = prec <= PREC_ASSIGNMENT;
         infix_rule(interpreter);
     }
 
+    interpreter->can_assign = prec <= PREC_ASSIGNMENT;
+
     if (interpreter->can_assign && match(interpreter, TOKEN_EQUAL))
         error(parser, "Invalid assignment target");
 }
@@ -234,6 +328,14 @@ static void named_variable(polity_interpreter* interpreter, token name)
         emit_bytes(interpreter, set_op, (uint8_t)arg);
     } else
         emit_bytes(interpreter, get_op, (uint8_t)arg);
+
+    /* Globals carry the index of their inline cache */
+    if (get_op == OP_GET_GLOBAL) {
+        int cache = interpreter->chunk->cache_count++;
+        if (cache > UINT16_MAX)
+            error(interpreter->parser, "Too many global variable accesses in one chunk");
+        emit_bytes(interpreter, (cache >> 8) & 0xFF, cache & 0xFF);
+    }
 }
 
 static void variable(polity_interpreter* interpreter)
@@ -313,6 +415,78 @@ static uint8_t parse_variable(polity_interpreter* interpreter, const char* messa
     return identifier_constant(interpreter, &interpreter->parser->previous);
 }
 
+static uint8_t argument_list(polity_interpreter* interpreter)
+{
+    uint8_t arg_count = 0;
+    if (interpreter->parser->current.type != TOKEN_RIGHT_PAREN) {
+        do {
+            expression(interpreter);
+            if (arg_count == 255)
+                error(interpreter->parser, "Can't have more than 255 arguments");
+            arg_count++;
+        } while (match(interpreter, TOKEN_COMMA));
+    }
+
+    consume(interpreter, TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+    return arg_count;
+}
+
+static void call(polity_interpreter* interpreter)
+{
+    uint8_t arg_count = argument_list(interpreter);
+    emit_bytes(interpreter, OP_CALL, arg_count);
+}
+
+static void array_literal(polity_interpreter* interpreter)
+{
+    uint8_t count = 0;
+    if (interpreter->parser->current.type != TOKEN_RIGHT_BRACKET) {
+        do {
+            expression(interpreter);
+            if (count == 255)
+                error(interpreter->parser, "Can't have more than 255 elements in an array literal");
+            count++;
+        } while (match(interpreter, TOKEN_COMMA));
+    }
+
+    consume(interpreter, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements");
+    emit_bytes(interpreter, OP_ARRAY, count);
+}
+
+/* {key: value, ...}. A '{' that starts a statement is a block instead. */
+static void map_literal(polity_interpreter* interpreter)
+{
+    uint8_t count = 0;
+    if (interpreter->parser->current.type != TOKEN_RIGHT_BRACE) {
+        do {
+            expression(interpreter);
+            consume(interpreter, TOKEN_COLON, "Expect ':' after map key");
+            expression(interpreter);
+            if (count == 255)
+                error(interpreter->parser, "Can't have more than 255 entries in a map literal");
+            count++;
+        } while (match(interpreter, TOKEN_COMMA));
+    }
+
+    consume(interpreter, TOKEN_RIGHT_BRACE, "Expect '}' after map entries");
+    emit_bytes(interpreter, OP_MAP, count);
+}
+
+/* a[i] and a[i] = value. Parsing the index clobbers can_assign, so it
+ * is read first. */
+static void subscript(polity_interpreter* interpreter)
+{
+    bool can_assign = interpreter->can_assign;
+    expression(interpreter);
+    consume(interpreter, TOKEN_RIGHT_BRACKET, "Expect ']' after index");
+
+    if (can_assign && match(interpreter, TOKEN_EQUAL)) {
+        expression(interpreter);
+        emit_byte(interpreter, OP_SET_INDEX);
+    } else
+        emit_byte(interpreter, OP_GET_INDEX);
+}
+
 static void unary(polity_interpreter* interpreter)
 {
     token_type operator_type = interpreter->parser->previous.type;
@@ -335,10 +509,12 @@ static void unary(polity_interpreter* interpreter)
 static void end_compiler(polity_interpreter* interpreter)
 {
     emit_byte(interpreter, OP_RETURN); /* Emit return */
-#ifdef DEBUG
-    if (!interpreter->parser->had_error)
-        disassemble_chunk(interpreter->chunk, "code");
-#endif
+    chunk* chunk = interpreter->chunk;
+    chunk->caches = ALLOCATE(interpreter->vm, MEMORY_CHUNKS, global_cache, chunk->cache_count);
+    if (chunk->cache_count > 0)
+        memset(chunk->caches, 0, sizeof(global_cache) * chunk->cache_count);
+    if (interpreter->vm->optimize && !interpreter->parser->had_error)
+        optimize_chunk(interpreter->vm, chunk);
 }
 
 static void begin_scope(compiler* compiler)
@@ -375,11 +551,14 @@ static void literal(polity_interpreter* interpreter)
     }
 }
 
-parse_rule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+static const parse_rule rules[] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map_literal, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {array_literal, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -388,7 +567,7 @@ parse_rule rules[] = {
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_NONE},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
     [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
@@ -400,11 +579,13 @@ parse_rule rules[] = {
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DELETE] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IMPORT] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
@@ -414,11 +595,12 @@ parse_rule rules[] = {
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-static parse_rule *get_rule(token_type type)
+static const parse_rule *get_rule(token_type type)
 {
     return &rules[type];
 }
@@ -426,7 +608,7 @@ static parse_rule *get_rule(token_type type)
 static void binary(polity_interpreter* interpreter)
 {
     token_type operator_type = interpreter->parser->previous.type;
-    parse_rule *rule = get_rule(operator_type);
+    const parse_rule *rule = get_rule(operator_type);
     parse_precedence(interpreter, (precedence)(rule->prec + 1));
 
     switch (operator_type)
@@ -519,6 +701,21 @@ static void var_declaration(polity_interpreter* interpreter)
     define_variable(interpreter, global);
 }
 
+/* import "module.np"; runs the module once, before this script. Paths are
+ * relative to the importing file. Nothing is emitted here: compile() links
+ * the modules' code in ahead of the script's. */
+static void import_declaration(polity_interpreter* interpreter)
+{
+    consume(interpreter, TOKEN_STRING, "Expect module path after 'import'");
+    token path = interpreter->parser->previous;
+    if (interpreter->compiler->scope_depth > 0)
+        error(interpreter->parser, "Can only import at top level");
+    consume(interpreter, TOKEN_SEMICOLON, "Expect ';' after import");
+
+    interpreter->imports = (char**)realloc(interpreter->imports, sizeof(char*) * (interpreter->import_count + 1));
+    interpreter->imports[interpreter->import_count++] = strndup(path.start + 1, path.length - 2);
+}
+
 static void expression_statement(polity_interpreter* interpreter)
 {
     expression(interpreter);
@@ -600,6 +797,27 @@ static void print_statement(polity_interpreter* interpreter)
     emit_byte(interpreter, OP_PRINT);
 }
 
+static void yield_statement(polity_interpreter* interpreter)
+{
+    consume(interpreter, TOKEN_SEMICOLON, "Expect ';' after 'yield'");
+    emit_byte(interpreter, OP_YIELD);
+}
+
+/* delete m[k]; compiles m[k] as a read, then turns the read into a delete */
+static void delete_statement(polity_interpreter* interpreter)
+{
+    compiler* compiler = interpreter->compiler;
+    parse_precedence(interpreter, PREC_CALL);
+    if (compiler->last_op != OP_GET_INDEX || compiler->operand_bytes > 0)
+        error(interpreter->parser, "Can only delete a subscript");
+    else {
+        interpreter->chunk->code[interpreter->chunk->count - 1] = OP_DELETE_INDEX;
+        compiler->last_op = OP_DELETE_INDEX;
+    }
+    consume(interpreter, TOKEN_SEMICOLON, "Expect ';' after delete");
+    emit_byte(interpreter, OP_POP);
+}
+
 static void synchronize(polity_interpreter* interpreter)
 {
     parser* parser = interpreter->parser;
@@ -611,13 +829,16 @@ static void synchronize(polity_interpreter* interpreter)
 
         switch (parser->current.type) {
             case TOKEN_CLASS:
+            case TOKEN_DELETE:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_IF:
+            case TOKEN_IMPORT:
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_YIELD:
                 return;
             default:
                 ;
@@ -631,6 +852,8 @@ static void declaration(polity_interpreter* interpreter)
 {
     if (match(interpreter, TOKEN_VAR))
         var_declaration(interpreter);
+    else if (match(interpreter, TOKEN_IMPORT))
+        import_declaration(interpreter);
     else
         statement(interpreter);
 
@@ -669,6 +892,10 @@ static void statement(polity_interpreter* interpreter)
         if_statement(interpreter);
     else if (match(interpreter, TOKEN_WHILE))
         while_statement(interpreter);
+    else if (match(interpreter, TOKEN_YIELD))
+        yield_statement(interpreter);
+    else if (match(interpreter, TOKEN_DELETE))
+        delete_statement(interpreter);
     else if (match(interpreter, TOKEN_LEFT_BRACE)) {
         begin_scope(interpreter->compiler);
         block(interpreter);
@@ -683,6 +910,9 @@ bool compile(char *source, polity_interpreter* interpreter)
     interpreter->scanner = init_scanner(source);
     interpreter->compiler = (compiler*)calloc(1, sizeof(compiler));
     interpreter->parser = (parser *)calloc(1, sizeof(parser));
+    interpreter->parser->err = interpreter->vm->err;
+    interpreter->imports = NULL;
+    interpreter->import_count = 0;
 
     advance(interpreter);
     
@@ -690,6 +920,20 @@ bool compile(char *source, polity_interpreter* interpreter)
         declaration(interpreter);
 
     end_compiler(interpreter);
+
+    /* Imported modules are compiled and linked in ahead of the script */
+    if (interpreter->import_count > 0 && !interpreter->module) {
+        if (!interpreter->parser->had_error && !link_imports(interpreter))
+            interpreter->parser->had_error = true;
+        for (int i = 0; i < interpreter->import_count; i++)
+            free(interpreter->imports[i]);
+        free(interpreter->imports);
+        interpreter->imports = NULL;
+    }
+#ifdef DEBUG
+    if (!interpreter->parser->had_error && !interpreter->module)
+        disassemble_chunk(interpreter->vm->out, interpreter->chunk, "code");
+#endif
  
     interpreter->can_assign = !interpreter->parser->had_error;
     free(interpreter->scanner);
@@ -699,12 +943,13 @@ bool compile(char *source, polity_interpreter* interpreter)
 }
 
 /* CHUNK OPERATIONS */
-void write_chunk(chunk* chunk, uint8_t byte, int line)
+void write_chunk(VM* vm, chunk* chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1) {
+        int old_capacity = chunk->capacity;
         chunk->capacity = (chunk->capacity) < 8 ? 8 : (chunk->capacity) * 2;
-        chunk->code = (uint8_t*)realloc(chunk->code, sizeof(uint8_t) * (chunk->capacity));
-        chunk->lines = (int*)realloc(chunk->lines, sizeof(int) * (chunk->capacity));
+        chunk->code = GROW_ARRAY(vm, MEMORY_CHUNKS, uint8_t, chunk->code, old_capacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, MEMORY_CHUNKS, int, chunk->lines, old_capacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
@@ -712,19 +957,29 @@ void write_chunk(chunk* chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
-void free_chunk(chunk* chunk)
+void free_chunk(VM* vm, chunk* chunk)
 {
-    free(chunk->code);
-    free(chunk->lines);
-    free(chunk->constants.values);
+    if (chunk->image)
+        free_image(chunk); /* code and lines live in the mapping */
+    else {
+        FREE_ARRAY(vm, MEMORY_CHUNKS, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, MEMORY_CHUNKS, int, chunk->lines, chunk->capacity);
+    }
+    FREE_ARRAY(vm, MEMORY_CHUNKS, value, chunk->constants.values, chunk->constants.capacity);
+    FREE_ARRAY(vm, MEMORY_CHUNKS, global_cache, chunk->caches, chunk->caches ? chunk->cache_count : 0);
+    FREE_ARRAY(vm, MEMORY_CHUNKS, uint32_t, chunk->back_edges, chunk->back_edges ? chunk->count : 0);
+    if (chunk->jit)
+        free_jit_code(chunk->jit);
     free(chunk);
 }
 
-int add_constant(chunk* chunk, value val)
+int add_constant(VM* vm, chunk* chunk, value val)
 {
-    if (chunk->constants.capacity < chunk->constants.count + 1) {
-        chunk->constants.capacity = (chunk->constants.capacity) < 8 ? 8 : (chunk->constants.capacity) * 2;
-        chunk->constants.values = (value*)realloc(chunk->constants.values, sizeof(value) * (chunk->constants.capacity));
+    value_array* constants = &chunk->constants;
+    if (constants->capacity < constants->count + 1) {
+        int old_capacity = constants->capacity;
+        constants->capacity = (constants->capacity) < 8 ? 8 : (constants->capacity) * 2;
+        constants->values = GROW_ARRAY(vm, MEMORY_CHUNKS, value, constants->values, old_capacity, constants->capacity);
     }
 
     chunk->constants.values[chunk->constants.count++] = val;
@@ -764,9 +1019,18 @@ bool table_get(table* table, obj_string* key, value* val)
     return true;
 }
 
-static void adjust_capacity(table* table, int capacity)
+entry* table_lookup(table* table, obj_string* key)
+{
+    if (table->count == 0)
+        return NULL;
+
+    entry* entry = find_entry(table->entries, table->capacity, key);
+    return entry->key == NULL ? NULL : entry;
+}
+
+static void adjust_capacity(VM* vm, table* table, int capacity)
 {
-    entry* entries = (entry*)malloc(sizeof(entry) * capacity);
+    entry* entries = ALLOCATE(vm, MEMORY_TABLES, entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -784,15 +1048,26 @@ static void adjust_capacity(table* table, int capacity)
         table->count++;
     }
 
+    FREE_ARRAY(vm, MEMORY_TABLES, entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
+    table->version++;
 }
 
-bool table_set(table* table, obj_string* key, value val)
+bool table_set(VM* vm, table* table, obj_string* key, value val)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = ((table->capacity) < 8 ? 8 : (table->capacity) * 2);
-        adjust_capacity(table, capacity);
+        /* Tombstones count toward the load. When they make up most of it,
+         * rehash in place so churn does not keep doubling the table. */
+        int live = 0;
+        for (int i = 0; i < table->capacity; i++)
+            live += table->entries[i].key != NULL;
+        int capacity = table->capacity;
+        if (capacity < 8)
+            capacity = 8;
+        else if (live + 1 > capacity * TABLE_MAX_LOAD / 2)
+            capacity *= 2;
+        adjust_capacity(vm, table, capacity);
     }
 
     entry* entry = find_entry(table->entries, table->capacity, key);
@@ -806,6 +1081,23 @@ bool table_set(table* table, obj_string* key, value val)
     return is_new_key;
 }
 
+void free_table(VM* vm, table* table)
+{
+    FREE_ARRAY(vm, MEMORY_TABLES, entry, table->entries, table->capacity);
+    table->entries = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+/* A top-level var. Under -n the script runs once per line and its
+ * declarations only take effect the first time. */
+void define_global(VM* vm, obj_string* name, value val)
+{
+    if (vm->keep_globals && table_lookup(&vm->globals, name))
+        return;
+    table_set(vm, &vm->globals, name, val);
+}
+
 bool table_delete(table* table, obj_string* key)
 {
     if (table->count == 0)
@@ -817,6 +1109,7 @@ bool table_delete(table* table, obj_string* key)
 
     entry->key = NULL;
     entry->value = BOOL_VAL(true);
+    table->version++;
 
     return true;
 }
@@ -886,6 +1179,8 @@ static token_type identifier_type(scanner* scanner)
             return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
         case 'c':
             return check_keyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+        case 'd':
+            return check_keyword(scanner, 1, 5, "elete", TOKEN_DELETE);
         case 'e':
             return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
@@ -901,7 +1196,15 @@ static token_type identifier_type(scanner* scanner)
             }
             break;
         case 'i':
-            return check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'f':
+                        return check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+                    case 'm':
+                        return check_keyword(scanner, 2, 4, "port", TOKEN_IMPORT);
+                }
+            }
+            break;
         case 'n':
             return check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
         case 'o':
@@ -926,6 +1229,8 @@ static token_type identifier_type(scanner* scanner)
             return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
         case 'w':
             return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+        case 'y':
+            return check_keyword(scanner, 1, 4, "ield", TOKEN_YIELD);
         }
     return TOKEN_IDENTIFIER;
 }
@@ -1032,7 +1337,10 @@ token scan_token(scanner* scanner)
     case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
     case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
     case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return make_token(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return make_token(scanner, TOKEN_RIGHT_BRACKET);
     case ';': return make_token(scanner, TOKEN_SEMICOLON);
+    case ':': return make_token(scanner, TOKEN_COLON);
     case ',': return make_token(scanner, TOKEN_COMMA);
     case '.': return make_token(scanner, TOKEN_DOT);
     case '-': return make_token(scanner, TOKEN_MINUS);
@@ -1050,110 +1358,171 @@ token scan_token(scanner* scanner)
 }
 
 /* DEBUGGER OPERATIONS */
-static int jump_instruction(const char* name, int sign, chunk* chunk, int offset)
+static int jump_instruction(FILE* out, const char* name, int sign, chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    fprintf(out, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
-int disassemble_instruction(chunk* chunk, int offset)
+int disassemble_instruction(FILE* out, chunk* chunk, int offset)
 {
-    printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) printf("   | ");
-    else printf("%4d ", chunk->lines[offset]);
+    fprintf(out, "%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) fprintf(out, "   | ");
+    else fprintf(out, "%4d ", chunk->lines[offset]);
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             uint8_t constant = chunk->code[offset + 1];
-            printf("%-16s %4d '%g'\n", "OP_CONSTANT", constant, AS_NUMBER(chunk->constants.values[constant]));
+            fprintf(out, "%-16s %4d '", "OP_CONSTANT", constant);
+            print_value(out, chunk->constants.values[constant]);
+            fprintf(out, "'\n");
             return offset + 2;
         case OP_NIL:
-            printf("OP_NIL\n");
+            fprintf(out, "OP_NIL\n");
             return offset + 1;
         case OP_TRUE:
-            printf("OP_TRUE\n");
+            fprintf(out, "OP_TRUE\n");
             return offset + 1;
         case OP_FALSE:
-            printf("OP_FALSE\n");
+            fprintf(out, "OP_FALSE\n");
             return offset + 1;
         case OP_POP:
-            printf("OP_POP");
+            fprintf(out, "OP_POP\n");
             return offset + 1;
         case OP_GET_LOCAL:
             uint8_t local_get = chunk->code[offset + 1];
-            printf("%-16s %4d\n", "OP_GET_LOCAL", local_get);
+            fprintf(out, "%-16s %4d\n", "OP_GET_LOCAL", local_get);
             return offset + 2;
         case OP_SET_LOCAL:
             uint8_t local_set = chunk->code[offset + 1];
-            printf("%-16s %4d\n", "OP_SET_LOCAL", local_set);
+            fprintf(out, "%-16s %4d\n", "OP_SET_LOCAL", local_set);
             return offset + 2;
         case OP_GET_GLOBAL:
             uint8_t global_get = chunk->code[offset + 1];
-            printf("%-16s %4d '%g'\n", "OP_GET_GLOBAL", global_get, AS_NUMBER(chunk->constants.values[global_get]));
-            return offset + 2;
+            fprintf(out, "%-16s %4d '%s'\n", "OP_GET_GLOBAL", global_get, AS_CSTRING(chunk->constants.values[global_get]));
+            return offset + 4;
         case OP_DEFINE_GLOBAL:
             uint8_t global_def = chunk->code[offset + 1];
-            printf("%-16s %4d '%g'\n", "OP_DEFINE_GLOBAL", global_def, AS_NUMBER(chunk->constants.values[global_def]));
+            fprintf(out, "%-16s %4d '%s'\n", "OP_DEFINE_GLOBAL", global_def, AS_CSTRING(chunk->constants.values[global_def]));
             return offset + 2;
         case OP_SET_GLOBAL:
             uint8_t global_set = chunk->code[offset + 1];
-            printf("%-16s %4d '%g'\n", "OP_SET_GLOBAL", global_set, AS_NUMBER(chunk->constants.values[global_set]));
-            return offset + 2;
+            fprintf(out, "%-16s %4d '%s'\n", "OP_SET_GLOBAL", global_set, AS_CSTRING(chunk->constants.values[global_set]));
+            return offset + 4;
         case OP_EQUAL:
-            printf("OP_EQUAL\n");
+            fprintf(out, "OP_EQUAL\n");
             return offset + 1;
         case OP_GREATER:
-            printf("OP_GREATER\n");
+            fprintf(out, "OP_GREATER\n");
             return offset + 1;
         case OP_LESS:
-            printf("OP_LESS\n");
+            fprintf(out, "OP_LESS\n");
             return offset + 1;
         case OP_ADD:
-            printf("OP_ADD\n");
+            fprintf(out, "OP_ADD\n");
             return offset + 1;
         case OP_SUBTRACT:
-            printf("OP_SUBTRACT\n");
+            fprintf(out, "OP_SUBTRACT\n");
             return offset + 1;
         case OP_MULTIPLY:
-            printf("OP_MULTIPLY\n");
+            fprintf(out, "OP_MULTIPLY\n");
             return offset + 1;
         case OP_DIVIDE:
-            printf("OP_DIVIDE\n");
+            fprintf(out, "OP_DIVIDE\n");
             return offset + 1;
         case OP_NOT:
-            printf("OP_NOT");
+            fprintf(out, "OP_NOT\n");
             return offset + 1;
         case OP_NEGATE:
-            printf("OP_NEGATE\n");
+            fprintf(out, "OP_NEGATE\n");
             return offset + 1;
         case OP_PRINT:
-            printf("OP_PRINT\n");
+            fprintf(out, "OP_PRINT\n");
             return offset + 1;
         case OP_JUMP:
-            return jump_instruction("OP_JUMP", 1, chunk, offset);
+            return jump_instruction(out, "OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jump_instruction(out, "OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", -1, chunk, offset);
+            return jump_instruction(out, "OP_LOOP", -1, chunk, offset);
+        case OP_CALL:
+            uint8_t arg_count = chunk->code[offset + 1];
+            fprintf(out, "%-16s %4d\n", "OP_CALL", arg_count);
+            return offset + 2;
+        case OP_ARRAY:
+            fprintf(out, "%-16s %4d\n", "OP_ARRAY", chunk->code[offset + 1]);
+            return offset + 2;
+        case OP_GET_INDEX:
+            fprintf(out, "OP_GET_INDEX\n");
+            return offset + 1;
+        case OP_MAP:
+            fprintf(out, "%-16s %4d\n", "OP_MAP", chunk->code[offset + 1]);
+            return offset + 2;
+        case OP_DELETE_INDEX:
+            fprintf(out, "OP_DELETE_INDEX\n");
+            return offset + 1;
+        case OP_SET_INDEX:
+            fprintf(out, "OP_SET_INDEX\n");
+            return offset + 1;
+        case OP_YIELD:
+            fprintf(out, "OP_YIELD\n");
+            return offset + 1;
         case OP_RETURN:
-            printf("OP_RETURN\n");
+            fprintf(out, "OP_RETURN\n");
+            return offset + 1;
+        case OP_ADD_NUM:
+            fprintf(out, "OP_ADD_NUM\n");
+            return offset + 1;
+        case OP_ADD_STR:
+            fprintf(out, "OP_ADD_STR\n");
+            return offset + 1;
+        case OP_SUBTRACT_NUM:
+            fprintf(out, "OP_SUBTRACT_NUM\n");
+            return offset + 1;
+        case OP_MULTIPLY_NUM:
+            fprintf(out, "OP_MULTIPLY_NUM\n");
+            return offset + 1;
+        case OP_DIVIDE_NUM:
+            fprintf(out, "OP_DIVIDE_NUM\n");
+            return offset + 1;
+        case OP_GREATER_NUM:
+            fprintf(out, "OP_GREATER_NUM\n");
+            return offset + 1;
+        case OP_LESS_NUM:
+            fprintf(out, "OP_LESS_NUM\n");
+            return offset + 1;
+        case OP_ADD_INT:
+            fprintf(out, "OP_ADD_INT\n");
+            return offset + 1;
+        case OP_SUBTRACT_INT:
+            fprintf(out, "OP_SUBTRACT_INT\n");
+            return offset + 1;
+        case OP_MULTIPLY_INT:
+            fprintf(out, "OP_MULTIPLY_INT\n");
+            return offset + 1;
+        case OP_GREATER_INT:
+            fprintf(out, "OP_GREATER_INT\n");
+            return offset + 1;
+        case OP_LESS_INT:
+            fprintf(out, "OP_LESS_INT\n");
             return offset + 1;
         default:
-            printf("Unknown opcode (%d)\n", instruction);
+            fprintf(out, "Unknown opcode (%d)\n", instruction);
     }
 
     return offset + 1;
 }
 
-void disassemble_chunk(chunk* chunk, const char* name)
+void disassemble_chunk(FILE* out, chunk* chunk, const char* name)
 {
-    printf("== %s ==\n", name);
+    fprintf(out, "== %s ==\n", name);
+    fprintf(out, "max stack depth: %d\n", chunk->max_stack);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(out, chunk, offset);
     }
 }
 
@@ -1163,23 +1532,90 @@ static inline value pop(VM* vm) { return *(--vm->stack_top); }
 static inline value peek(VM* vm, int distance) { return vm->stack_top[-1 - distance]; }
 static inline bool is_falsey(value val) { return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val)); }
 
-static interpret_result runtime_error(VM* vm, const char* format, ...)
+/* Both operand types folded into one word so specialized ops guard with a single compare */
+#define TYPE_PAIR(a, b) (((a).type << 3) | (b).type)
+#define NUMBER_PAIR ((VAL_NUMBER << 3) | VAL_NUMBER)
+#define INT_PAIR ((VAL_INT << 3) | VAL_INT)
+
+/* Rewrite the instruction just dispatched in place. Generic instructions do
+ * this after observing their operand types; specialized ones do it to
+ * deoptimize when their guard fails, rewinding so the generic form reruns. */
+static inline void quicken(VM* vm, uint8_t instruction)
+{
+    vm->ip[-1] = instruction;
+}
+
+/* The specialized form for the operands on top of the stack: one for two
+ * doubles, one for two integers, and the generic form for a mix */
+static inline uint8_t specialize(VM* vm, uint8_t generic, uint8_t numbers, uint8_t integers)
+{
+    switch (TYPE_PAIR(peek(vm, 1), peek(vm, 0))) {
+        case NUMBER_PAIR: return numbers;
+        case INT_PAIR: return integers;
+        default: return generic;
+    }
+}
+
+static inline void deoptimize(VM* vm, uint8_t instruction)
+{
+    if (vm->profile)
+        vm->profile->deopts[vm->ip[-1]]++;
+    vm->ip[-1] = instruction;
+    vm->ip--;
+}
+
+/* Make room for needed more values above stack_top. The stack is only ever
+ * checked here, on entry to a chunk, so push() can stay unchecked. False,
+ * with the stack as it was, when the memory limit or malloc says no. */
+bool ensure_stack(VM* vm, int needed)
+{
+    int depth = (int)(vm->stack_top - vm->stack);
+    if (depth + needed <= vm->stack_capacity)
+        return true;
+
+    int capacity = vm->stack_capacity;
+    while (capacity < depth + needed)
+        capacity *= 2;
+
+    if (!memory_available(vm, sizeof(value) * (capacity - vm->stack_capacity)))
+        return false;
+    value* stack = GROW_ARRAY(vm, MEMORY_STACKS, value, vm->stack, vm->stack_capacity, capacity);
+    if (stack == NULL)
+        return false;
+    vm->stack = stack;
+    vm->stack_capacity = capacity;
+
+    /* Fix up every pointer into the old stack */
+    vm->stack_top = vm->stack + depth;
+    return true;
+}
+
+interpret_result runtime_error(VM* vm, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    size_t instruction = vm->ip - vm->chunk->code - 1;
+    /* Before the first instruction, as when the stack cannot grow, blame
+     * the first line */
+    size_t instruction = vm->ip > vm->chunk->code ? (size_t)(vm->ip - vm->chunk->code - 1) : 0;
     int line = vm->chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    fprintf(vm->err, "[line %d] in script\n", line);
 
     return INTERPRET_RUNTIME_ERROR;
 }
 
-static bool values_equal(value a, value b)
+interpret_result out_of_memory(VM* vm)
+{
+    return runtime_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+}
+
+bool values_equal(value a, value b)
 {
+    if (IS_NUMERIC(a) && IS_NUMERIC(b) && a.type != b.type)
+        return TO_NUMBER(a) == TO_NUMBER(b);
     if (a.type != b.type) return false;
 
     switch (a.type) {
@@ -1189,7 +1625,12 @@ static bool values_equal(value a, value b)
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:
+            return AS_INT(a) == AS_INT(b);
         case VAL_OBJ:
+            /* Strings compare by content, everything else by identity */
+            if (!IS_STRING(a) || !IS_STRING(b))
+                return AS_OBJ(a) == AS_OBJ(b);
             return AS_STRING(a)->length == AS_STRING(b)->length &&
                     memcmp(AS_STRING(a)->chars, AS_STRING(b)->chars, AS_STRING(a)->length) == 0;
         default:
@@ -1197,59 +1638,205 @@ static bool values_equal(value a, value b)
     }
 }
 
+/* Arithmetic on two numbers of either kind. Integers stay integers while
+ * the result fits; division and everything else is computed in doubles. */
+value number_arithmetic(uint8_t op, value a, value b)
+{
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t x = AS_INT(a), y = AS_INT(b), result;
+        switch (op) {
+            case OP_ADD:
+                if (!__builtin_add_overflow(x, y, &result))
+                    return INT_VAL(result);
+                break;
+            case OP_SUBTRACT:
+                if (!__builtin_sub_overflow(x, y, &result))
+                    return INT_VAL(result);
+                break;
+            case OP_MULTIPLY:
+                if (!__builtin_mul_overflow(x, y, &result))
+                    return INT_VAL(result);
+                break;
+        }
+    }
+
+    double x = TO_NUMBER(a), y = TO_NUMBER(b);
+    switch (op) {
+        case OP_ADD: return NUMBER_VAL(x + y);
+        case OP_SUBTRACT: return NUMBER_VAL(x - y);
+        case OP_MULTIPLY: return NUMBER_VAL(x * y);
+        default: return NUMBER_VAL(x / y);
+    }
+}
+
+bool number_less(value a, value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) < AS_INT(b);
+    return TO_NUMBER(a) < TO_NUMBER(b);
+}
+
+value number_negate(value a)
+{
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN)
+        return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-TO_NUMBER(a));
+}
+
 static interpret_result check(VM* vm)
 {
-    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1)))
+    if (!IS_NUMERIC(peek(vm, 0)) || !IS_NUMERIC(peek(vm, 1)))
         return runtime_error(vm, "Operands must be numbers");
 
     return INTERPRET_OK;
 }
 
-static void print_value(value val)
+void print_value(FILE* out, value val)
 {
     switch (val.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(val) ? "true" : "false"); break;
+            fprintf(out, AS_BOOL(val) ? "true" : "false"); break;
         case VAL_NIL:
-            printf("nil"); break;
+            fprintf(out, "nil"); break;
         case VAL_NUMBER:
-            printf("%g", AS_NUMBER(val)); break;
+            fprintf(out, "%g", AS_NUMBER(val)); break;
+        case VAL_INT:
+            fprintf(out, "%lld", (long long)AS_INT(val)); break;
         case VAL_OBJ: 
             switch (OBJ_TYPE(val)) {
                 case OBJ_FUNCTION:
-                    printf("<fn %s>", AS_FUNCTION(val)->name->chars);
+                    fprintf(out, "<fn %s>", AS_FUNCTION(val)->name->chars);
+                    break;
+                case OBJ_NATIVE:
+                    fprintf(out, "<native fn %s>", AS_NATIVE(val)->name->chars);
                     break;
                 case OBJ_STRING:
-                    printf("%s", AS_CSTRING(val));
+                    fprintf(out, "%s", AS_CSTRING(val));
+                    break;
+                case OBJ_ARRAY:
+                case OBJ_NUMBER_ARRAY:
+                    print_array(out, AS_OBJ(val));
+                    break;
+                case OBJ_MAP:
+                    print_map(out, AS_OBJ(val));
                     break;
             }
             break;
     }
 }
 
-static void concatenate(VM* vm)
+/* The concatenation of a and b, or NULL if it would pass the memory limit.
+ * In a loop the result is usually interned already, so a short one is
+ * put together on the C stack and only copied to the heap when it is new. */
+obj_string* concatenate_strings(VM* vm, obj_string* a, obj_string* b)
 {
-    obj_string* b = AS_STRING(pop(vm));
-    obj_string* a = AS_STRING(pop(vm));
-
     int length = a->length + b->length;
-    char* chars = (char*)malloc(sizeof(char) * (length + 1));
+    if (!memory_available(vm, sizeof(obj_string) + length + 1))
+        return NULL;
+
+    char buffer[256];
+    char* chars = length < (int)sizeof(buffer) ? buffer : ALLOCATE(vm, MEMORY_STRINGS, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
     uint32_t hash = hash_string(chars, length);
-    obj_string* result = allocate_string(vm, chars, length, hash);
+    obj_string* interned = table_find_string(&vm->strings, chars, length, hash);
+    if (interned != NULL) {
+        if (chars != buffer)
+            FREE_ARRAY(vm, MEMORY_STRINGS, char, chars, length + 1);
+        return interned;
+    }
+
+    if (chars == buffer) {
+        chars = ALLOCATE(vm, MEMORY_STRINGS, char, length + 1);
+        memcpy(chars, buffer, length + 1);
+    }
+    return allocate_string(vm, chars, length, hash);
+}
+
+static bool concatenate(VM* vm)
+{
+    obj_string* b = AS_STRING(pop(vm));
+    obj_string* a = AS_STRING(pop(vm));
+    obj_string* result = concatenate_strings(vm, a, b);
+    if (!result)
+        return false;
     push(vm, OBJ_VAL(result));
+    return true;
+}
+
+/* Count a back edge to the loop header at vm->ip. Once the loop is hot the
+ * chunk is compiled and the loop carries on in machine code from its header.
+ * Compiled code addresses the same stack slots as run(), so the stack and
+ * locals are handed over as they are. JIT_EXIT means keep interpreting. */
+static jit_status tier_up(VM* vm)
+{
+    chunk* chunk = vm->chunk;
+    int header = (int)(vm->ip - chunk->code);
+    if (!chunk->back_edges) {
+        chunk->back_edges = ALLOCATE(vm, MEMORY_CHUNKS, uint32_t, chunk->count);
+        memset(chunk->back_edges, 0, sizeof(uint32_t) * chunk->count);
+    }
+    if (++chunk->back_edges[header] < HOT_LOOP)
+        return JIT_EXIT;
+    chunk->back_edges[header] = 0;
+
+    int line = chunk->lines[header];
+    if (!chunk->jit)
+        chunk->jit = jit_compile(chunk);
+    if (!chunk->jit) {
+        if (vm->trace_tiers)
+            fprintf(vm->err, "[tier] loop at line %d is hot, but this platform has no JIT\n", line);
+        vm->engine = ENGINE_STACK;
+        return JIT_EXIT;
+    }
+
+    if (vm->trace_tiers)
+        fprintf(vm->err, "[tier] loop at line %d hot after %d iterations, entering JIT at %04d\n", line, HOT_LOOP, header);
+
+    jit_status status = jit_run(vm, chunk->jit, header);
+    if (status == JIT_DEOPT) {
+        /* The code assumed operand types that no longer hold. Drop it, so
+         * the next tier-up compiles what run() has quickened since. */
+        if (vm->trace_tiers)
+            fprintf(vm->err, "[tier] deoptimized at %04d (line %d), discarding compiled code\n",
+                    (int)(vm->ip - chunk->code), chunk->lines[vm->ip - chunk->code]);
+        free_jit_code(chunk->jit);
+        chunk->jit = NULL;
+        return JIT_EXIT;
+    }
+    if (status == JIT_EXIT && vm->trace_tiers)
+        fprintf(vm->err, "[tier] side exit to interpreter at %04d (line %d)\n",
+                (int)(vm->ip - chunk->code), chunk->lines[vm->ip - chunk->code]);
+    return status;
 }
 
 static interpret_result run(VM* vm)
 {
-    double a, b;
+    value a, b;
+    int64_t integer;
     uint8_t instruction;
 
+    /* The compiler recorded the deepest stack this chunk can reach, so one
+     * check here covers every push below. */
+    if (!ensure_stack(vm, vm->chunk->max_stack))
+        return out_of_memory(vm);
+
+/* Back edges and calls burn fuel. With none left, stop in front of the
+ * instruction so resume_chunk() starts with it. */
+#define CONSUME_FUEL() \
+    if (--vm->fuel < 0) { \
+        vm->ip--; \
+        return INTERPRET_YIELD; \
+    }
+
     while (1) {
-        switch (instruction = (*vm->ip++)) {
+        instruction = *vm->ip++;
+        if (vm->profile)
+            vm->profile->executed[instruction]++;
+
+        switch (instruction) {
             case OP_CONSTANT:
                 value constant = vm->chunk->constants.values[(*vm->ip++)];
                 push(vm, constant);
@@ -1273,23 +1860,45 @@ static interpret_result run(VM* vm)
                 vm->stack[(*vm->ip++)] = peek(vm, 0);
                 break;
             case OP_GET_GLOBAL:
-                obj_string* global_name = AS_STRING(vm->chunk->constants.values[(*vm->ip++)]);
-                value val;
-                if (!table_get(&vm->globals, global_name, &val))
+                global_cache* get_cache = &vm->chunk->caches[(vm->ip[1] << 8) | vm->ip[2]];
+                if (get_cache->version == vm->globals.version) {
+                    vm->ip += 3;
+                    push(vm, vm->globals.entries[get_cache->index].value);
+                    break;
+                }
+
+                obj_string* global_name = AS_STRING(vm->chunk->constants.values[vm->ip[0]]);
+                vm->ip += 3;
+                entry* global_get = table_lookup(&vm->globals, global_name);
+                if (!global_get)
                     return runtime_error(vm, "Undefined variable '%s'", global_name->chars);
-                push(vm, val);
+
+                get_cache->version = vm->globals.version;
+                get_cache->index = (int)(global_get - vm->globals.entries);
+                push(vm, global_get->value);
                 break;
             case OP_DEFINE_GLOBAL:
                 obj_string* global_def = AS_STRING(vm->chunk->constants.values[(*vm->ip++)]);
-                table_set(&vm->globals, global_def, peek(vm, 0));
+                define_global(vm, global_def, peek(vm, 0));
                 pop(vm);
                 break;
             case OP_SET_GLOBAL:
-                obj_string* global_set = AS_STRING(vm->chunk->constants.values[(*vm->ip++)]);
-                if (table_set(&vm->globals, global_set, peek(vm, 0))) {
-                    table_delete(&vm->globals, global_set);
-                    return runtime_error(vm, "Undefined variable '%s'", global_set->chars);
+                global_cache* set_cache = &vm->chunk->caches[(vm->ip[1] << 8) | vm->ip[2]];
+                if (set_cache->version == vm->globals.version) {
+                    vm->ip += 3;
+                    vm->globals.entries[set_cache->index].value = peek(vm, 0);
+                    break;
                 }
+
+                obj_string* global_set = AS_STRING(vm->chunk->constants.values[vm->ip[0]]);
+                vm->ip += 3;
+                entry* global_entry = table_lookup(&vm->globals, global_set);
+                if (!global_entry)
+                    return runtime_error(vm, "Undefined variable '%s'", global_set->chars);
+
+                set_cache->version = vm->globals.version;
+                set_cache->index = (int)(global_entry - vm->globals.entries);
+                global_entry->value = peek(vm, 0);
                 break;
             case OP_EQUAL:
                 push(vm, BOOL_VAL(values_equal(pop(vm), pop(vm))));
@@ -1297,56 +1906,163 @@ static interpret_result run(VM* vm)
             case OP_GREATER:
                 if (check(vm))
                     return INTERPRET_RUNTIME_ERROR;
-                b = AS_NUMBER(pop(vm)); a = AS_NUMBER(pop(vm));
+                quicken(vm, specialize(vm, OP_GREATER, OP_GREATER_NUM, OP_GREATER_INT));
 
-                push(vm, NUMBER_VAL(a > b));
+                b = pop(vm); a = pop(vm);
+                push(vm, BOOL_VAL(number_less(b, a)));
                 break;
             case OP_LESS:
                 if (check(vm))
                     return INTERPRET_RUNTIME_ERROR;
+                quicken(vm, specialize(vm, OP_LESS, OP_LESS_NUM, OP_LESS_INT));
 
-                push(vm, NUMBER_VAL(a < b));
+                b = pop(vm); a = pop(vm);
+                push(vm, BOOL_VAL(number_less(a, b)));
                 break;
             case OP_ADD:
-                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1)))
-                    concatenate(vm);
-                else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
-                    push(vm, NUMBER_VAL(AS_NUMBER(pop(vm)) + AS_NUMBER(pop(vm))));
-                else
+                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    quicken(vm, OP_ADD_STR);
+                    if (!concatenate(vm))
+                        return out_of_memory(vm);
+                } else if (IS_NUMERIC(peek(vm, 0)) && IS_NUMERIC(peek(vm, 1))) {
+                    quicken(vm, specialize(vm, OP_ADD, OP_ADD_NUM, OP_ADD_INT));
+                    b = pop(vm); a = pop(vm);
+                    push(vm, number_arithmetic(OP_ADD, a, b));
+                } else
                     return runtime_error(vm, "Operands must be two numbers or two strings\n");
                 break;
             case OP_SUBTRACT:
-                if (check(vm))
-                    return INTERPRET_RUNTIME_ERROR;
-
-                b = AS_NUMBER(pop(vm)); a = AS_NUMBER(pop(vm));
-                push(vm, NUMBER_VAL(a - b));
-                break;
             case OP_MULTIPLY:
-                if (check(vm))
-                    return INTERPRET_RUNTIME_ERROR;
-
-                push(vm, NUMBER_VAL(AS_NUMBER(pop(vm)) * AS_NUMBER(pop(vm))));
-                break;
             case OP_DIVIDE:
                 if (check(vm))
                     return INTERPRET_RUNTIME_ERROR;
+                if (instruction == OP_SUBTRACT)
+                    quicken(vm, specialize(vm, OP_SUBTRACT, OP_SUBTRACT_NUM, OP_SUBTRACT_INT));
+                else if (instruction == OP_MULTIPLY)
+                    quicken(vm, specialize(vm, OP_MULTIPLY, OP_MULTIPLY_NUM, OP_MULTIPLY_INT));
+                else
+                    quicken(vm, specialize(vm, OP_DIVIDE, OP_DIVIDE_NUM, OP_DIVIDE));
 
-                b = AS_NUMBER(pop(vm)); a = AS_NUMBER(pop(vm));
-                push(vm, NUMBER_VAL(a / b));
+                b = pop(vm); a = pop(vm);
+                push(vm, number_arithmetic(instruction, a, b));
+                break;
+            case OP_ADD_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_ADD);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1].as.number += vm->stack_top[0].as.number;
+                break;
+            case OP_ADD_STR:
+                if (!(IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1)))) {
+                    deoptimize(vm, OP_ADD);
+                    break;
+                }
+                if (!concatenate(vm))
+                    return out_of_memory(vm);
+                break;
+            case OP_SUBTRACT_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_SUBTRACT);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1].as.number -= vm->stack_top[0].as.number;
+                break;
+            case OP_MULTIPLY_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_MULTIPLY);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1].as.number *= vm->stack_top[0].as.number;
+                break;
+            case OP_DIVIDE_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_DIVIDE);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1].as.number /= vm->stack_top[0].as.number;
+                break;
+            case OP_GREATER_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_GREATER);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1] = BOOL_VAL(vm->stack_top[-1].as.number > vm->stack_top[0].as.number);
+                break;
+            case OP_LESS_NUM:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != NUMBER_PAIR) {
+                    deoptimize(vm, OP_LESS);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1] = BOOL_VAL(vm->stack_top[-1].as.number < vm->stack_top[0].as.number);
+                break;
+            case OP_ADD_INT:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != INT_PAIR) {
+                    deoptimize(vm, OP_ADD);
+                    break;
+                }
+                vm->stack_top--;
+                if (__builtin_add_overflow(vm->stack_top[-1].as.integer, vm->stack_top[0].as.integer, &integer))
+                    vm->stack_top[-1] = number_arithmetic(OP_ADD, vm->stack_top[-1], vm->stack_top[0]);
+                else
+                    vm->stack_top[-1].as.integer = integer;
+                break;
+            case OP_SUBTRACT_INT:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != INT_PAIR) {
+                    deoptimize(vm, OP_SUBTRACT);
+                    break;
+                }
+                vm->stack_top--;
+                if (__builtin_sub_overflow(vm->stack_top[-1].as.integer, vm->stack_top[0].as.integer, &integer))
+                    vm->stack_top[-1] = number_arithmetic(OP_SUBTRACT, vm->stack_top[-1], vm->stack_top[0]);
+                else
+                    vm->stack_top[-1].as.integer = integer;
+                break;
+            case OP_MULTIPLY_INT:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != INT_PAIR) {
+                    deoptimize(vm, OP_MULTIPLY);
+                    break;
+                }
+                vm->stack_top--;
+                if (__builtin_mul_overflow(vm->stack_top[-1].as.integer, vm->stack_top[0].as.integer, &integer))
+                    vm->stack_top[-1] = number_arithmetic(OP_MULTIPLY, vm->stack_top[-1], vm->stack_top[0]);
+                else
+                    vm->stack_top[-1].as.integer = integer;
+                break;
+            case OP_GREATER_INT:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != INT_PAIR) {
+                    deoptimize(vm, OP_GREATER);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1] = BOOL_VAL(vm->stack_top[-1].as.integer > vm->stack_top[0].as.integer);
+                break;
+            case OP_LESS_INT:
+                if (TYPE_PAIR(peek(vm, 1), peek(vm, 0)) != INT_PAIR) {
+                    deoptimize(vm, OP_LESS);
+                    break;
+                }
+                vm->stack_top--;
+                vm->stack_top[-1] = BOOL_VAL(vm->stack_top[-1].as.integer < vm->stack_top[0].as.integer);
                 break;
             case OP_NOT:
                 push(vm, BOOL_VAL(is_falsey(pop(vm))));
                 break;
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(vm, 0)))
+                if (!IS_NUMERIC(peek(vm, 0)))
                     return runtime_error(vm, "Operand must be a number");
 
-                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                push(vm, number_negate(pop(vm)));
                 break;
             case OP_PRINT: 
-                print_value(pop(vm));
-                printf("\n");
+                print_value(vm->out, pop(vm));
+                fprintf(vm->out, "\n");
                 break;
             case OP_JUMP:
                 vm->ip += (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]));
@@ -1354,15 +2070,78 @@ static interpret_result run(VM* vm)
             case OP_JUMP_IF_FALSE:
                 if (is_falsey(peek(vm, 0)))
                     vm->ip += (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]));
+                else
+                    vm->ip += 2;
                 break;
             case OP_LOOP:
+                CONSUME_FUEL();
                 vm->ip -= (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | vm->ip[-1]));
+                if (vm->engine == ENGINE_JIT) {
+                    jit_status status = tier_up(vm);
+                    if (status != JIT_EXIT)
+                        return status == JIT_DONE ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            case OP_CALL:
+                CONSUME_FUEL();
+                uint8_t arg_count = *vm->ip++;
+                value callee = peek(vm, arg_count);
+                if (!IS_NATIVE(callee))
+                    return runtime_error(vm, "Can only call functions");
+
+                obj_native* native = AS_NATIVE(callee);
+                if (native->arity != -1 && native->arity != arg_count)
+                    return runtime_error(vm, "Expected %d arguments but got %d", native->arity, arg_count);
+
+                value result;
+                if (!native->function(vm, arg_count, vm->stack_top - arg_count, &result))
+                    return INTERPRET_RUNTIME_ERROR;
+
+                vm->stack_top -= arg_count + 1;
+                push(vm, result);
+                break;
+            case OP_ARRAY:
+                uint8_t count = *vm->ip++;
+                vm->stack_top -= count;
+                if (!make_array(vm, vm->stack_top, count, vm->stack_top))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm->stack_top++;
+                break;
+            case OP_GET_INDEX:
+                value element;
+                if (!get_index(vm, peek(vm, 1), peek(vm, 0), &element))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm->stack_top -= 2;
+                push(vm, element);
+                break;
+            case OP_SET_INDEX:
+                if (!set_index(vm, peek(vm, 2), peek(vm, 1), peek(vm, 0)))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm->stack_top[-3] = vm->stack_top[-1];
+                vm->stack_top -= 2;
                 break;
+            case OP_MAP:
+                uint8_t pair_count = *vm->ip++;
+                vm->stack_top -= 2 * pair_count;
+                if (!make_map(vm, vm->stack_top, pair_count, vm->stack_top))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm->stack_top++;
+                break;
+            case OP_DELETE_INDEX:
+                value existed;
+                if (!delete_index(vm, peek(vm, 1), peek(vm, 0), &existed))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm->stack_top -= 2;
+                push(vm, existed);
+                break;
+            case OP_YIELD:
+                return INTERPRET_YIELD; /* resume_chunk() picks up after it */
             case OP_RETURN:
                 /* Exit interpreter */
                 return INTERPRET_OK;
         }
     }
+#undef CONSUME_FUEL
 }
 
 VM* init_vm()
@@ -1370,6 +2149,8 @@ VM* init_vm()
     VM* vm = (VM*)calloc(1,sizeof(VM));
     vm->chunk = NULL;
     vm->ip = NULL;
+    vm->stack = ALLOCATE(vm, MEMORY_STACKS, value, STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
     vm->stack_top = vm->stack;
     vm->objects = NULL;
 
@@ -1380,60 +2161,472 @@ VM* init_vm()
     vm->globals.count = 0;
     vm->globals.capacity = 0;
     vm->globals.entries = NULL;
+    vm->globals.version = 1; /* never matches a fresh cache */
+    vm->out = stdout;
+    vm->err = stderr;
+
+    define_builtins(vm);
 
     return vm;
 }
 
+static void free_object(VM* vm, struct obj* object)
+{
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            obj_function* function = (obj_function*)object;
+            free(function->chunk.code);
+            free(function->chunk.lines);
+            free(function->chunk.constants.values);
+            free(function->chunk.caches);
+            free(function);
+            break;
+        }
+        case OBJ_NATIVE:
+            free(object);
+            break;
+        case OBJ_STRING: {
+            obj_string* str = (obj_string*)object;
+            if (!str->borrowed)
+                FREE_ARRAY(vm, MEMORY_STRINGS, char, str->chars, str->length + 1);
+            FREE(vm, MEMORY_STRINGS, obj_string, str);
+            break;
+        }
+        case OBJ_ARRAY: {
+            obj_array* array = (obj_array*)object;
+            FREE_ARRAY(vm, MEMORY_ARRAYS, value, array->values, array->capacity);
+            FREE(vm, MEMORY_ARRAYS, obj_array, array);
+            break;
+        }
+        case OBJ_NUMBER_ARRAY: {
+            obj_number_array* array = (obj_number_array*)object;
+            FREE_ARRAY(vm, MEMORY_ARRAYS, double, array->numbers, array->capacity);
+            FREE(vm, MEMORY_ARRAYS, obj_number_array, array);
+            break;
+        }
+        case OBJ_MAP: {
+            obj_map* map = (obj_map*)object;
+            FREE_ARRAY(vm, MEMORY_MAPS, map_entry, map->entries, map->capacity);
+            FREE_ARRAY(vm, MEMORY_MAPS, int32_t, map->slots, map->slot_count);
+            FREE(vm, MEMORY_MAPS, obj_map, map);
+            break;
+        }
+    }
+}
+
 void free_vm(VM* vm)
 {
     /* Free allocated strings */
 	struct obj* object = vm->objects;
 	while (object != NULL) {
 		struct obj* next = object->next;
-		switch (object->type) {
-            case OBJ_FUNCTION: {
-                obj_function* function = (obj_function*)object;
-                free_chunk(&function->chunk);
-                free((obj_function*)object);
-            }
-			case OBJ_STRING: {
-				obj_string* str = (obj_string*)object;
-				free(str->chars);
-				free(str);
-            }
-		}
+		free_object(vm, object);
 		object = next;
 	}
 
 	/* Free virtual machine */
-    free(vm->strings.entries);
-    free(vm->globals.entries);
+    free_io(vm);
+    if (vm->suspended)
+        free_reg_chunk(vm->suspended);
+    FREE_ARRAY(vm, MEMORY_STACKS, value, vm->stack, vm->stack_capacity);
+    free(vm->profile);
+    free_table(vm, &vm->strings);
+    free_table(vm, &vm->globals);
+    FREE_ARRAY(vm, MEMORY_ARRAYS, value, vm->remembered, vm->remembered_capacity);
 	free(vm);
 }
 
+/* Return the VM to the state it was in when vm->objects was mark: objects
+ * allocated since are freed, and the globals are replaced by builtins */
+void reset_vm(VM* vm, struct obj* mark, table* builtins)
+{
+    forget_writes(vm);
+    while (vm->objects != mark) {
+        struct obj* object = vm->objects;
+        vm->objects = object->next;
+        if (object->type == OBJ_STRING && !((obj_string*)object)->borrowed)
+            table_delete(&vm->strings, (obj_string*)object);
+        free_object(vm, object);
+    }
+
+    /* Empty the globals in place, keeping their storage */
+    for (int i = 0; i < vm->globals.capacity; i++) {
+        vm->globals.entries[i].key = NULL;
+        vm->globals.entries[i].value = NIL_VAL;
+    }
+    vm->globals.count = 0;
+    vm->globals.version++; /* stale caches must not match */
+    for (int i = 0; i < builtins->capacity; i++)
+        if (builtins->entries[i].key)
+            table_set(vm, &vm->globals, builtins->entries[i].key, builtins->entries[i].value);
+
+    close_files(vm);
+    if (vm->suspended) {
+        free_reg_chunk(vm->suspended);
+        vm->suspended = NULL;
+    }
+    vm->stack_top = vm->stack;
+    vm->chunk = NULL;
+    vm->ip = NULL;
+}
+
+/* Clear the mark of a candidate val reaches, and of those it holds */
+static void keep_value(value val)
+{
+    if (!IS_OBJ(val) || !AS_OBJ(val)->marked)
+        return;
+    AS_OBJ(val)->marked = false;
+    if (IS_ARRAY(val))
+        for (int i = 0; i < AS_ARRAY(val)->count; i++)
+            keep_value(AS_ARRAY(val)->values[i]);
+    if (IS_MAP(val))
+        for (int i = 0; i < AS_MAP(val)->used; i++) {
+            keep_value(AS_MAP(val)->entries[i].key);
+            keep_value(AS_MAP(val)->entries[i].value);
+        }
+}
+
+/* Free the objects allocated since mark that no global or remembered
+ * value reaches, and return how many are left. The VM has no collector, and a value is only
+ * reachable from a global or the stack, so this is safe between runs,
+ * when the stack is empty. Borrowed strings that survive get their own
+ * copy of their characters.
+ *
+ * Only objects newer than mark are candidates: they start marked, and
+ * whatever a global or a value stored in an array or map reaches is cleared. The walk
+ * stops at older objects, so it costs the objects made since mark rather
+ * than everything the globals hold. */
+size_t free_unreachable(VM* vm, struct obj* mark)
+{
+    size_t kept = 0;
+    for (struct obj* object = vm->objects; object != mark; object = object->next)
+        object->marked = true;
+    for (int i = 0; i < vm->globals.capacity; i++)
+        if (vm->globals.entries[i].key && IS_OBJ(vm->globals.entries[i].value))
+            keep_value(vm->globals.entries[i].value);
+    for (int i = 0; i < vm->remembered_count; i++)
+        keep_value(vm->remembered[i]);
+    forget_writes(vm);
+
+    struct obj** link = &vm->objects;
+    while (*link != mark) {
+        struct obj* object = *link;
+        if (!object->marked) {
+            if (object->type == OBJ_STRING && ((obj_string*)object)->borrowed) {
+                obj_string* str = (obj_string*)object;
+                char* chars = ALLOCATE(vm, MEMORY_STRINGS, char, str->length + 1);
+                memcpy(chars, str->chars, str->length + 1);
+                str->chars = chars;
+                str->hash = hash_string(chars, str->length);
+                str->borrowed = false;
+            }
+            link = &object->next;
+            kept++;
+            continue;
+        }
+
+        *link = object->next;
+        if (object->type == OBJ_STRING && !((obj_string*)object)->borrowed)
+            table_delete(&vm->strings, (obj_string*)object);
+        free_object(vm, object);
+    }
+    return kept;
+}
+
+static void refuel(VM* vm)
+{
+    vm->fuel = vm->budget > 0 ? vm->budget : INT64_MAX;
+}
+
+/* Run vm->chunk from vm->ip on the selected engine with a full tank. A
+ * yielded register run keeps its translation in vm->suspended. */
+static interpret_result refuel_and_run(VM* vm)
+{
+    refuel(vm);
+    if (vm->engine != ENGINE_REGISTER)
+        return run(vm); /* ENGINE_JIT tiers up from here */
+
+    reg_chunk* code = vm->suspended;
+    int start = vm->suspended_at;
+    vm->suspended = NULL;
+    if (!code) {
+        code = compile_registers(vm->chunk);
+        start = 0;
+#ifdef DEBUG_REGISTERS
+        disassemble_registers(vm->out, code, "registers");
+#endif
+    }
+
+    interpret_result result = run_registers(vm, code, start);
+    if (result == INTERPRET_YIELD)
+        vm->suspended = code;
+    else
+        free_reg_chunk(code);
+    return result;
+}
+
+/* Run a compiled chunk on the selected engine, leaving the chunk alive.
+ * With a budget, returns INTERPRET_YIELD once it is spent. */
+interpret_result run_chunk(VM* vm, chunk* chunk)
+{
+    if (vm->suspended) {
+        free_reg_chunk(vm->suspended);
+        vm->suspended = NULL;
+    }
+    vm->chunk = chunk;
+    vm->ip = chunk->code;
+    return refuel_and_run(vm);
+}
+
+/* Carry on with a run that returned INTERPRET_YIELD, on a fresh budget */
+interpret_result resume_chunk(VM* vm)
+{
+    return refuel_and_run(vm);
+}
+
+/* Run chunk to the end on register code translated from it once by the
+ * caller, for callers that run the same chunk many times */
+interpret_result run_translated(VM* vm, chunk* chunk, reg_chunk* code)
+{
+    vm->chunk = chunk;
+    vm->ip = chunk->code;
+    refuel(vm);
+    interpret_result result = run_registers(vm, code, 0);
+    while (result == INTERPRET_YIELD) {
+        refuel(vm);
+        result = run_registers(vm, code, vm->suspended_at);
+    }
+    return result;
+}
+
+/* FIBERS
+ *
+ * Fibers let one VM interleave many runs. Each owns a value stack and an
+ * instruction pointer and shares the VM's globals and strings. Switching
+ * exchanges the handful of VM fields that describe the current run with
+ * the fiber's, so no OS thread or C stack is involved. */
+
+void init_fiber(VM* vm, fiber* fiber, chunk* chunk)
+{
+    fiber->chunk = chunk;
+    fiber->ip = chunk->code;
+    fiber->stack_capacity = chunk->max_stack > 0 ? chunk->max_stack : 1;
+    fiber->stack = ALLOCATE(vm, MEMORY_STACKS, value, fiber->stack_capacity);
+    fiber->stack_top = fiber->stack;
+    fiber->suspended = NULL;
+    fiber->suspended_at = 0;
+    fiber->status = INTERPRET_YIELD;
+}
+
+static void switch_fiber(VM* vm, fiber* fiber)
+{
+#define SWAP(type, field) { type saved = vm->field; vm->field = fiber->field; fiber->field = saved; }
+    SWAP(chunk*, chunk);
+    SWAP(uint8_t*, ip);
+    SWAP(value*, stack);
+    SWAP(value*, stack_top);
+    SWAP(int, stack_capacity);
+    SWAP(reg_chunk*, suspended);
+    SWAP(int, suspended_at);
+#undef SWAP
+}
+
+/* Run fiber until it yields, runs out of fuel or finishes. A finished
+ * fiber keeps returning how it finished. */
+interpret_result resume_fiber(VM* vm, fiber* fiber)
+{
+    if (fiber->status != INTERPRET_YIELD)
+        return fiber->status;
+
+    switch_fiber(vm, fiber);
+    fiber->status = resume_chunk(vm);
+    switch_fiber(vm, fiber);
+    return fiber->status;
+}
+
+void free_fiber(VM* vm, fiber* fiber)
+{
+    if (fiber->suspended)
+        free_reg_chunk(fiber->suspended);
+    FREE_ARRAY(vm, MEMORY_STACKS, value, fiber->stack, fiber->stack_capacity);
+}
+
+static interpret_result execute(polity_interpreter* interpreter)
+{
+    if (interpreter->line_mode) {
+        interpret_result result = run_lines(interpreter->vm, interpreter->chunk, fileno(stdin));
+        free_chunk(interpreter->vm, interpreter->chunk);
+        return result;
+    }
+
+    interpret_result result = run_chunk(interpreter->vm, interpreter->chunk);
+    while (result == INTERPRET_YIELD)
+        result = resume_chunk(interpreter->vm);
+    free_chunk(interpreter->vm, interpreter->chunk);
+    return result;
+}
+
 interpret_result interpret(polity_interpreter* interpreter, char* source)
 {
     interpreter->chunk = (chunk*)calloc(1, sizeof(chunk));
 
     if (!compile(source, interpreter)) {
-        free_chunk(interpreter->chunk);
+        free_chunk(interpreter->vm, interpreter->chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    interpreter->vm->chunk = interpreter->chunk;
-    interpreter->vm->ip = interpreter->chunk->code;
+    return execute(interpreter);
+}
 
-    interpret_result result = run(interpreter->vm);
+/* As interpret(), but reuse the chunk cached at cache_path when it was
+ * compiled from this same source, and refresh the cache otherwise */
+interpret_result interpret_cached(polity_interpreter* interpreter, char* source, const char* cache_path)
+{
+    VM* vm = interpreter->vm;
+    interpreter->chunk = load_cached_chunk(vm, cache_path, source, vm->optimize);
+    if (interpreter->chunk) {
+#ifdef DEBUG
+        disassemble_chunk(interpreter->vm->out, interpreter->chunk, "code");
+#endif
+        return execute(interpreter);
+    }
 
-    free_chunk(interpreter->chunk);
-    return result;
+    interpreter->chunk = (chunk*)calloc(1, sizeof(chunk));
+    if (!compile(source, interpreter)) {
+        free_chunk(interpreter->vm, interpreter->chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    /* The cache is keyed on this script alone, so programs with imports skip it */
+    if (interpreter->import_count == 0)
+        save_cached_chunk(interpreter->chunk, cache_path, source, vm->optimize);
+    return execute(interpreter);
+}
+
+/* Read a whole script into a NUL-terminated buffer, or NULL if it cannot be opened */
+char* read_file(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(file_size + 1);
+    size_t read = fread(buffer, sizeof(char), file_size, file);
+    buffer[read] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+/* Compile source into an image at image_path without running it */
+interpret_result compile_image(polity_interpreter* interpreter, char* source, const char* image_path)
+{
+    interpreter->chunk = (chunk*)calloc(1, sizeof(chunk));
+    if (!compile(source, interpreter)) {
+        free_chunk(interpreter->vm, interpreter->chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    bool saved = save_image(interpreter->chunk, image_path);
+    free_chunk(interpreter->vm, interpreter->chunk);
+    if (!saved) {
+        fprintf(stderr, "Could not write image \"%s\".\n", image_path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return INTERPRET_OK;
+}
+
+/* Map the image at image_path and run it */
+interpret_result interpret_image(polity_interpreter* interpreter, const char* image_path)
+{
+    interpreter->chunk = load_image(interpreter->vm, image_path);
+    if (!interpreter->chunk) {
+        fprintf(stderr, "Invalid image \"%s\".\n", image_path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+#ifdef DEBUG
+    disassemble_chunk(interpreter->vm->out, interpreter->chunk, "code");
+#endif
+    return execute(interpreter);
+}
+
+/* Report how often each quickened instruction ran in its specialized form */
+void print_profile(VM* vm)
+{
+    static const struct {
+        uint8_t generic;
+        const char* name;
+        uint8_t specialized[3];
+        const char* specialized_names[3];
+    } families[] = {
+        {OP_ADD, "OP_ADD", {OP_ADD_NUM, OP_ADD_INT, OP_ADD_STR}, {"OP_ADD_NUM", "OP_ADD_INT", "OP_ADD_STR"}},
+        {OP_SUBTRACT, "OP_SUBTRACT", {OP_SUBTRACT_NUM, OP_SUBTRACT_INT}, {"OP_SUBTRACT_NUM", "OP_SUBTRACT_INT"}},
+        {OP_MULTIPLY, "OP_MULTIPLY", {OP_MULTIPLY_NUM, OP_MULTIPLY_INT}, {"OP_MULTIPLY_NUM", "OP_MULTIPLY_INT"}},
+        {OP_DIVIDE, "OP_DIVIDE", {OP_DIVIDE_NUM}, {"OP_DIVIDE_NUM"}},
+        {OP_GREATER, "OP_GREATER", {OP_GREATER_NUM, OP_GREATER_INT}, {"OP_GREATER_NUM", "OP_GREATER_INT"}},
+        {OP_LESS, "OP_LESS", {OP_LESS_NUM, OP_LESS_INT}, {"OP_LESS_NUM", "OP_LESS_INT"}},
+    };
+    profile_stats* profile = vm->profile;
+
+    fprintf(stderr, "== profile ==\n");
+    for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+        uint64_t generic = profile->executed[families[i].generic];
+        uint64_t hits = 0;
+        for (int j = 0; j < 3 && families[i].specialized_names[j]; j++) {
+            uint8_t op = families[i].specialized[j];
+            hits += profile->executed[op] - profile->deopts[op];
+        }
+        if (generic + hits == 0)
+            continue;
+
+        fprintf(stderr, "%-16s generic %8llu  hit rate %6.2f%%\n", families[i].name,
+                (unsigned long long)generic, 100.0 * hits / (generic + hits));
+        for (int j = 0; j < 3 && families[i].specialized_names[j]; j++) {
+            uint8_t op = families[i].specialized[j];
+            fprintf(stderr, "  %-16s %8llu  deopts %llu\n", families[i].specialized_names[j],
+                    (unsigned long long)(profile->executed[op] - profile->deopts[op]),
+                    (unsigned long long)profile->deopts[op]);
+        }
+    }
 }
 
 obj_function* new_function()
 {
     struct obj* object = (struct obj*)calloc(1, sizeof(obj_function));
     object->type = OBJ_FUNCTION;
+    object->marked = false;
     obj_function* function = (obj_function*)object;
 
     return function;
-}
\ No newline at end of file
+}
+void define_native(VM* vm, const char* name, int arity, native_fn function)
+{
+    struct obj* object = (struct obj*)malloc(sizeof(obj_native));
+    object->type = OBJ_NATIVE;
+    object->marked = false;
+    object->next = vm->objects;
+    vm->objects = object;
+
+    obj_native* native = (obj_native*)object;
+    native->arity = arity;
+    native->function = function;
+    native->name = copy_string(vm, name, (int)strlen(name));
+
+    table_set(vm, &vm->globals, native->name, OBJ_VAL(native));
+}
+
+void native_error(VM* vm, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputs("\n", vm->err);
+
+    size_t instruction = vm->ip - vm->chunk->code - 1;
+    fprintf(vm->err, "[line %d] in script\n", vm->chunk->lines[instruction]);
+}
@@ -0,0 +1,875 @@
+#define _GNU_SOURCE /* open_memstream */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+
+/* FILE STREAMS
+ *
+ * Scripts open files as integer handles and read them a line at a time
+ * or write them in pieces. Every stream owns two blocks: while the script
+ * works through one, the other is being read ahead or written behind, so
+ * the disk and the interpreter overlap.
+ *
+ * Blocks move through one of three backends. io_uring submits them to the
+ * kernel without a thread per transfer; where the kernel refuses, a small
+ * pool of threads runs pread() and pwrite() instead. The blocking backend
+ * transfers each block when it is submitted, and is the baseline the
+ * others are measured against. */
+
+#define IO_BLOCK (128 * 1024)
+#define IO_QUEUE_DEPTH 64
+#define IO_WORKERS 2
+
+typedef struct io_request {
+    int fd;
+    bool write;
+    char* buffer;
+    size_t length; /* bytes wanted */
+    size_t transferred; /* bytes moved so far */
+    off_t offset;
+    ssize_t last; /* result of the most recent transfer */
+    int error; /* errno of a failed transfer, 0 otherwise */
+    bool busy; /* submitted and not yet completed */
+    struct io_request* next; /* thread pool queue */
+} io_request;
+
+typedef struct {
+    int fd;
+    bool writing;
+    io_request requests[2];
+    char* buffers[2];
+    int current; /* the block the script is using */
+    size_t position; /* next unread byte of a read block, or bytes in a write block */
+    off_t offset; /* where the next block is read from or written to */
+    bool loaded; /* the current read block has arrived */
+    bool ended; /* every byte of the file has been read */
+    char* line; /* a line split across blocks */
+    int line_length;
+    int line_capacity;
+} io_stream;
+
+struct io_context {
+    io_backend backend;
+
+    /* io_uring */
+    int ring;
+    unsigned entries;
+    unsigned in_flight;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_size;
+    void* cq_map;
+    size_t cq_size;
+    size_t sqes_size;
+
+    /* thread pool */
+    pthread_t threads[IO_WORKERS];
+    pthread_mutex_t lock; /* guards the queue and every request's busy flag */
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    io_request* head;
+    io_request* tail;
+    bool stopping;
+
+    io_stream** streams; /* indexed by handle, NULL once closed */
+    int stream_capacity;
+};
+
+/* Record the result of one pread() or pwrite(), or -errno */
+static void complete(io_request* request, ssize_t result)
+{
+    request->last = result;
+    if (result < 0)
+        request->error = (int)-result;
+    else
+        request->transferred += result;
+    request->busy = false;
+}
+
+/* Move the rest of request's bytes with one blocking call */
+static ssize_t transfer(io_request* request)
+{
+    char* buffer = request->buffer + request->transferred;
+    size_t length = request->length - request->transferred;
+    off_t offset = request->offset + request->transferred;
+    ssize_t result = request->write ? pwrite(request->fd, buffer, length, offset)
+                                    : pread(request->fd, buffer, length, offset);
+    return result < 0 ? -errno : result;
+}
+
+/* IO_URING */
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static bool open_ring(struct io_context* io)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = io_uring_setup(IO_QUEUE_DEPTH, &params);
+    if (ring < 0)
+        return false;
+    /* IORING_OP_READ and IORING_OP_WRITE arrived with this feature */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring);
+        return false;
+    }
+
+    io->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && io->cq_size > io->sq_size)
+        io->sq_size = io->cq_size;
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    io->sq_map = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    io->cq_map = single ? io->sq_map
+                        : mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    io->sqes = (struct io_uring_sqe*)mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (io->sq_map == MAP_FAILED || io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sq_map != MAP_FAILED)
+            munmap(io->sq_map, io->sq_size);
+        if (!single && io->cq_map != MAP_FAILED)
+            munmap(io->cq_map, io->cq_size);
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, io->sqes_size);
+        close(ring);
+        return false;
+    }
+
+    char* sq = (char*)io->sq_map;
+    char* cq = (char*)io->cq_map;
+    io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    io->entries = params.sq_entries;
+    io->ring = ring;
+    return true;
+}
+
+static void close_ring(struct io_context* io)
+{
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_map != io->sq_map)
+        munmap(io->cq_map, io->cq_size);
+    munmap(io->sq_map, io->sq_size);
+    close(io->ring);
+}
+
+/* Complete every request the kernel has finished, first waiting for at
+ * least one if wait is set */
+static void reap_ring(struct io_context* io, bool wait)
+{
+    if (wait)
+        io_uring_enter(io->ring, 0, 1, IORING_ENTER_GETEVENTS);
+
+    unsigned head = *io->cq_head;
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+        complete((io_request*)(uintptr_t)cqe->user_data, cqe->res);
+        io->in_flight--;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void submit_ring(struct io_context* io, io_request* request)
+{
+    while (io->in_flight >= io->entries)
+        reap_ring(io, true);
+
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (uintptr_t)(request->buffer + request->transferred);
+    sqe->len = (unsigned)(request->length - request->transferred);
+    sqe->off = request->offset + request->transferred;
+    sqe->user_data = (uintptr_t)request;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->in_flight++;
+
+    /* A full completion queue refuses submissions until it is drained */
+    while (io_uring_enter(io->ring, 1, 0, 0) < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            reap_ring(io, false);
+            continue;
+        }
+        /* Any other failure submitted nothing: take the entry back and
+         * move the bytes with a blocking call, so the request still
+         * completes rather than waiting forever */
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+        io->in_flight--;
+        complete(request, transfer(request));
+        return;
+    }
+}
+
+/* THREAD POOL */
+static void* io_worker(void* argument)
+{
+    struct io_context* io = (struct io_context*)argument;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->head && !io->stopping)
+            pthread_cond_wait(&io->queued, &io->lock);
+        if (!io->head)
+            break;
+        io_request* request = io->head;
+        io->head = request->next;
+        if (!io->head)
+            io->tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        ssize_t result = transfer(request);
+        pthread_mutex_lock(&io->lock);
+        complete(request, result);
+        pthread_cond_broadcast(&io->finished);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void start_pool(struct io_context* io)
+{
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->queued, NULL);
+    pthread_cond_init(&io->finished, NULL);
+    for (int i = 0; i < IO_WORKERS; i++)
+        pthread_create(&io->threads[i], NULL, io_worker, io);
+}
+
+static void stop_pool(struct io_context* io)
+{
+    pthread_mutex_lock(&io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->queued);
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < IO_WORKERS; i++)
+        pthread_join(io->threads[i], NULL);
+    pthread_cond_destroy(&io->finished);
+    pthread_cond_destroy(&io->queued);
+    pthread_mutex_destroy(&io->lock);
+}
+
+/* REQUESTS */
+static void start_request(struct io_context* io, io_request* request)
+{
+    request->busy = true;
+    request->last = 0;
+    switch (io->backend) {
+        case IO_URING:
+            submit_ring(io, request);
+            break;
+        case IO_THREADS:
+            pthread_mutex_lock(&io->lock);
+            request->next = NULL;
+            if (io->tail)
+                io->tail->next = request;
+            else
+                io->head = request;
+            io->tail = request;
+            pthread_cond_signal(&io->queued);
+            pthread_mutex_unlock(&io->lock);
+            break;
+        case IO_BLOCKING:
+            complete(request, transfer(request));
+            break;
+    }
+}
+
+/* Whether request has completed, without waiting for it */
+static bool poll_request(struct io_context* io, io_request* request)
+{
+    bool busy;
+    switch (io->backend) {
+        case IO_URING:
+            reap_ring(io, false);
+            return !request->busy;
+        case IO_THREADS:
+            pthread_mutex_lock(&io->lock);
+            busy = request->busy;
+            pthread_mutex_unlock(&io->lock);
+            return !busy;
+        default:
+            return true;
+    }
+}
+
+/* Wait until request has moved all its bytes, reached the end of the
+ * file or failed, resubmitting the rest after a short transfer */
+static void finish_request(struct io_context* io, io_request* request)
+{
+    for (;;) {
+        if (io->backend == IO_URING) {
+            while (request->busy)
+                reap_ring(io, true);
+        } else if (io->backend == IO_THREADS) {
+            pthread_mutex_lock(&io->lock);
+            while (request->busy)
+                pthread_cond_wait(&io->finished, &io->lock);
+            pthread_mutex_unlock(&io->lock);
+        }
+
+        if (request->error || request->transferred == request->length || request->last == 0)
+            return;
+        start_request(io, request);
+    }
+}
+
+/* STREAMS */
+static struct io_context* io_context(VM* vm)
+{
+    if (vm->io)
+        return vm->io;
+
+    struct io_context* io = (struct io_context*)calloc(1, sizeof(struct io_context));
+    io->backend = vm->io_backend;
+    if (io->backend == IO_URING && !open_ring(io))
+        io->backend = IO_THREADS;
+    if (io->backend == IO_THREADS)
+        start_pool(io);
+    vm->io = io;
+    return io;
+}
+
+static int add_stream(struct io_context* io, io_stream* stream)
+{
+    int handle = 0;
+    while (handle < io->stream_capacity && io->streams[handle])
+        handle++;
+    if (handle == io->stream_capacity) {
+        int capacity = io->stream_capacity < 8 ? 8 : io->stream_capacity * 2;
+        io->streams = (io_stream**)realloc(io->streams, sizeof(io_stream*) * capacity);
+        memset(io->streams + io->stream_capacity, 0, sizeof(io_stream*) * (capacity - io->stream_capacity));
+        io->stream_capacity = capacity;
+    }
+    io->streams[handle] = stream;
+    return handle;
+}
+
+static io_stream* new_stream(VM* vm, int fd, bool writing)
+{
+    io_stream* stream = ALLOCATE(vm, MEMORY_FILES, io_stream, 1);
+    memset(stream, 0, sizeof(io_stream));
+    stream->fd = fd;
+    stream->writing = writing;
+    for (int i = 0; i < 2; i++) {
+        stream->buffers[i] = ALLOCATE(vm, MEMORY_FILES, char, IO_BLOCK);
+        stream->requests[i].fd = fd;
+        stream->requests[i].write = writing;
+        stream->requests[i].buffer = stream->buffers[i];
+    }
+    return stream;
+}
+
+/* Submit the next block of a read stream into buffer index */
+static void read_ahead(struct io_context* io, io_stream* stream, int index)
+{
+    io_request* request = &stream->requests[index];
+    request->length = IO_BLOCK;
+    request->transferred = 0;
+    request->offset = stream->offset;
+    stream->offset += IO_BLOCK;
+    start_request(io, request);
+}
+
+/* Write out the current block and switch to the other one, which must
+ * first finish its own write. Fails with the error of any earlier write. */
+static int flush_block(struct io_context* io, io_stream* stream)
+{
+    io_request* request = &stream->requests[stream->current];
+    if (stream->position > 0) {
+        request->length = stream->position;
+        request->transferred = 0;
+        request->offset = stream->offset;
+        stream->offset += stream->position;
+        start_request(io, request);
+        stream->position = 0;
+    }
+
+    stream->current = 1 - stream->current;
+    io_request* other = &stream->requests[stream->current];
+    finish_request(io, other);
+    return other->error;
+}
+
+/* Wait for the stream's transfers and close it, returning the first
+ * write error it had not yet reported */
+static int close_stream(VM* vm, io_stream* stream)
+{
+    struct io_context* io = vm->io;
+    int error = 0;
+    if (stream->writing) {
+        error = flush_block(io, stream);
+        if (!error)
+            error = flush_block(io, stream);
+    }
+    for (int i = 0; i < 2; i++) {
+        finish_request(io, &stream->requests[i]);
+        FREE_ARRAY(vm, MEMORY_FILES, char, stream->buffers[i], IO_BLOCK);
+    }
+    close(stream->fd);
+    FREE_ARRAY(vm, MEMORY_FILES, char, stream->line, stream->line_capacity);
+    FREE(vm, MEMORY_FILES, io_stream, stream);
+    return error;
+}
+
+/* Close every open file, flushing what was written to them */
+void close_files(VM* vm)
+{
+    struct io_context* io = vm->io;
+    if (!io)
+        return;
+    for (int i = 0; i < io->stream_capacity; i++) {
+        if (io->streams[i]) {
+            close_stream(vm, io->streams[i]);
+            io->streams[i] = NULL;
+        }
+    }
+}
+
+void free_io(VM* vm)
+{
+    struct io_context* io = vm->io;
+    if (!io)
+        return;
+    close_files(vm);
+    if (io->backend == IO_URING)
+        close_ring(io);
+    else if (io->backend == IO_THREADS)
+        stop_pool(io);
+    free(io->streams);
+    free(io);
+    vm->io = NULL;
+}
+
+/* FILE NATIVES */
+static io_stream* find_stream(VM* vm, value handle)
+{
+    struct io_context* io = vm->io;
+    if (!IS_INT(handle) || !io || AS_INT(handle) < 0 || AS_INT(handle) >= io->stream_capacity
+        || !io->streams[AS_INT(handle)]) {
+        native_error(vm, "Expected an open file");
+        return NULL;
+    }
+    return io->streams[AS_INT(handle)];
+}
+
+static io_stream* stream_argument(VM* vm, value handle, bool writing)
+{
+    io_stream* stream = find_stream(vm, handle);
+    if (stream && stream->writing != writing) {
+        native_error(vm, writing ? "File is open for reading" : "File is open for writing");
+        return NULL;
+    }
+    return stream;
+}
+
+static bool open_file(VM* vm, value path, bool writing, value* result)
+{
+    if (!IS_STRING(path)) {
+        native_error(vm, "Expected a path");
+        return false;
+    }
+    if (!memory_available(vm, sizeof(io_stream) + 2 * IO_BLOCK)) {
+        native_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+        return false;
+    }
+    int flags = writing ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    int fd = open(AS_CSTRING(path), flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        native_error(vm, "Could not open file \"%s\": %s", AS_CSTRING(path), strerror(errno));
+        return false;
+    }
+
+    struct io_context* io = io_context(vm);
+    io_stream* stream = new_stream(vm, fd, writing);
+    if (!writing) {
+        read_ahead(io, stream, 0);
+        read_ahead(io, stream, 1);
+    }
+    *result = INT_VAL(add_stream(io, stream));
+    return true;
+}
+
+static bool open_read_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return open_file(vm, args[0], false, result);
+}
+
+static bool open_write_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return open_file(vm, args[0], true, result);
+}
+
+static bool append_line(VM* vm, io_stream* stream, const char* chars, size_t length)
+{
+    if (length == 0)
+        return true;
+    if (length > (size_t)(INT32_MAX - stream->line_length)) {
+        native_error(vm, "Line is too long");
+        return false;
+    }
+    int needed = stream->line_length + (int)length;
+    if (needed > stream->line_capacity) {
+        int capacity = needed < 64 ? 64 : needed;
+        if (capacity <= INT32_MAX / 2)
+            capacity *= 2;
+        if (!memory_available(vm, capacity - stream->line_capacity)) {
+            native_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+            return false;
+        }
+        stream->line = GROW_ARRAY(vm, MEMORY_FILES, char, stream->line, stream->line_capacity, capacity);
+        stream->line_capacity = capacity;
+    }
+    memcpy(stream->line + stream->line_length, chars, length);
+    stream->line_length = needed;
+    return true;
+}
+
+static bool line_value(VM* vm, const char* chars, size_t length, value* result)
+{
+    if (!memory_available(vm, sizeof(obj_string) + length + 1)) {
+        native_error(vm, "Out of memory: the limit is %zu bytes", vm->memory.limit);
+        return false;
+    }
+    *result = OBJ_VAL(copy_string(vm, chars, (int)length));
+    return true;
+}
+
+/* The next line without its newline, or nil at the end of the file */
+static bool read_line_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    io_stream* stream = stream_argument(vm, args[0], false);
+    if (!stream)
+        return false;
+
+    struct io_context* io = vm->io;
+    for (;;) {
+        io_request* request = &stream->requests[stream->current];
+        if (!stream->loaded) {
+            if (stream->ended) {
+                if (stream->line_length == 0) {
+                    *result = NIL_VAL;
+                    return true;
+                }
+                int length = stream->line_length;
+                stream->line_length = 0;
+                return line_value(vm, stream->line, length, result);
+            }
+            finish_request(io, request);
+            if (request->error) {
+                native_error(vm, "Could not read file: %s", strerror(request->error));
+                return false;
+            }
+            if (request->transferred == 0) {
+                stream->ended = true;
+                continue;
+            }
+            stream->loaded = true;
+            stream->position = 0;
+        }
+
+        char* start = request->buffer + stream->position;
+        size_t left = request->transferred - stream->position;
+        char* newline = (char*)memchr(start, '\n', left);
+        if (newline) {
+            size_t length = newline - start;
+            stream->position += length + 1;
+            if (stream->line_length == 0)
+                return line_value(vm, start, length, result);
+            if (!append_line(vm, stream, start, length))
+                return false;
+            length = stream->line_length;
+            stream->line_length = 0;
+            return line_value(vm, stream->line, length, result);
+        }
+
+        /* The block is used up: its line continues in the next one, which
+         * is already on its way, and this buffer reads ahead behind it */
+        if (!append_line(vm, stream, start, left))
+            return false;
+        stream->loaded = false;
+        if (request->transferred < request->length) {
+            stream->ended = true; /* a short block is the last */
+        } else {
+            read_ahead(io, stream, stream->current);
+            stream->current = 1 - stream->current;
+        }
+    }
+}
+
+/* Copy bytes into a write stream, writing out each block it fills */
+static int append_bytes(struct io_context* io, io_stream* stream, const char* chars, size_t length)
+{
+    while (length > 0) {
+        size_t room = IO_BLOCK - stream->position;
+        size_t take = length < room ? length : room;
+        memcpy(stream->buffers[stream->current] + stream->position, chars, take);
+        stream->position += take;
+        chars += take;
+        length -= take;
+        if (stream->position == IO_BLOCK) {
+            int error = flush_block(io, stream);
+            if (error)
+                return error;
+        }
+    }
+    return 0;
+}
+
+/* Append text to a write stream as print shows it, then a newline if
+ * asked for */
+static bool write_value(VM* vm, value handle, value text, bool newline, value* result)
+{
+    io_stream* stream = stream_argument(vm, handle, true);
+    if (!stream)
+        return false;
+
+    struct io_context* io = vm->io;
+    int error;
+    if (IS_STRING(text)) {
+        error = append_bytes(io, stream, AS_CSTRING(text), AS_STRING(text)->length);
+    } else {
+        char* printed;
+        size_t length;
+        FILE* out = open_memstream(&printed, &length);
+        print_value(out, text);
+        fclose(out);
+        error = append_bytes(io, stream, printed, length);
+        free(printed);
+    }
+    if (!error && newline)
+        error = append_bytes(io, stream, "\n", 1);
+
+    if (error) {
+        native_error(vm, "Could not write file: %s", strerror(error));
+        return false;
+    }
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool write_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return write_value(vm, args[0], args[1], false, result);
+}
+
+static bool write_line_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    return write_value(vm, args[0], args[1], true, result);
+}
+
+/* Whether the next read_line() or write() can go ahead without waiting on
+ * the disk, so a fiber can yield until it does:
+ *
+ *     while (!ready(file)) yield;
+ */
+static bool ready_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    io_stream* stream = find_stream(vm, args[0]);
+    if (!stream)
+        return false;
+
+    struct io_context* io = vm->io;
+    bool ready;
+    if (stream->writing) {
+        ready = stream->position < IO_BLOCK || poll_request(io, &stream->requests[1 - stream->current]);
+    } else if (stream->ended) {
+        ready = true;
+    } else if (stream->loaded) {
+        io_request* request = &stream->requests[stream->current];
+        ready = memchr(request->buffer + stream->position, '\n', request->transferred - stream->position)
+                || poll_request(io, &stream->requests[1 - stream->current]);
+    } else {
+        ready = poll_request(io, &stream->requests[stream->current]);
+    }
+    *result = BOOL_VAL(ready);
+    return true;
+}
+
+static bool close_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    io_stream* stream = find_stream(vm, args[0]);
+    if (!stream)
+        return false;
+
+    struct io_context* io = vm->io;
+    io->streams[AS_INT(args[0])] = NULL;
+    int error = close_stream(vm, stream);
+    if (error) {
+        native_error(vm, "Could not write file: %s", strerror(error));
+        return false;
+    }
+    *result = NIL_VAL;
+    return true;
+}
+
+void define_file_natives(VM* vm)
+{
+    define_native(vm, "open_read", 1, open_read_native);
+    define_native(vm, "open_write", 1, open_write_native);
+    define_native(vm, "read_line", 1, read_line_native);
+    define_native(vm, "write", 2, write_native);
+    define_native(vm, "write_line", 2, write_line_native);
+    define_native(vm, "ready", 1, ready_native);
+    define_native(vm, "close", 1, close_native);
+}
+
+/* LINE MODE
+ *
+ * polity -n runs a script once per line of its input, like awk. Input is
+ * read in large chunks into one buffer, and each line is handed to the
+ * script as a string over that buffer, its newline overwritten with the
+ * terminating NUL. After every line the objects it created are freed
+ * unless a global holds them, so memory stays flat however long the
+ * input is.
+ *
+ * That check only looks at the line's own objects. Those that survive are
+ * checked again, with everything else kept since the first line, once
+ * there are as many of them as there were live objects after the last
+ * such pass. A global that grows by a line at a time costs a constant
+ * amount per line, and one that is overwritten keeps at most that many
+ * stale values. */
+
+#define LINE_BUFFER (1024 * 1024)
+#define LINE_SURVIVORS 256 /* kept objects that always wait for the full pass */
+
+static interpret_result run_once(VM* vm, chunk* chunk, reg_chunk* code)
+{
+    if (code)
+        return run_translated(vm, chunk, code);
+    interpret_result result = run_chunk(vm, chunk);
+    while (result == INTERPRET_YIELD)
+        result = resume_chunk(vm);
+    return result;
+}
+
+/* Run chunk for each line of fd with the line, without its newline, in
+ * the global `line` and its number from 1 in `nr`. Top-level variables
+ * are declared on the first line and keep their values after it. Once the
+ * input ends, chunk runs one last time with `line` nil and `nr` the
+ * number of lines, for totals. */
+interpret_result run_lines(VM* vm, chunk* chunk, int fd)
+{
+    obj_string* line_name = copy_string(vm, "line", 4);
+    obj_string* number_name = copy_string(vm, "nr", 2);
+    table_set(vm, &vm->globals, line_name, NIL_VAL);
+    table_set(vm, &vm->globals, number_name, INT_VAL(0));
+    struct obj* mark = vm->objects;
+    struct obj* young = mark; /* first object older than the current line */
+    size_t kept = 0; /* survivors of line passes since the last full one */
+    size_t live = 0; /* survivors of the last full pass */
+    vm->keep_globals = true;
+    reg_chunk* code = vm->engine == ENGINE_REGISTER ? compile_registers(chunk) : NULL;
+
+    /* A memory limit too tight for the whole buffer starts a smaller one */
+    size_t capacity = LINE_BUFFER;
+    while (capacity > 4096 && !memory_available(vm, capacity + 1))
+        capacity /= 2;
+    char* buffer = ALLOCATE(vm, MEMORY_FILES, char, capacity + 1); /* room for a last line's NUL */
+    size_t start = 0; /* first byte of the next line */
+    size_t end = 0; /* one past the last byte read */
+    bool ended = false;
+    int64_t number = 0;
+    interpret_result result = INTERPRET_OK;
+
+    while (result == INTERPRET_OK) {
+        char* newline = (char*)memchr(buffer + start, '\n', end - start);
+        if (!newline && !ended) {
+            /* Move the partial line to the front and read behind it */
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            if (end == capacity) {
+                if (!memory_available(vm, capacity)) {
+                    fprintf(vm->err, "Out of memory: line %lld is longer than the limit of %zu bytes allows\n",
+                            (long long)number + 1, vm->memory.limit);
+                    result = INTERPRET_RUNTIME_ERROR;
+                    break;
+                }
+                buffer = GROW_ARRAY(vm, MEMORY_FILES, char, buffer, capacity + 1, 2 * capacity + 1);
+                capacity *= 2;
+            }
+            ssize_t count = read(fd, buffer + end, capacity - end);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                fprintf(vm->err, "Could not read input: %s\n", strerror(errno));
+            if (count <= 0)
+                ended = true;
+            else
+                end += count;
+            continue;
+        }
+        if (!newline && start == end)
+            break;
+
+        size_t length = newline ? (size_t)(newline - (buffer + start)) : end - start;
+        if (length > INT32_MAX) {
+            fprintf(vm->err, "Line %lld is too long\n", (long long)number + 1);
+            result = INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        buffer[start + length] = '\0';
+        obj_string* line = borrow_string(vm, buffer + start, (int)length);
+        start += length + (newline != NULL);
+
+        table_set(vm, &vm->globals, line_name, OBJ_VAL(line));
+        table_set(vm, &vm->globals, number_name, INT_VAL(++number));
+        result = run_once(vm, chunk, code);
+        table_set(vm, &vm->globals, line_name, NIL_VAL);
+        if (kept >= (live > LINE_SURVIVORS ? live : LINE_SURVIVORS)) {
+            live = free_unreachable(vm, mark);
+            kept = 0;
+        } else
+            kept += free_unreachable(vm, young);
+        young = vm->objects;
+    }
+
+    if (result == INTERPRET_OK)
+        result = run_once(vm, chunk, code);
+    vm->keep_globals = false;
+    forget_writes(vm);
+    if (code)
+        free_reg_chunk(code);
+    FREE_ARRAY(vm, MEMORY_FILES, char, buffer, capacity + 1);
+    return result;
+}
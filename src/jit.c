@@ -0,0 +1,1419 @@
+#include "interpreter.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+/* TEMPLATE JIT
+ *
+ * Each stack instruction is translated by its own template into x86-64.
+ * Compiled code keeps the VM stack base in r12 and the VM in r13. Slot
+ * addresses are fixed at compile time because the stack depth at every
+ * instruction is static. Locals, constants and arithmetic results stay
+ * symbolic where possible; numbers live unboxed in xmm registers until
+ * a helper call, a jump target or a store needs them in their slot.
+ * Quickened instructions are compiled for the operand types run() saw;
+ * when a type guard or overflow check fails, a deopt stub stores the
+ * operands back into their slots and run() redoes the instruction.
+ * Instructions without a template leave the compiled code through a side
+ * exit, and run() continues from there. */
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+
+#define XMM_ALLOCATABLE 14 /* xmm0-xmm13; xmm14 and xmm15 are scratch */
+#define XMM_SCRATCH 14
+#define XMM_COPY 15
+
+#define CC_O  0x0
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_NS 0x9
+#define CC_NP 0xB
+#define CC_L  0xC
+#define CC_G  0xF
+
+#define TYPE_UNKNOWN -1
+
+#define SLOT(n) ((int32_t)((n) * (int)sizeof(value)))
+#define TYPE_OF(n) SLOT(n)
+#define PAYLOAD_OF(n) (SLOT(n) + (int32_t)offsetof(value, as))
+
+_Static_assert(sizeof(value) == 16, "JIT templates assume 16-byte values");
+_Static_assert(offsetof(value, type) == 0, "JIT templates assume the tag comes first");
+
+typedef enum {
+    IN_SLOT,     /* in its own stack slot */
+    IN_LOCAL,    /* a copy of a local that has not been made yet */
+    IN_CONSTANT, /* a constant that has not been stored yet */
+    IN_XMM       /* an unboxed number in an xmm register */
+} operand_kind;
+
+typedef struct {
+    operand_kind kind;
+    int index;
+} operand;
+
+typedef struct {
+    int position;
+    int target;
+} fixup;
+
+/* A failed guard: the branch to patch, and where every operand of the
+ * instruction and below it was at that point */
+typedef struct {
+    int position;
+    int offset;
+    int depth;
+    operand* stack;
+} deopt;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+} buffer;
+
+typedef struct {
+    chunk* chunk;
+    buffer out;
+    operand* stack;
+    int depth;
+    int8_t* slot_type; /* value type a slot is known to hold, or TYPE_UNKNOWN */
+    bool xmm_used[XMM_ALLOCATABLE];
+    int* native; /* machine code offset of each jump target */
+    bool* is_target;
+    int* target_depth;
+    fixup* jumps;
+    int jump_count;
+    deopt* deopts;
+    int deopt_count;
+    int offset; /* bytecode offset being compiled */
+    int entry_depth; /* stack depth before the current instruction */
+    int done_label;
+    int error_label;
+    int exit_label;
+    int deopt_label;
+} jit_compiler;
+
+
+/* MACHINE CODE BUFFER */
+static void emit8(jit_compiler* c, uint8_t byte)
+{
+    buffer* b = &c->out;
+    if (b->capacity < b->count + 1) {
+        b->capacity = b->capacity < 256 ? 256 : b->capacity * 2;
+        b->code = (uint8_t*)realloc(b->code, b->capacity);
+    }
+    b->code[b->count++] = byte;
+}
+
+static void emit32(jit_compiler* c, int32_t word)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(c, (uint8_t)(word >> (8 * i)));
+}
+
+static void emit64(jit_compiler* c, uint64_t word)
+{
+    for (int i = 0; i < 8; i++)
+        emit8(c, (uint8_t)(word >> (8 * i)));
+}
+
+static void patch32(jit_compiler* c, int position, int32_t word)
+{
+    for (int i = 0; i < 4; i++)
+        c->out.code[position + i] = (uint8_t)(word >> (8 * i));
+}
+
+static void add_fixup(fixup** list, int* count, int position, int target)
+{
+    *list = (fixup*)realloc(*list, sizeof(fixup) * (*count + 1));
+    (*list)[(*count)++] = (fixup){position, target};
+}
+
+/* INSTRUCTION ENCODING */
+
+/* [prefix] [REX] opcode ModRM(reg, [base + disp32]) */
+static void mem_op(jit_compiler* c, uint8_t prefix, bool wide, uint16_t opcode, int reg, int base, int32_t disp)
+{
+    if (prefix)
+        emit8(c, prefix);
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (rex != 0x40)
+        emit8(c, rex);
+    if (opcode > 0xFF)
+        emit8(c, opcode >> 8);
+    emit8(c, opcode & 0xFF);
+    emit8(c, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4)
+        emit8(c, 0x24);
+    emit32(c, disp);
+}
+
+/* [prefix] [REX] opcode ModRM(reg, rm) */
+static void reg_op(jit_compiler* c, uint8_t prefix, bool wide, uint16_t opcode, int reg, int rm)
+{
+    if (prefix)
+        emit8(c, prefix);
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (rex != 0x40)
+        emit8(c, rex);
+    if (opcode > 0xFF)
+        emit8(c, opcode >> 8);
+    emit8(c, opcode & 0xFF);
+    emit8(c, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void mov_imm64(jit_compiler* c, int reg, uint64_t imm)
+{
+    emit8(c, 0x48 | ((reg & 8) ? 1 : 0));
+    emit8(c, 0xB8 + (reg & 7));
+    emit64(c, imm);
+}
+
+static void store_imm32(jit_compiler* c, int base, int32_t disp, int32_t imm)
+{
+    mem_op(c, 0, false, 0xC7, 0, base, disp);
+    emit32(c, imm);
+}
+
+static void cmp_dword_imm8(jit_compiler* c, int base, int32_t disp, int8_t imm)
+{
+    mem_op(c, 0, false, 0x83, 7, base, disp);
+    emit8(c, (uint8_t)imm);
+}
+
+static void cmp_byte_imm8(jit_compiler* c, int base, int32_t disp, int8_t imm)
+{
+    mem_op(c, 0, false, 0x80, 7, base, disp);
+    emit8(c, (uint8_t)imm);
+}
+
+static void call_helper(jit_compiler* c, void* helper)
+{
+    mov_imm64(c, RAX, (uint64_t)(uintptr_t)helper);
+    emit8(c, 0xFF);
+    emit8(c, 0xD0);
+}
+
+static int jcc(jit_compiler* c, uint8_t cc)
+{
+    emit8(c, 0x0F);
+    emit8(c, 0x80 | cc);
+    emit32(c, 0);
+    return c->out.count - 4;
+}
+
+static int jmp(jit_compiler* c)
+{
+    emit8(c, 0xE9);
+    emit32(c, 0);
+    return c->out.count - 4;
+}
+
+/* Point a rel32 at the current position */
+static void bind(jit_compiler* c, int position)
+{
+    patch32(c, position, c->out.count - (position + 4));
+}
+
+static void bind_to(jit_compiler* c, int position, int target)
+{
+    patch32(c, position, target - (position + 4));
+}
+
+static void setcc_al(jit_compiler* c, uint8_t cc)
+{
+    emit8(c, 0x0F);
+    emit8(c, 0x90 | cc);
+    emit8(c, 0xC0);
+}
+
+static void load_args(jit_compiler* c, bool with_ip, int slot)
+{
+    reg_op(c, 0, true, 0x89, R13, RDI); /* mov rdi, r13 */
+    if (with_ip)
+        mov_imm64(c, RSI, (uint64_t)(uintptr_t)&c->chunk->code[c->offset]);
+    if (slot >= 0)
+        mem_op(c, 0, true, 0x8D, RDX, R12, SLOT(slot)); /* lea rdx, [r12 + slot] */
+}
+
+/* Call a helper that returns false after reporting a runtime error */
+static void call_checked(jit_compiler* c, void* helper)
+{
+    call_helper(c, helper);
+    emit8(c, 0x84);
+    emit8(c, 0xC0); /* test al, al */
+    int error = jcc(c, CC_E);
+    bind_to(c, error, c->error_label);
+}
+
+/* RUNTIME HELPERS */
+static void sync_ip(VM* vm, uint8_t* ip)
+{
+    vm->ip = ip + 1;
+}
+
+static bool jit_get_global(VM* vm, uint8_t* ip, value* slot)
+{
+    global_cache* cache = &vm->chunk->caches[(ip[2] << 8) | ip[3]];
+    obj_string* name = AS_STRING(vm->chunk->constants.values[ip[1]]);
+    entry* global = table_lookup(&vm->globals, name);
+    if (!global) {
+        sync_ip(vm, ip);
+        runtime_error(vm, "Undefined variable '%s'", name->chars);
+        return false;
+    }
+
+    cache->version = vm->globals.version;
+    cache->index = (int)(global - vm->globals.entries);
+    *slot = global->value;
+    return true;
+}
+
+static bool jit_set_global(VM* vm, uint8_t* ip, value* slot)
+{
+    global_cache* cache = &vm->chunk->caches[(ip[2] << 8) | ip[3]];
+    obj_string* name = AS_STRING(vm->chunk->constants.values[ip[1]]);
+    entry* global = table_lookup(&vm->globals, name);
+    if (!global) {
+        sync_ip(vm, ip);
+        runtime_error(vm, "Undefined variable '%s'", name->chars);
+        return false;
+    }
+
+    cache->version = vm->globals.version;
+    cache->index = (int)(global - vm->globals.entries);
+    global->value = *slot;
+    return true;
+}
+
+static void jit_define_global(VM* vm, uint8_t* ip, value* slot)
+{
+    define_global(vm, AS_STRING(vm->chunk->constants.values[ip[1]]), *slot);
+}
+
+static bool jit_add(VM* vm, uint8_t* ip, value* slot)
+{
+    if (IS_STRING(slot[0]) && IS_STRING(slot[1])) {
+        obj_string* result = concatenate_strings(vm, AS_STRING(slot[0]), AS_STRING(slot[1]));
+        if (!result) {
+            sync_ip(vm, ip);
+            out_of_memory(vm);
+            return false;
+        }
+        slot[0] = OBJ_VAL(result);
+        return true;
+    }
+    if (IS_NUMERIC(slot[0]) && IS_NUMERIC(slot[1])) {
+        slot[0] = number_arithmetic(OP_ADD, slot[0], slot[1]);
+        return true;
+    }
+
+    sync_ip(vm, ip);
+    runtime_error(vm, "Operands must be two numbers or two strings\n");
+    return false;
+}
+
+/* Arithmetic and comparisons on operands of no single known kind */
+static bool jit_binary(VM* vm, uint8_t* ip, value* slot, int op)
+{
+    if (!IS_NUMERIC(slot[0]) || !IS_NUMERIC(slot[1])) {
+        sync_ip(vm, ip);
+        runtime_error(vm, "Operands must be numbers");
+        return false;
+    }
+
+    switch (op) {
+        case OP_GREATER: slot[0] = BOOL_VAL(number_less(slot[1], slot[0])); break;
+        case OP_LESS: slot[0] = BOOL_VAL(number_less(slot[0], slot[1])); break;
+        default: slot[0] = number_arithmetic(op, slot[0], slot[1]); break;
+    }
+    return true;
+}
+
+static bool jit_negate(VM* vm, uint8_t* ip, value* slot)
+{
+    if (!IS_NUMERIC(slot[0])) {
+        sync_ip(vm, ip);
+        runtime_error(vm, "Operand must be a number");
+        return false;
+    }
+
+    slot[0] = number_negate(slot[0]);
+    return true;
+}
+
+static void jit_equal(VM* vm, uint8_t* ip, value* slot)
+{
+    (void)vm;
+    (void)ip;
+    slot[0] = BOOL_VAL(values_equal(slot[0], slot[1]));
+}
+
+static void jit_print(VM* vm, uint8_t* ip, value* slot)
+{
+    (void)ip;
+    print_value(vm->out, *slot);
+    fprintf(vm->out, "\n");
+}
+
+static bool jit_call(VM* vm, uint8_t* ip, value* slot)
+{
+    int arg_count = ip[1];
+    sync_ip(vm, ip);
+    if (!IS_NATIVE(slot[0])) {
+        runtime_error(vm, "Can only call functions");
+        return false;
+    }
+
+    obj_native* native = AS_NATIVE(slot[0]);
+    if (native->arity != -1 && native->arity != arg_count) {
+        runtime_error(vm, "Expected %d arguments but got %d", native->arity, arg_count);
+        return false;
+    }
+
+    value result;
+    if (!native->function(vm, arg_count, slot + 1, &result))
+        return false;
+
+    slot[0] = result;
+    return true;
+}
+
+static bool jit_array(VM* vm, uint8_t* ip, value* slot)
+{
+    sync_ip(vm, ip);
+    return make_array(vm, slot, ip[1], slot);
+}
+
+static bool jit_get_index(VM* vm, uint8_t* ip, value* slot)
+{
+    sync_ip(vm, ip);
+    return get_index(vm, slot[0], slot[1], slot);
+}
+
+static bool jit_set_index(VM* vm, uint8_t* ip, value* slot)
+{
+    sync_ip(vm, ip);
+    if (!set_index(vm, slot[0], slot[1], slot[2]))
+        return false;
+    slot[0] = slot[2];
+    return true;
+}
+
+static bool jit_map(VM* vm, uint8_t* ip, value* slot)
+{
+    sync_ip(vm, ip);
+    return make_map(vm, slot, ip[1], slot);
+}
+
+static bool jit_delete_index(VM* vm, uint8_t* ip, value* slot)
+{
+    sync_ip(vm, ip);
+    return delete_index(vm, slot[0], slot[1], slot);
+}
+
+/* OPERAND STACK */
+static bool known_number(jit_compiler* c, operand op)
+{
+    switch (op.kind) {
+        case IN_XMM: return true;
+        case IN_CONSTANT: return IS_NUMBER(c->chunk->constants.values[op.index]);
+        case IN_SLOT:
+        case IN_LOCAL: return c->slot_type[op.index] == VAL_NUMBER;
+    }
+    return false;
+}
+
+static bool known_int(jit_compiler* c, operand op)
+{
+    switch (op.kind) {
+        case IN_XMM: return false;
+        case IN_CONSTANT: return IS_INT(c->chunk->constants.values[op.index]);
+        case IN_SLOT:
+        case IN_LOCAL: return c->slot_type[op.index] == VAL_INT;
+    }
+    return false;
+}
+
+static void free_xmm(jit_compiler* c, operand op)
+{
+    if (op.kind == IN_XMM)
+        c->xmm_used[op.index] = false;
+}
+
+/* Emit the stores that put an operand into slot position. Types are not
+ * known to the caller, so every store writes the tag as well. */
+static void store_operand(jit_compiler* c, operand op, int position)
+{
+    switch (op.kind) {
+        case IN_SLOT:
+            return;
+        case IN_LOCAL:
+            mem_op(c, 0xF3, false, 0x0F6F, XMM_COPY, R12, SLOT(op.index)); /* movdqu */
+            mem_op(c, 0xF3, false, 0x0F7F, XMM_COPY, R12, SLOT(position));
+            return;
+        case IN_CONSTANT: {
+            value val = c->chunk->constants.values[op.index];
+            uint64_t payload;
+            memcpy(&payload, &val.as, sizeof(payload));
+            store_imm32(c, R12, TYPE_OF(position), val.type);
+            mov_imm64(c, RAX, payload);
+            mem_op(c, 0, true, 0x89, RAX, R12, PAYLOAD_OF(position));
+            return;
+        }
+        case IN_XMM:
+            store_imm32(c, R12, TYPE_OF(position), VAL_NUMBER);
+            mem_op(c, 0xF2, false, 0x0F11, op.index, R12, PAYLOAD_OF(position)); /* movsd */
+            return;
+    }
+}
+
+/* Copy one slot to another. With the type known, only the payload moves,
+ * as a 16-byte load straight after the tag and payload stores that wrote
+ * the slot would miss store forwarding. */
+static void copy_slot(jit_compiler* c, int from, int to)
+{
+    int8_t type = c->slot_type[from];
+    if (type == TYPE_UNKNOWN) {
+        mem_op(c, 0xF3, false, 0x0F6F, XMM_COPY, R12, SLOT(from)); /* movdqu */
+        mem_op(c, 0xF3, false, 0x0F7F, XMM_COPY, R12, SLOT(to));
+    } else {
+        if (c->slot_type[to] != type)
+            store_imm32(c, R12, TYPE_OF(to), type);
+        mem_op(c, 0, true, 0x8B, RAX, R12, PAYLOAD_OF(from));
+        mem_op(c, 0, true, 0x89, RAX, R12, PAYLOAD_OF(to));
+    }
+    c->slot_type[to] = type;
+}
+
+/* Store a symbolic operand into its own slot */
+static void materialize(jit_compiler* c, int position)
+{
+    operand op = c->stack[position];
+    switch (op.kind) {
+        case IN_SLOT:
+            return;
+        case IN_LOCAL:
+            copy_slot(c, op.index, position);
+            break;
+        case IN_CONSTANT:
+            store_operand(c, op, position);
+            c->slot_type[position] = c->chunk->constants.values[op.index].type;
+            break;
+        case IN_XMM:
+            if (c->slot_type[position] != VAL_NUMBER)
+                store_imm32(c, R12, TYPE_OF(position), VAL_NUMBER);
+            mem_op(c, 0xF2, false, 0x0F11, op.index, R12, PAYLOAD_OF(position)); /* movsd */
+            c->xmm_used[op.index] = false;
+            c->slot_type[position] = VAL_NUMBER;
+            break;
+    }
+    c->stack[position] = (operand){IN_SLOT, position};
+}
+
+static void flush(jit_compiler* c)
+{
+    for (int i = 0; i < c->depth; i++)
+        materialize(c, i);
+}
+
+static int alloc_xmm(jit_compiler* c)
+{
+    while (1) {
+        for (int i = 0; i < XMM_ALLOCATABLE; i++) {
+            if (!c->xmm_used[i]) {
+                c->xmm_used[i] = true;
+                return i;
+            }
+        }
+        /* Out of registers: spill the deepest unboxed value */
+        for (int i = 0; i < c->depth; i++) {
+            if (c->stack[i].kind == IN_XMM) {
+                materialize(c, i);
+                break;
+            }
+        }
+    }
+}
+
+/* Send a failed guard's branch to a deopt stub for the current instruction */
+static void guard_deopt(jit_compiler* c, int position)
+{
+    c->deopts = (deopt*)realloc(c->deopts, sizeof(deopt) * (c->deopt_count + 1));
+    deopt* d = &c->deopts[c->deopt_count++];
+    d->position = position;
+    d->offset = c->offset;
+    d->depth = c->entry_depth;
+    d->stack = (operand*)malloc(sizeof(operand) * (d->depth + 1));
+    memcpy(d->stack, c->stack, sizeof(operand) * d->depth);
+}
+
+/* Make sure a slot holds a value of the given type, deoptimizing otherwise */
+static void guard_type(jit_compiler* c, int slot, value_type type)
+{
+    if (c->slot_type[slot] == (int8_t)type)
+        return;
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), type);
+    guard_deopt(c, jcc(c, CC_NE));
+    c->slot_type[slot] = type;
+}
+
+/* Produce the operand's number in an xmm register the caller owns. Known
+ * integers are converted; callers only get here with one when the result
+ * is computed in doubles anyway. */
+static int load_number(jit_compiler* c, operand op)
+{
+    if (op.kind == IN_XMM)
+        return op.index;
+
+    int xmm = alloc_xmm(c);
+    if (op.kind == IN_CONSTANT) {
+        value val = c->chunk->constants.values[op.index];
+        if (!IS_NUMERIC(val)) {
+            guard_deopt(c, jmp(c));
+            return xmm;
+        }
+        double number = TO_NUMBER(val);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        mov_imm64(c, RAX, bits);
+        reg_op(c, 0x66, true, 0x0F6E, xmm, RAX); /* movq xmm, rax */
+        return xmm;
+    }
+
+    if (c->slot_type[op.index] == VAL_INT) {
+        mem_op(c, 0xF2, true, 0x0F2A, xmm, R12, PAYLOAD_OF(op.index)); /* cvtsi2sd */
+        return xmm;
+    }
+    guard_type(c, op.index, VAL_NUMBER);
+    mem_op(c, 0xF2, false, 0x0F10, xmm, R12, PAYLOAD_OF(op.index));
+    return xmm;
+}
+
+/* Apply an SSE instruction (F2 0F opcode or 66 0F 2E) to xmm with the
+ * operand as source, read straight from memory when it lives in a slot */
+static void sse_with_operand(jit_compiler* c, uint8_t prefix, uint16_t opcode, int xmm, operand op)
+{
+    if ((op.kind == IN_SLOT || op.kind == IN_LOCAL) && c->slot_type[op.index] != VAL_INT) {
+        guard_type(c, op.index, VAL_NUMBER);
+        mem_op(c, prefix, false, opcode, xmm, R12, PAYLOAD_OF(op.index));
+        return;
+    }
+
+    int source;
+    if (op.kind == IN_XMM)
+        source = op.index;
+    else if (op.kind != IN_CONSTANT) {
+        source = XMM_SCRATCH;
+        mem_op(c, 0xF2, true, 0x0F2A, source, R12, PAYLOAD_OF(op.index)); /* cvtsi2sd */
+    } else {
+        source = load_number(c, op);
+        c->xmm_used[source] = false;
+    }
+    reg_op(c, prefix, false, opcode, xmm, source);
+}
+
+static void push_operand(jit_compiler* c, operand_kind kind, int index)
+{
+    c->stack[c->depth++] = (operand){kind, index};
+}
+
+static operand pop_operand(jit_compiler* c)
+{
+    return c->stack[--c->depth];
+}
+
+/* Store a boolean from al into a slot */
+static void store_bool_al(jit_compiler* c, int slot)
+{
+    emit8(c, 0x0F);
+    emit8(c, 0xB6);
+    emit8(c, 0xC0); /* movzx eax, al */
+    store_imm32(c, R12, TYPE_OF(slot), VAL_BOOL);
+    mem_op(c, 0, true, 0x89, RAX, R12, PAYLOAD_OF(slot));
+    c->slot_type[slot] = VAL_BOOL;
+    c->stack[slot] = (operand){IN_SLOT, slot};
+}
+
+/* Branch to target when the slot holds nil or false */
+static void jump_if_falsey(jit_compiler* c, int slot, int target)
+{
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), VAL_NIL);
+    add_fixup(&c->jumps, &c->jump_count, jcc(c, CC_E), target);
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), VAL_BOOL);
+    int truthy = jcc(c, CC_NE);
+    cmp_byte_imm8(c, R12, PAYLOAD_OF(slot), 0);
+    add_fixup(&c->jumps, &c->jump_count, jcc(c, CC_E), target);
+    bind(c, truthy);
+}
+
+static void record_target_depth(jit_compiler* c, int target)
+{
+    c->target_depth[target] = c->depth;
+}
+
+/* TEMPLATES */
+static void arithmetic(jit_compiler* c, uint16_t opcode)
+{
+    operand right = pop_operand(c);
+    operand left = pop_operand(c);
+    int xmm = load_number(c, left);
+    sse_with_operand(c, 0xF2, opcode, xmm, right);
+    free_xmm(c, right);
+    push_operand(c, IN_XMM, xmm);
+}
+
+/* Whether an operand can feed an integer template */
+static bool int_operand(jit_compiler* c, operand op)
+{
+    return op.kind != IN_XMM && (op.kind != IN_CONSTANT || IS_INT(c->chunk->constants.values[op.index]));
+}
+
+/* Apply an ALU opcode (or mov, 8B) to rax with an integer operand as the
+ * source, read straight from its slot after a tag guard */
+static void int_with_operand(jit_compiler* c, uint16_t opcode, operand op)
+{
+    if (op.kind == IN_CONSTANT) {
+        int64_t integer = AS_INT(c->chunk->constants.values[op.index]);
+        mov_imm64(c, opcode == 0x8B ? RAX : RCX, (uint64_t)integer);
+        if (opcode != 0x8B)
+            reg_op(c, 0, true, opcode, RAX, RCX);
+        return;
+    }
+
+    guard_type(c, op.index, VAL_INT);
+    mem_op(c, 0, true, opcode, RAX, R12, PAYLOAD_OF(op.index));
+}
+
+/* Integer add, subtract or multiply (ALU opcode 03, 2B or 0FAF). Overflow
+ * deoptimizes, and run() redoes the instruction in doubles. */
+static void integer_arithmetic(jit_compiler* c, uint16_t opcode)
+{
+    operand right = pop_operand(c);
+    operand left = pop_operand(c);
+    int_with_operand(c, 0x8B, left);
+    int_with_operand(c, opcode, right);
+    guard_deopt(c, jcc(c, CC_O));
+
+    int slot = c->depth;
+    if (c->slot_type[slot] != VAL_INT)
+        store_imm32(c, R12, TYPE_OF(slot), VAL_INT);
+    mem_op(c, 0, true, 0x89, RAX, R12, PAYLOAD_OF(slot));
+    push_operand(c, IN_SLOT, slot);
+    c->slot_type[slot] = VAL_INT;
+}
+
+/* Call out for arithmetic or a comparison on operands of unknown kinds */
+static void call_binary(jit_compiler* c, uint8_t op)
+{
+    flush(c);
+    int slot = c->depth - 2;
+    load_args(c, true, slot);
+    emit8(c, 0xB9);
+    emit32(c, op); /* mov ecx, op */
+    call_checked(c, (void*)jit_binary);
+    c->depth -= 1;
+    c->slot_type[slot] = TYPE_UNKNOWN;
+}
+
+/* Whether an operand is known to be a number of either kind */
+static bool known_numeric(jit_compiler* c, operand op)
+{
+    return known_number(c, op) || known_int(c, op);
+}
+
+/* Subtract, multiply or divide in the form run() quickened the instruction
+ * to, or by what is known about the operands: integers inline in rax,
+ * doubles (and mixes, which compute in doubles) inline in xmm, and
+ * anything else through a helper */
+static void binary(jit_compiler* c, uint8_t instruction, uint16_t sse_opcode, uint16_t alu_opcode)
+{
+    operand right = c->stack[c->depth - 1];
+    operand left = c->stack[c->depth - 2];
+    uint8_t generic = instruction;
+    switch (instruction) {
+        case OP_SUBTRACT_NUM: generic = OP_SUBTRACT; break;
+        case OP_MULTIPLY_NUM: generic = OP_MULTIPLY; break;
+        case OP_DIVIDE_NUM: generic = OP_DIVIDE; break;
+        case OP_SUBTRACT_INT: generic = OP_SUBTRACT; break;
+        case OP_MULTIPLY_INT: generic = OP_MULTIPLY; break;
+    }
+
+    bool int_form = instruction == OP_SUBTRACT_INT || instruction == OP_MULTIPLY_INT;
+    bool integers = int_form ? int_operand(c, left) && int_operand(c, right)
+                             : known_int(c, left) && known_int(c, right);
+    if (integers && generic != OP_DIVIDE)
+        integer_arithmetic(c, alu_opcode);
+    else if (int_form)
+        call_binary(c, generic);
+    else if (instruction != generic || (known_numeric(c, left) && known_numeric(c, right)))
+        arithmetic(c, sse_opcode);
+    else
+        call_binary(c, generic);
+}
+
+/* OP_ADD may concatenate strings, so unless one side is known to be a
+ * number it checks both tags in place and calls out for anything else */
+static void add(jit_compiler* c, uint8_t instruction)
+{
+    operand right = c->stack[c->depth - 1];
+    operand left = c->stack[c->depth - 2];
+    if (instruction == OP_ADD_INT ? int_operand(c, left) && int_operand(c, right)
+                                  : known_int(c, left) && known_int(c, right)) {
+        integer_arithmetic(c, 0x03);
+        return;
+    }
+    if (known_number(c, left) || known_number(c, right)) {
+        arithmetic(c, 0x0F58);
+        return;
+    }
+
+    flush(c);
+    int slot = c->depth - 2;
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), VAL_NUMBER);
+    int slow_left = jcc(c, CC_NE);
+    cmp_dword_imm8(c, R12, TYPE_OF(slot + 1), VAL_NUMBER);
+    int slow_right = jcc(c, CC_NE);
+    mem_op(c, 0xF2, false, 0x0F10, XMM_SCRATCH, R12, PAYLOAD_OF(slot));
+    mem_op(c, 0xF2, false, 0x0F58, XMM_SCRATCH, R12, PAYLOAD_OF(slot + 1));
+    mem_op(c, 0xF2, false, 0x0F11, XMM_SCRATCH, R12, PAYLOAD_OF(slot));
+    int join = jmp(c);
+
+    bind(c, slow_left);
+    bind(c, slow_right);
+    load_args(c, true, slot);
+    call_checked(c, (void*)jit_add);
+    bind(c, join);
+
+    c->depth -= 2;
+    push_operand(c, IN_SLOT, slot);
+    c->slot_type[slot] = TYPE_UNKNOWN;
+}
+
+/* Compare two numbers; returns the condition code that holds when the
+ * comparison does */
+static uint8_t compare(jit_compiler* c, bool less)
+{
+    operand right = pop_operand(c);
+    operand left = pop_operand(c);
+    /* ucomisd x, y sets "above" only for ordered x > y */
+    operand first = less ? right : left;
+    operand second = less ? left : right;
+    int xmm = load_number(c, first);
+    sse_with_operand(c, 0x66, 0x0F2E, xmm, second);
+    c->xmm_used[xmm] = false;
+    free_xmm(c, second);
+    return CC_A;
+}
+
+static uint8_t integer_compare(jit_compiler* c, bool less)
+{
+    operand right = pop_operand(c);
+    operand left = pop_operand(c);
+    int_with_operand(c, 0x8B, left);
+    int_with_operand(c, 0x3B, right); /* cmp rax, right */
+    return less ? CC_L : CC_G;
+}
+
+static bool pops_on_both_paths(jit_compiler* c, int jump_offset)
+{
+    uint8_t* code = c->chunk->code;
+    if (code[jump_offset] != OP_JUMP_IF_FALSE || c->is_target[jump_offset])
+        return false;
+
+    int target = jump_offset + 3 + ((code[jump_offset + 1] << 8) | code[jump_offset + 2]);
+    return code[jump_offset + 3] == OP_POP && code[target] == OP_POP;
+}
+
+/* Returns the bytecode length consumed, fusing a following conditional
+ * jump whose condition is popped straight away on both paths */
+static int comparison(jit_compiler* c, uint8_t instruction, bool less)
+{
+    int next = c->offset + 1;
+    operand right = c->stack[c->depth - 1];
+    operand left = c->stack[c->depth - 2];
+    uint8_t holds;
+    bool int_form = instruction == OP_LESS_INT || instruction == OP_GREATER_INT;
+    if (int_form ? int_operand(c, left) && int_operand(c, right)
+                 : known_int(c, left) && known_int(c, right))
+        holds = integer_compare(c, less);
+    else if (instruction == OP_LESS_NUM || instruction == OP_GREATER_NUM ||
+            (!int_form && known_numeric(c, left) && known_numeric(c, right)))
+        holds = compare(c, less);
+    else {
+        call_binary(c, less ? OP_LESS : OP_GREATER);
+        return 1;
+    }
+
+    if (pops_on_both_paths(c, next)) {
+        uint8_t* code = c->chunk->code;
+        int target = next + 3 + ((code[next + 1] << 8) | code[next + 2]);
+        /* The condition itself is dead; keep a placeholder for the pops */
+        push_operand(c, IN_SLOT, c->depth);
+        c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+        flush(c); /* only moves, which leave the flags alone */
+        record_target_depth(c, target);
+        add_fixup(&c->jumps, &c->jump_count, jcc(c, holds ^ 1), target);
+        return 4;
+    }
+
+    setcc_al(c, holds);
+    push_operand(c, IN_SLOT, c->depth);
+    store_bool_al(c, c->depth - 1);
+    return 1;
+}
+
+static void equal(jit_compiler* c)
+{
+    operand right = c->stack[c->depth - 1];
+    operand left = c->stack[c->depth - 2];
+    if (known_number(c, left) && known_number(c, right)) {
+        c->depth -= 2;
+        int xmm = load_number(c, left);
+        sse_with_operand(c, 0x66, 0x0F2E, xmm, right);
+        c->xmm_used[xmm] = false;
+        free_xmm(c, right);
+        setcc_al(c, CC_E);
+        emit8(c, 0x0F);
+        emit8(c, 0x9B);
+        emit8(c, 0xC1); /* setnp cl */
+        emit8(c, 0x20);
+        emit8(c, 0xC8); /* and al, cl */
+        push_operand(c, IN_SLOT, c->depth);
+        store_bool_al(c, c->depth - 1);
+        return;
+    }
+
+    flush(c);
+    load_args(c, true, c->depth - 2);
+    call_helper(c, (void*)jit_equal);
+    c->depth -= 1;
+    c->slot_type[c->depth - 1] = VAL_BOOL;
+}
+
+static void logical_not(jit_compiler* c)
+{
+    int slot = c->depth - 1;
+    if (known_number(c, c->stack[slot])) {
+        free_xmm(c, c->stack[slot]);
+        emit8(c, 0x31);
+        emit8(c, 0xC0); /* xor eax, eax */
+        store_bool_al(c, slot);
+        return;
+    }
+
+    materialize(c, slot);
+    emit8(c, 0xB0);
+    emit8(c, 0x01); /* mov al, 1 */
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), VAL_NIL);
+    int done_nil = jcc(c, CC_E);
+    emit8(c, 0x31);
+    emit8(c, 0xC0); /* xor eax, eax */
+    cmp_dword_imm8(c, R12, TYPE_OF(slot), VAL_BOOL);
+    int done_other = jcc(c, CC_NE);
+    cmp_byte_imm8(c, R12, PAYLOAD_OF(slot), 0);
+    setcc_al(c, CC_E);
+    bind(c, done_nil);
+    bind(c, done_other);
+    store_bool_al(c, slot);
+}
+
+static void negate(jit_compiler* c)
+{
+    if (!known_number(c, c->stack[c->depth - 1])) {
+        flush(c);
+        int slot = c->depth - 1;
+        load_args(c, true, slot);
+        call_checked(c, (void*)jit_negate);
+        c->slot_type[slot] = TYPE_UNKNOWN;
+        return;
+    }
+
+    operand op = pop_operand(c);
+    int xmm = load_number(c, op);
+    mov_imm64(c, RAX, 0x8000000000000000ull);
+    reg_op(c, 0x66, true, 0x0F6E, XMM_SCRATCH, RAX); /* movq xmm14, rax */
+    reg_op(c, 0x66, false, 0x0F57, xmm, XMM_SCRATCH); /* xorpd */
+    push_operand(c, IN_XMM, xmm);
+}
+
+static void get_local(jit_compiler* c, int local)
+{
+    /* Slots above the stack hold -O temporaries and are always in memory */
+    if (local < c->depth)
+        materialize(c, local);
+    push_operand(c, IN_LOCAL, local);
+}
+
+static void set_local(jit_compiler* c, int local)
+{
+    int top = c->depth - 1;
+    operand val = c->stack[top];
+    if (local == top) {
+        materialize(c, top);
+        return;
+    }
+
+    /* Anything still reading the old value must take its copy first */
+    for (int i = 0; i < c->depth; i++) {
+        if (i != top && c->stack[i].kind == IN_LOCAL && c->stack[i].index == local)
+            materialize(c, i);
+    }
+
+    if (local < c->depth)
+        free_xmm(c, c->stack[local]);
+    switch (val.kind) {
+        case IN_LOCAL:
+        case IN_SLOT:
+            if (val.index != local)
+                copy_slot(c, val.index, local);
+            break;
+        case IN_CONSTANT: {
+            value constant = c->chunk->constants.values[val.index];
+            uint64_t payload;
+            memcpy(&payload, &constant.as, sizeof(payload));
+            store_imm32(c, R12, TYPE_OF(local), constant.type);
+            mov_imm64(c, RAX, payload);
+            mem_op(c, 0, true, 0x89, RAX, R12, PAYLOAD_OF(local));
+            c->slot_type[local] = constant.type;
+            break;
+        }
+        case IN_XMM:
+            if (c->slot_type[local] != VAL_NUMBER)
+                store_imm32(c, R12, TYPE_OF(local), VAL_NUMBER);
+            mem_op(c, 0xF2, false, 0x0F11, val.index, R12, PAYLOAD_OF(local));
+            c->slot_type[local] = VAL_NUMBER;
+            break;
+    }
+    if (local < c->depth)
+        c->stack[local] = (operand){IN_SLOT, local};
+}
+
+/* Inline cache probe shared by global reads and writes. Leaves rcx pointing
+ * at the cached entry and returns the rel32 to patch for a miss. */
+static int global_cache_probe(jit_compiler* c, uint8_t* ip)
+{
+    global_cache* cache = &c->chunk->caches[(ip[2] << 8) | ip[3]];
+    mov_imm64(c, RCX, (uint64_t)(uintptr_t)cache);
+    mem_op(c, 0, false, 0x8B, RAX, RCX, (int32_t)offsetof(global_cache, version)); /* mov eax, [rcx] */
+    mem_op(c, 0, false, 0x3B, RAX, R13, (int32_t)(offsetof(VM, globals) + offsetof(table, version)));
+    int miss = jcc(c, CC_NE);
+    mem_op(c, 0, true, 0x63, RAX, RCX, (int32_t)offsetof(global_cache, index)); /* movsxd rax, [rcx + index] */
+    reg_op(c, 0, true, 0x6B, RAX, RAX); /* imul rax, rax, sizeof(entry) */
+    emit8(c, (uint8_t)sizeof(entry));
+    mem_op(c, 0, true, 0x8B, RCX, R13, (int32_t)(offsetof(VM, globals) + offsetof(table, entries)));
+    reg_op(c, 0, true, 0x01, RAX, RCX); /* add rcx, rax */
+    return miss;
+}
+
+static void get_global(jit_compiler* c, uint8_t* ip)
+{
+    flush(c);
+    int slot = c->depth;
+    int miss = global_cache_probe(c, ip);
+    mem_op(c, 0xF3, false, 0x0F6F, XMM_COPY, RCX, (int32_t)offsetof(entry, value));
+    mem_op(c, 0xF3, false, 0x0F7F, XMM_COPY, R12, SLOT(slot));
+    int join = jmp(c);
+
+    bind(c, miss);
+    load_args(c, true, slot);
+    call_checked(c, (void*)jit_get_global);
+    bind(c, join);
+
+    push_operand(c, IN_SLOT, slot);
+    c->slot_type[slot] = TYPE_UNKNOWN;
+}
+
+static void set_global(jit_compiler* c, uint8_t* ip)
+{
+    flush(c);
+    int slot = c->depth - 1;
+    int miss = global_cache_probe(c, ip);
+    mem_op(c, 0xF3, false, 0x0F6F, XMM_COPY, R12, SLOT(slot));
+    mem_op(c, 0xF3, false, 0x0F7F, XMM_COPY, RCX, (int32_t)offsetof(entry, value));
+    int join = jmp(c);
+
+    bind(c, miss);
+    load_args(c, true, slot);
+    call_checked(c, (void*)jit_set_global);
+    bind(c, join);
+}
+
+/* Leave compiled code so run() resumes at the current instruction */
+static void side_exit(jit_compiler* c)
+{
+    flush(c);
+    mem_op(c, 0, true, 0x8D, RAX, R12, SLOT(c->depth)); /* lea rax, [r12 + depth] */
+    mem_op(c, 0, true, 0x89, RAX, R13, (int32_t)offsetof(VM, stack_top));
+    mov_imm64(c, RAX, (uint64_t)(uintptr_t)&c->chunk->code[c->offset]);
+    mem_op(c, 0, true, 0x89, RAX, R13, (int32_t)offsetof(VM, ip));
+    bind_to(c, jmp(c), c->exit_label);
+}
+
+/* dec qword [vm->fuel], branching to where once fuel remains. Out of fuel,
+ * leave through a side exit at this instruction, where run() yields. */
+static void consume_fuel(jit_compiler* c, int where)
+{
+    mem_op(c, 0, true, 0xFF, 1, R13, (int32_t)offsetof(VM, fuel));
+    int enough = jcc(c, CC_NS);
+    if (where < 0) {
+        side_exit(c);
+        bind(c, enough);
+    } else {
+        bind_to(c, enough, where);
+        side_exit(c);
+    }
+}
+
+static uint8_t generic_form(uint8_t instruction)
+{
+    switch (instruction) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR: return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM: return OP_DIVIDE;
+        case OP_GREATER_NUM: return OP_GREATER;
+        case OP_LESS_NUM: return OP_LESS;
+        case OP_ADD_INT: return OP_ADD;
+        case OP_SUBTRACT_INT: return OP_SUBTRACT;
+        case OP_MULTIPLY_INT: return OP_MULTIPLY;
+        case OP_GREATER_INT: return OP_GREATER;
+        case OP_LESS_INT: return OP_LESS;
+        default: return instruction;
+    }
+}
+
+/* Prologue that enters at an arbitrary jump target, and the shared exits */
+static void emit_entry_and_exits(jit_compiler* c)
+{
+    emit8(c, 0x55);                         /* push rbp */
+    reg_op(c, 0, true, 0x89, 4, 5);         /* mov rbp, rsp */
+    emit8(c, 0x41); emit8(c, 0x54);         /* push r12 */
+    emit8(c, 0x41); emit8(c, 0x55);         /* push r13 */
+    reg_op(c, 0, true, 0x89, RDI, R13);     /* mov r13, rdi */
+    reg_op(c, 0, true, 0x89, RSI, R12);     /* mov r12, rsi */
+    emit8(c, 0xFF); emit8(c, 0xE2);         /* jmp rdx */
+
+    jit_status statuses[] = {JIT_DONE, JIT_ERROR, JIT_EXIT, JIT_DEOPT};
+    int* labels[] = {&c->done_label, &c->error_label, &c->exit_label, &c->deopt_label};
+    for (int i = 0; i < 4; i++) {
+        *labels[i] = c->out.count;
+        emit8(c, 0xB8);                     /* mov eax, status */
+        emit32(c, statuses[i]);
+        emit8(c, 0x41); emit8(c, 0x5D);     /* pop r13 */
+        emit8(c, 0x41); emit8(c, 0x5C);     /* pop r12 */
+        emit8(c, 0x5D);                     /* pop rbp */
+        emit8(c, 0xC3);                     /* ret */
+    }
+}
+
+static bool compile_chunk(jit_compiler* c)
+{
+    chunk* chunk = c->chunk;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = generic_form(chunk->code[offset]);
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            c->is_target[offset + 3 + (op == OP_LOOP ? -jump : jump)] = true;
+        }
+        offset += 1 + operand_length[chunk->code[offset]];
+    }
+    c->is_target[0] = true;
+
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t* ip = &chunk->code[offset];
+        c->offset = offset;
+        c->entry_depth = c->depth;
+
+        if (c->is_target[offset]) {
+            if (reachable)
+                flush(c);
+            else if (c->target_depth[offset] != -1)
+                c->depth = c->target_depth[offset];
+            for (int i = 0; i < c->depth; i++)
+                c->stack[i] = (operand){IN_SLOT, i};
+            memset(c->slot_type, TYPE_UNKNOWN, c->chunk->max_stack + 1);
+            memset(c->xmm_used, 0, sizeof(c->xmm_used));
+            c->native[offset] = c->out.count;
+            reachable = true;
+        }
+
+        int length = 1 + operand_length[*ip];
+        switch (generic_form(*ip)) {
+            case OP_CONSTANT:
+                push_operand(c, IN_CONSTANT, ip[1]);
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE: {
+                int slot = c->depth;
+                push_operand(c, IN_SLOT, slot);
+                store_imm32(c, R12, TYPE_OF(slot), *ip == OP_NIL ? VAL_NIL : VAL_BOOL);
+                store_imm32(c, R12, PAYLOAD_OF(slot), *ip == OP_TRUE);
+                store_imm32(c, R12, PAYLOAD_OF(slot) + 4, 0);
+                c->slot_type[slot] = *ip == OP_NIL ? VAL_NIL : VAL_BOOL;
+                break;
+            }
+            case OP_POP:
+                free_xmm(c, pop_operand(c));
+                break;
+            case OP_GET_LOCAL:
+                get_local(c, ip[1]);
+                break;
+            case OP_SET_LOCAL:
+                set_local(c, ip[1]);
+                break;
+            case OP_GET_GLOBAL:
+                get_global(c, ip);
+                break;
+            case OP_DEFINE_GLOBAL:
+                flush(c);
+                load_args(c, true, c->depth - 1);
+                call_helper(c, (void*)jit_define_global);
+                c->depth--;
+                break;
+            case OP_SET_GLOBAL:
+                set_global(c, ip);
+                break;
+            case OP_EQUAL:
+                equal(c);
+                break;
+            case OP_GREATER:
+                length = comparison(c, *ip, false);
+                break;
+            case OP_LESS:
+                length = comparison(c, *ip, true);
+                break;
+            case OP_ADD:
+                add(c, *ip);
+                break;
+            case OP_SUBTRACT:
+                binary(c, *ip, 0x0F5C, 0x2B);
+                break;
+            case OP_MULTIPLY:
+                binary(c, *ip, 0x0F59, 0x0FAF);
+                break;
+            case OP_DIVIDE:
+                binary(c, *ip, 0x0F5E, 0);
+                break;
+            case OP_NOT:
+                logical_not(c);
+                break;
+            case OP_NEGATE:
+                negate(c);
+                break;
+            case OP_PRINT:
+                flush(c);
+                load_args(c, false, c->depth - 1);
+                call_helper(c, (void*)jit_print);
+                c->depth--;
+                break;
+            case OP_JUMP: {
+                int target = offset + 3 + ((ip[1] << 8) | ip[2]);
+                flush(c);
+                record_target_depth(c, target);
+                add_fixup(&c->jumps, &c->jump_count, jmp(c), target);
+                reachable = false;
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                int target = offset + 3 + ((ip[1] << 8) | ip[2]);
+                operand condition = c->stack[c->depth - 1];
+                if (condition.kind == IN_CONSTANT) {
+                    value val = chunk->constants.values[condition.index];
+                    flush(c);
+                    record_target_depth(c, target);
+                    if (IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val)))
+                        add_fixup(&c->jumps, &c->jump_count, jmp(c), target);
+                    break;
+                }
+                flush(c);
+                record_target_depth(c, target);
+                jump_if_falsey(c, c->depth - 1, target);
+                break;
+            }
+            case OP_LOOP: {
+                int target = offset + 3 - ((ip[1] << 8) | ip[2]);
+                flush(c);
+                consume_fuel(c, c->native[target]);
+                reachable = false;
+                break;
+            }
+            case OP_CALL:
+                flush(c);
+                consume_fuel(c, -1);
+                load_args(c, true, c->depth - 1 - ip[1]);
+                call_checked(c, (void*)jit_call);
+                c->depth -= ip[1];
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_ARRAY:
+                flush(c);
+                load_args(c, true, c->depth - ip[1]);
+                call_checked(c, (void*)jit_array);
+                c->depth += 1 - ip[1];
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_GET_INDEX:
+                flush(c);
+                load_args(c, true, c->depth - 2);
+                call_checked(c, (void*)jit_get_index);
+                c->depth -= 1;
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_SET_INDEX:
+                flush(c);
+                load_args(c, true, c->depth - 3);
+                call_checked(c, (void*)jit_set_index);
+                c->depth -= 2;
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_MAP:
+                flush(c);
+                load_args(c, true, c->depth - 2 * ip[1]);
+                call_checked(c, (void*)jit_map);
+                c->depth += 1 - 2 * ip[1];
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_DELETE_INDEX:
+                flush(c);
+                load_args(c, true, c->depth - 2);
+                call_checked(c, (void*)jit_delete_index);
+                c->depth -= 1;
+                c->slot_type[c->depth - 1] = TYPE_UNKNOWN;
+                break;
+            case OP_RETURN:
+                flush(c);
+                mem_op(c, 0, true, 0x8D, RAX, R12, SLOT(c->depth));
+                mem_op(c, 0, true, 0x89, RAX, R13, (int32_t)offsetof(VM, stack_top));
+                bind_to(c, jmp(c), c->done_label);
+                reachable = false;
+                break;
+            default:
+                side_exit(c);
+                reachable = false;
+                break;
+        }
+
+        offset += length;
+    }
+
+    for (int i = 0; i < c->jump_count; i++)
+        bind_to(c, c->jumps[i].position, c->native[c->jumps[i].target]);
+
+    /* Deopt stubs: put the operands back in their slots and leave so run()
+     * redoes the instruction generically, raising any runtime error itself */
+    for (int i = 0; i < c->deopt_count; i++) {
+        deopt* d = &c->deopts[i];
+        bind(c, d->position);
+        for (int slot = 0; slot < d->depth; slot++)
+            store_operand(c, d->stack[slot], slot);
+        mem_op(c, 0, true, 0x8D, RAX, R12, SLOT(d->depth));
+        mem_op(c, 0, true, 0x89, RAX, R13, (int32_t)offsetof(VM, stack_top));
+        mov_imm64(c, RAX, (uint64_t)(uintptr_t)&chunk->code[d->offset]);
+        mem_op(c, 0, true, 0x89, RAX, R13, (int32_t)offsetof(VM, ip));
+        bind_to(c, jmp(c), c->deopt_label);
+    }
+
+    return true;
+}
+
+jit_code* jit_compile(chunk* chunk)
+{
+    jit_compiler c = {0};
+    c.chunk = chunk;
+    c.stack = (operand*)malloc(sizeof(operand) * (chunk->max_stack + 1));
+    c.slot_type = (int8_t*)malloc(chunk->max_stack + 1);
+    c.native = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    c.is_target = (bool*)calloc(chunk->count + 1, sizeof(bool));
+    c.target_depth = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    for (int i = 0; i <= chunk->count; i++) {
+        c.native[i] = -1;
+        c.target_depth[i] = -1;
+    }
+
+    emit_entry_and_exits(&c);
+    bool compiled = compile_chunk(&c);
+
+    jit_code* code = NULL;
+    if (compiled) {
+        void* memory = mmap(NULL, c.out.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memcpy(memory, c.out.code, c.out.count);
+            if (mprotect(memory, c.out.count, PROT_READ | PROT_EXEC) == 0) {
+                code = (jit_code*)malloc(sizeof(jit_code));
+                code->memory = (uint8_t*)memory;
+                code->size = c.out.count;
+                code->entries = c.native;
+                c.native = NULL;
+            } else
+                munmap(memory, c.out.count);
+        }
+    }
+
+    free(c.out.code);
+    free(c.stack);
+    free(c.slot_type);
+    free(c.native);
+    free(c.is_target);
+    free(c.target_depth);
+    free(c.jumps);
+    for (int i = 0; i < c.deopt_count; i++)
+        free(c.deopts[i].stack);
+    free(c.deopts);
+    return code;
+}
+
+typedef jit_status (*jit_entry)(VM* vm, value* stack, void* target);
+
+jit_status jit_run(VM* vm, jit_code* code, int offset)
+{
+    if (code->entries[offset] < 0)
+        return JIT_EXIT;
+
+    /* run() already made room for the chunk, so it can carry on where
+     * the stack could not grow */
+    if (!ensure_stack(vm, vm->chunk->max_stack))
+        return JIT_EXIT;
+    jit_entry entry = (jit_entry)(void*)code->memory;
+    return entry(vm, vm->stack, code->memory + code->entries[offset]);
+}
+
+void free_jit_code(jit_code* code)
+{
+    munmap(code->memory, code->size);
+    free(code->entries);
+    free(code);
+}
+
+#else
+
+/* No code generator for this platform; everything runs in run() */
+jit_code* jit_compile(chunk* chunk)
+{
+    return NULL;
+}
+
+jit_status jit_run(VM* vm, jit_code* code, int offset)
+{
+    return JIT_EXIT;
+}
+
+void free_jit_code(jit_code* code)
+{
+}
+
+#endif
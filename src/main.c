@@ -5,11 +5,38 @@
 #include "common.h"
 #include "interpreter.h"
 
-static void run_file(polity_interpreter* interpreter, const char* path)
+static bool has_extension(const char* path, const char* extension)
 {
+	size_t length = strlen(path);
+	return length >= strlen(extension) && strcmp(&path[length - strlen(extension)], extension) == 0;
+}
+
+/* Bytes in "64M" and the like: a count with an optional k, M or G suffix */
+static size_t parse_size(const char* text)
+{
+	char* end;
+	size_t size = strtoull(text, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': return size << 10;
+		case 'm': case 'M': return size << 20;
+		case 'g': case 'G': return size << 30;
+		default: return size;
+	}
+}
+
+static void run_file(polity_interpreter* interpreter, const char* path, bool use_cache, bool emit_image)
+{
+	interpret_result result;
+
+	/* Images are mapped and run as they are */
+	if (!emit_image && has_extension(path, ".npi")) {
+		result = interpret_image(interpreter, path);
+		goto done;
+	}
+
 	/* Read file */
-	if (!path || strlen(path) < 3 || strcmp(&path[(int)strlen(path) - 3],".np")) {
-		fprintf(stderr, "Must be file of type .np\n");
+	if (!has_extension(path, ".np")) {
+		fprintf(stderr, "Must be file of type .np or .npi\n");
 		exit(74);
 	}
 
@@ -29,10 +56,23 @@ static void run_file(polity_interpreter* interpreter, const char* path)
 
 	fclose(file);
 
-	/* Execute polity source file */
-	interpret_result result = interpret(interpreter, buffer);
+	/* Execute polity source file, through script.npc unless disabled */
+	interpreter->path = path;
+	if (emit_image) {
+		char* image_path = (char*)malloc(strlen(path) + 2);
+		sprintf(image_path, "%si", path);
+		result = compile_image(interpreter, buffer, image_path);
+		free(image_path);
+	} else if (use_cache) {
+		char* cache_path = (char*)malloc(strlen(path) + 2);
+		sprintf(cache_path, "%sc", path);
+		result = interpret_cached(interpreter, buffer, cache_path);
+		free(cache_path);
+	} else
+		result = interpret(interpreter, buffer);
 	free(buffer);
 
+done:
 	if (result == INTERPRET_COMPILE_ERROR) {
 		printf("Compile error\n");
 		exit(65);
@@ -45,16 +85,114 @@ static void run_file(polity_interpreter* interpreter, const char* path)
 
 int main(int argc, const char* argv[])
 {
-	polity_interpreter* interpreter = (polity_interpreter*)malloc(sizeof(polity_interpreter));
+	/* The client only forwards the script, so it never starts a VM */
+	if (argc == 4 && strcmp(argv[1], "--client") == 0)
+		return run_client(argv[2], argv[3]);
+
+	polity_interpreter* interpreter = (polity_interpreter*)calloc(1, sizeof(polity_interpreter));
 	interpreter->vm = init_vm();
-	
-	if (argc == 2) {
-		run_file(interpreter, argv[1]);
-	} else {
-		fprintf(stderr, "Usage: polity [path_to_file.np]\n");
+	const char* path = NULL;
+	bool use_cache = true;
+	bool emit_image = false;
+	bool memory_stats = false;
+	const char* socket_path = NULL;
+	const char* batch_directory = NULL;
+	int jobs = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--profile") == 0) {
+			interpreter->vm->profile = (profile_stats*)calloc(1, sizeof(profile_stats));
+		} else if (strcmp(argv[i], "--register") == 0) {
+			interpreter->vm->engine = ENGINE_REGISTER;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			interpreter->vm->engine = ENGINE_JIT;
+		} else if (strcmp(argv[i], "-O") == 0) {
+			interpreter->vm->optimize = true;
+		} else if (strcmp(argv[i], "--trace-tiers") == 0) {
+			interpreter->vm->trace_tiers = true;
+		} else if (strcmp(argv[i], "-n") == 0) {
+			interpreter->line_mode = true;
+		} else if (strcmp(argv[i], "--no-cache") == 0) {
+			use_cache = false;
+		} else if (strcmp(argv[i], "--emit-image") == 0) {
+			emit_image = true;
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			socket_path = argv[++i];
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_directory = argv[++i];
+		} else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+			interpreter->vm->budget = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+			interpreter->vm->memory.limit = parse_size(argv[++i]);
+		} else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "uring") == 0)
+				interpreter->vm->io_backend = IO_URING;
+			else if (strcmp(argv[i], "threads") == 0)
+				interpreter->vm->io_backend = IO_THREADS;
+			else if (strcmp(argv[i], "blocking") == 0)
+				interpreter->vm->io_backend = IO_BLOCKING;
+			else {
+				path = NULL;
+				break;
+			}
+		} else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "scalar") == 0)
+				interpreter->vm->simd = SIMD_SCALAR;
+			else if (strcmp(argv[i], "sse2") == 0)
+				interpreter->vm->simd = SIMD_SSE2;
+			else if (strcmp(argv[i], "avx") == 0)
+				interpreter->vm->simd = SIMD_AVX;
+			else {
+				path = NULL;
+				break;
+			}
+		} else if (strcmp(argv[i], "--memory-stats") == 0) {
+			memory_stats = true;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			jobs = interpreter->vm->jobs = atoi(argv[++i]);
+		} else if (!path) {
+			path = argv[i];
+		} else {
+			path = NULL;
+			break;
+		}
+	}
+
+	if (batch_directory && !path && !socket_path) {
+		int status = run_batch(interpreter->vm, batch_directory, jobs, use_cache);
+		free_vm(interpreter->vm);
+		free(interpreter);
+		return status;
+	}
+
+	if (socket_path && !path && !batch_directory) {
+		int status = serve(interpreter, socket_path);
+		free_vm(interpreter->vm);
+		free(interpreter);
+		return status;
+	}
+
+	if (!path || socket_path || batch_directory) {
+		fprintf(stderr, "Usage: polity [-O] [-n] [--profile] [--register] [--jit] [--trace-tiers] [--no-cache] [--emit-image] [--fuel n]\n"
+				"                     [--memory-limit bytes] [--memory-stats] [--io uring|threads|blocking]\n"
+				"                     [--simd scalar|sse2|avx]\n"
+				"                     [path_to_file.np | image.npi]\n"
+				"       polity [-O] [--register] [--jit] [--fuel n] [--memory-limit bytes] --serve <socket>\n"
+				"       polity --client <socket> path_to_file.np\n"
+				"       polity [-O] [--register] [--jit] [--no-cache] [--fuel n] [--memory-limit bytes] --batch <directory> [-j jobs]\n");
 		exit(64);
 	}
 
+	run_file(interpreter, path, use_cache, emit_image);
+
+	if (interpreter->vm->profile)
+		print_profile(interpreter->vm);
+	if (memory_stats)
+		print_memory(interpreter->vm);
+
 	free_vm(interpreter->vm);
+	free(interpreter);
 	return 0;
 }
\ No newline at end of file
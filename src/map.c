@@ -0,0 +1,370 @@
+#include "interpreter.h"
+
+/* MAPS
+ *
+ * {key: value} builds an obj_map, keyed by numbers and strings. Lookup is
+ * the globals table's scheme: open addressing, linear probing, tombstones
+ * and TABLE_MAX_LOAD. The slots hold positions into a dense array of
+ * entries kept in insertion order, though, rather than the entries
+ * themselves, so growing rehashes the slots without moving an entry and
+ * next() can walk a map that the walk itself is adding to. */
+
+#define MAP_EMPTY -1
+#define MAP_TOMBSTONE -2
+
+static const char* key_problem(value key)
+{
+    if (IS_STRING(key))
+        return NULL;
+    if (!IS_NUMERIC(key))
+        return "Map keys must be numbers or strings";
+    if (TO_NUMBER(key) != TO_NUMBER(key))
+        return "Map keys cannot be NaN";
+    return NULL;
+}
+
+/* 1 and 1.0 are the same key, and so are 0 and -0: ints, and doubles
+ * holding a whole number in the int64_t range, hash that integer, so
+ * ints past 2^53 keep every bit. Other doubles hash their bits. Borrowed
+ * strings are not hashed up front. */
+static uint32_t hash_key(value key)
+{
+    if (IS_STRING(key)) {
+        obj_string* str = AS_STRING(key);
+        return str->borrowed ? hash_string(str->chars, str->length) : str->hash;
+    }
+    uint64_t bits;
+    if (IS_INT(key)) {
+        bits = (uint64_t)AS_INT(key);
+    } else {
+        double number = AS_NUMBER(key);
+        if (number >= -9223372036854775808.0 && number < 9223372036854775808.0
+                && number == (double)(int64_t)number)
+            bits = (uint64_t)(int64_t)number;
+        else
+            memcpy(&bits, &number, sizeof(bits));
+    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/* Strings interned by copy_string() match by pointer. Borrowed line
+ * strings are not interned, so the rest compare by content. Two ints
+ * compare exactly, as in values_equal(); only a double meets a number
+ * as a double. */
+static bool keys_equal(value a, uint32_t hash_a, value b, uint32_t hash_b)
+{
+    if (hash_a != hash_b)
+        return false;
+    if (IS_STRING(a) && IS_STRING(b)) {
+        obj_string* x = AS_STRING(a);
+        obj_string* y = AS_STRING(b);
+        return x == y || (x->length == y->length && memcmp(x->chars, y->chars, x->length) == 0);
+    }
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) == AS_INT(b);
+    return IS_NUMERIC(a) && IS_NUMERIC(b) && TO_NUMBER(a) == TO_NUMBER(b);
+}
+
+/* The slot holding key's position, or else the one it would go in. The
+ * slot count is a power of two, so a mask stands in for the modulo. */
+static int32_t* find_slot(obj_map* map, value key, uint32_t hash)
+{
+    uint32_t mask = map->slot_count - 1;
+    uint32_t index = hash & mask;
+    int32_t* tombstone = NULL;
+    while (1) {
+        int32_t* slot = &map->slots[index];
+
+        if (*slot == MAP_EMPTY)
+            return tombstone != NULL ? tombstone : slot;
+        if (*slot == MAP_TOMBSTONE) {
+            if (tombstone == NULL)
+                tombstone = slot;
+        } else {
+            map_entry* entry = &map->entries[*slot];
+            if (keys_equal(entry->key, entry->hash, key, hash))
+                return slot;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+static int find_position(obj_map* map, value key)
+{
+    if (map->count == 0)
+        return -1;
+    int32_t* slot = find_slot(map, key, hash_key(key));
+    return *slot;
+}
+
+/* Rebuild the slots at slot_count, squeezing deleted entries out of the
+ * entry array on the way. Entries keep their relative order. */
+static bool adjust_capacity(VM* vm, obj_map* map, int slot_count)
+{
+    int capacity = (int)(slot_count * TABLE_MAX_LOAD);
+    size_t grown = 0;
+    if (slot_count > map->slot_count)
+        grown += sizeof(int32_t) * (slot_count - map->slot_count);
+    if (capacity > map->capacity)
+        grown += sizeof(map_entry) * (capacity - map->capacity);
+    if (!memory_available(vm, grown))
+        return false;
+
+    int live = 0;
+    for (int i = 0; i < map->used; i++)
+        if (!IS_NIL(map->entries[i].key))
+            map->entries[live++] = map->entries[i];
+    map->used = live;
+
+    if (capacity > map->capacity) {
+        map->entries = GROW_ARRAY(vm, MEMORY_MAPS, map_entry, map->entries, map->capacity, capacity);
+        map->capacity = capacity;
+    }
+    if (slot_count != map->slot_count) {
+        FREE_ARRAY(vm, MEMORY_MAPS, int32_t, map->slots, map->slot_count);
+        map->slots = ALLOCATE(vm, MEMORY_MAPS, int32_t, slot_count);
+        map->slot_count = slot_count;
+    }
+    for (int i = 0; i < slot_count; i++)
+        map->slots[i] = MAP_EMPTY;
+    for (int i = 0; i < map->used; i++)
+        *find_slot(map, map->entries[i].key, map->entries[i].hash) = i;
+    return true;
+}
+
+static bool insert(VM* vm, obj_map* map, value key, value val)
+{
+    uint32_t hash = hash_key(key);
+    if (map->count > 0) {
+        int32_t* slot = find_slot(map, key, hash);
+        if (*slot >= 0) {
+            map->entries[*slot].value = val;
+            remember_value(vm, val);
+            return true;
+        }
+    }
+
+    if (map->used + 1 > map->slot_count * TABLE_MAX_LOAD) {
+        /* As in table_set(), mostly deleted entries are squeezed out in
+         * place rather than doubling the map */
+        int slot_count = map->slot_count;
+        if (slot_count < 8)
+            slot_count = 8;
+        else if (map->count + 1 > slot_count * TABLE_MAX_LOAD / 2)
+            slot_count *= 2;
+        if (!adjust_capacity(vm, map, slot_count))
+            return false;
+    }
+
+    /* A borrowed line string would change under the key with the next line */
+    if (IS_STRING(key) && AS_STRING(key)->borrowed)
+        key = OBJ_VAL(copy_string(vm, AS_STRING(key)->chars, AS_STRING(key)->length));
+
+    int32_t* slot = find_slot(map, key, hash);
+    map_entry* entry = &map->entries[map->used];
+    entry->key = key;
+    entry->value = val;
+    entry->hash = hash;
+    *slot = map->used++;
+    map->count++;
+    remember_value(vm, key);
+    remember_value(vm, val);
+    return true;
+}
+
+/* OP_MAP: a new map from pair_count key and value pairs. result may alias
+ * items. A repeated key keeps its last value. */
+bool make_map(VM* vm, value* items, int pair_count, value* result)
+{
+    for (int i = 0; i < pair_count; i++) {
+        const char* problem = key_problem(items[2 * i]);
+        if (problem != NULL) {
+            runtime_error(vm, "%s", problem);
+            return false;
+        }
+    }
+    if (!memory_available(vm, sizeof(obj_map))) {
+        out_of_memory(vm);
+        return false;
+    }
+
+    obj_map* map = (obj_map*)reallocate(vm, MEMORY_MAPS, NULL, 0, sizeof(obj_map));
+    memset(map, 0, sizeof(obj_map));
+    map->obj.type = OBJ_MAP;
+    map->obj.next = vm->objects;
+    vm->objects = (struct obj*)map;
+
+    for (int i = 0; i < pair_count; i++) {
+        if (!insert(vm, map, items[2 * i], items[2 * i + 1])) {
+            out_of_memory(vm);
+            return false;
+        }
+    }
+    *result = OBJ_VAL(map);
+    return true;
+}
+
+/* m[key]. A key that is not there reads as nil. */
+bool map_get(VM* vm, obj_map* map, value key, value* result)
+{
+    const char* problem = key_problem(key);
+    if (problem != NULL) {
+        runtime_error(vm, "%s", problem);
+        return false;
+    }
+    int position = find_position(map, key);
+    *result = position >= 0 ? map->entries[position].value : NIL_VAL;
+    return true;
+}
+
+bool map_set(VM* vm, obj_map* map, value key, value val)
+{
+    const char* problem = key_problem(key);
+    if (problem != NULL) {
+        runtime_error(vm, "%s", problem);
+        return false;
+    }
+    if (!insert(vm, map, key, val)) {
+        out_of_memory(vm);
+        return false;
+    }
+    return true;
+}
+
+/* OP_DELETE_INDEX: delete m[key], producing whether key was there. The
+ * entry stays behind as a hole so positions, and walks, are undisturbed. */
+bool delete_index(VM* vm, value container, value key, value* result)
+{
+    if (!IS_MAP(container)) {
+        runtime_error(vm, "Can only delete from maps");
+        return false;
+    }
+    obj_map* map = AS_MAP(container);
+    const char* problem = key_problem(key);
+    if (problem != NULL) {
+        runtime_error(vm, "%s", problem);
+        return false;
+    }
+
+    *result = BOOL_VAL(false);
+    if (map->count == 0)
+        return true;
+    int32_t* slot = find_slot(map, key, hash_key(key));
+    if (*slot < 0)
+        return true;
+
+    map->entries[*slot].key = NIL_VAL;
+    map->entries[*slot].value = NIL_VAL;
+    *slot = MAP_TOMBSTONE;
+    map->count--;
+    *result = BOOL_VAL(true);
+    return true;
+}
+
+/* Maps print as {key: value, ...} in insertion order, and as {...} inside
+ * themselves */
+void print_map(FILE* out, struct obj* object)
+{
+    if (object->marked) {
+        fputs("{...}", out);
+        return;
+    }
+
+    obj_map* map = (obj_map*)object;
+    object->marked = true;
+    fputc('{', out);
+    bool first = true;
+    for (int i = 0; i < map->used; i++) {
+        map_entry* entry = &map->entries[i];
+        if (IS_NIL(entry->key))
+            continue;
+        if (!first)
+            fputs(", ", out);
+        first = false;
+        print_value(out, entry->key);
+        fputs(": ", out);
+        print_value(out, entry->value);
+    }
+    fputc('}', out);
+    object->marked = false;
+}
+
+/* MAP NATIVES */
+static bool expect_map(VM* vm, value val)
+{
+    if (IS_MAP(val))
+        return true;
+    native_error(vm, "Expected a map");
+    return false;
+}
+
+static bool expect_key(VM* vm, value key)
+{
+    const char* problem = key_problem(key);
+    if (problem == NULL)
+        return true;
+    native_error(vm, "%s", problem);
+    return false;
+}
+
+static bool has_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!expect_map(vm, args[0]) || !expect_key(vm, args[1]))
+        return false;
+    *result = BOOL_VAL(find_position(AS_MAP(args[0]), args[1]) >= 0);
+    return true;
+}
+
+/* keys(m): the keys as an array, in insertion order */
+static bool keys_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!expect_map(vm, args[0]))
+        return false;
+    obj_map* map = AS_MAP(args[0]);
+    if (!make_array(vm, NULL, map->count, result))
+        return false;
+    value* keys = AS_ARRAY(*result)->values;
+    for (int i = 0; i < map->used; i++)
+        if (!IS_NIL(map->entries[i].key))
+            *keys++ = map->entries[i].key;
+    return true;
+}
+
+/* next(m, key): the key inserted after key, or the first for nil, and nil
+ * past the last. Keys inserted during a walk are visited by it. */
+static bool next_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)arg_count;
+    if (!expect_map(vm, args[0]))
+        return false;
+    obj_map* map = AS_MAP(args[0]);
+    int position = 0;
+    if (!IS_NIL(args[1])) {
+        if (!expect_key(vm, args[1]))
+            return false;
+        position = find_position(map, args[1]);
+        if (position < 0) {
+            native_error(vm, "Key is not in the map");
+            return false;
+        }
+        position++;
+    }
+
+    while (position < map->used && IS_NIL(map->entries[position].key))
+        position++;
+    *result = position < map->used ? map->entries[position].key : NIL_VAL;
+    return true;
+}
+
+void define_map_natives(VM* vm)
+{
+    define_native(vm, "has", 2, has_native);
+    define_native(vm, "keys", 1, keys_native);
+    define_native(vm, "next", 2, next_native);
+}
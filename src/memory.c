@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "interpreter.h"
+
+/* MEMORY ACCOUNTING
+ *
+ * Strings, table entries, chunk arrays and value stacks are allocated,
+ * grown and freed through reallocate(), which keeps the VM's current and
+ * peak usage and the number of blocks allocated per category. The limit is enforced
+ * where a running script can grow the heap without bound: those paths ask
+ * memory_available() first and raise a runtime error instead of
+ * allocating. Compiling is not limited. */
+
+/* Resize pointer from old_size to new_size bytes, charging the difference
+ * to category. A new_size of 0 frees. A failed resize returns NULL, leaves
+ * pointer alone and charges nothing. */
+void* reallocate(VM* vm, memory_category category, void* pointer, size_t old_size, size_t new_size)
+{
+    void* result = NULL;
+    if (new_size == 0)
+        free(pointer);
+    else if ((result = realloc(pointer, new_size)) == NULL)
+        return NULL;
+
+    memory_stats* memory = &vm->memory;
+    memory->current[category] += new_size - old_size;
+    memory->total += new_size - old_size;
+    if (memory->current[category] > memory->peak[category])
+        memory->peak[category] = memory->current[category];
+    if (memory->total > memory->peak_total)
+        memory->peak_total = memory->total;
+    if (pointer == NULL && new_size > 0)
+        memory->allocations[category]++;
+    return result;
+}
+
+/* Whether size more bytes keep the VM within its limit */
+bool memory_available(VM* vm, size_t size)
+{
+    memory_stats* memory = &vm->memory;
+    if (memory->limit == 0)
+        return true;
+    return memory->total <= memory->limit && size <= memory->limit - memory->total;
+}
+
+void print_memory(VM* vm)
+{
+    static const char* names[MEMORY_CATEGORY_COUNT] = {
+        [MEMORY_STRINGS] = "strings",
+        [MEMORY_TABLES] = "tables",
+        [MEMORY_CHUNKS] = "chunks",
+        [MEMORY_ARRAYS] = "arrays",
+        [MEMORY_MAPS] = "maps",
+        [MEMORY_STACKS] = "stacks",
+        [MEMORY_FILES] = "files",
+    };
+    memory_stats* memory = &vm->memory;
+
+    size_t allocations = 0;
+    fprintf(stderr, "== memory ==\n");
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        fprintf(stderr, "%-16s current %10zu  peak %10zu  allocations %10zu\n",
+                names[i], memory->current[i], memory->peak[i], memory->allocations[i]);
+        allocations += memory->allocations[i];
+    }
+    fprintf(stderr, "%-16s current %10zu  peak %10zu  allocations %10zu\n", "total",
+            memory->total, memory->peak_total, allocations);
+    if (memory->limit)
+        fprintf(stderr, "%-16s %18zu\n", "limit", memory->limit);
+}
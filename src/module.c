@@ -0,0 +1,306 @@
+#define _GNU_SOURCE /* realpath with a NULL buffer */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+
+/* MODULES
+ *
+ * import "module.np"; pulls another file into the program. compile()
+ * compiles the importing script itself, then link_imports() compiles every
+ * module reachable from it on a pool of threads and links the results
+ * into a single chunk.
+ *
+ * Each module compiles on its own VM, which serves as its arena and
+ * string intern table, so workers share nothing but the module list.
+ * Modules are linked in a fixed order however the workers were scheduled:
+ * depth first along import statements, each module once and before the
+ * first script that imports it, so imported code runs first. Linking
+ * re-interns string constants into the program's VM, merges the constant
+ * pools and renumbers the global caches. */
+
+typedef struct {
+    char* path; /* canonical, NULL for a script read from elsewhere */
+    VM* vm; /* owns the strings the chunk refers to */
+    chunk* chunk;
+    char** imports; /* canonical paths, in import order */
+    int import_count;
+    char* errors;
+    size_t errors_size;
+    bool failed;
+    bool visited;
+} module;
+
+typedef struct {
+    VM* settings;
+    module** modules;
+    int count;
+    int capacity;
+    int next; /* first module no worker has claimed */
+    int busy; /* workers compiling a module */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} module_pool;
+
+/* Resolve name against the directory of importer, or the working
+ * directory, into a canonical path. NULL if there is no such file. */
+static char* resolve_import(const char* importer, const char* name)
+{
+    const char* slash = importer ? strrchr(importer, '/') : NULL;
+    if (name[0] == '/' || !slash)
+        return realpath(name, NULL);
+
+    size_t directory = slash - importer + 1;
+    char* joined = (char*)malloc(directory + strlen(name) + 1);
+    memcpy(joined, importer, directory);
+    strcpy(joined + directory, name);
+    char* resolved = realpath(joined, NULL);
+    free(joined);
+    return resolved;
+}
+
+static module* find_module(module_pool* pool, const char* path)
+{
+    for (int i = 0; i < pool->count; i++)
+        if (pool->modules[i]->path && strcmp(pool->modules[i]->path, path) == 0)
+            return pool->modules[i];
+    return NULL;
+}
+
+static module* add_module(module_pool* pool, const char* path)
+{
+    if (pool->capacity < pool->count + 1) {
+        pool->capacity = pool->capacity < 8 ? 8 : pool->capacity * 2;
+        pool->modules = (module**)realloc(pool->modules, sizeof(module*) * pool->capacity);
+    }
+    module* m = (module*)calloc(1, sizeof(module));
+    m->path = path ? strdup(path) : NULL;
+    pool->modules[pool->count++] = m;
+    return m;
+}
+
+/* Add an import to m's list, reporting it to errors if it does not resolve */
+static void add_import(module* m, const char* name, FILE* errors)
+{
+    char* resolved = resolve_import(m->path, name);
+    if (!resolved) {
+        fprintf(errors, "Could not find module \"%s\".\n", name);
+        m->failed = true;
+        return;
+    }
+    m->imports = (char**)realloc(m->imports, sizeof(char*) * (m->import_count + 1));
+    m->imports[m->import_count++] = resolved;
+}
+
+static void compile_module(module_pool* pool, module* m)
+{
+    VM* vm = m->vm = init_vm();
+    vm->optimize = pool->settings->optimize;
+    vm->err = open_memstream(&m->errors, &m->errors_size);
+
+    polity_interpreter interpreter = {0};
+    interpreter.vm = vm;
+    interpreter.path = m->path;
+    interpreter.module = true;
+    interpreter.chunk = (chunk*)calloc(1, sizeof(chunk));
+
+    char* source = read_file(m->path);
+    if (!source) {
+        fprintf(vm->err, "Could not open module \"%s\".\n", m->path);
+        m->failed = true;
+    } else {
+        m->failed = !compile(source, &interpreter);
+        free(source);
+    }
+
+    for (int i = 0; i < interpreter.import_count; i++) {
+        add_import(m, interpreter.imports[i], vm->err);
+        free(interpreter.imports[i]);
+    }
+    free(interpreter.imports);
+
+    if (m->failed)
+        free_chunk(vm, interpreter.chunk);
+    else
+        m->chunk = interpreter.chunk;
+    fclose(vm->err);
+    vm->err = stderr;
+}
+
+static void* compile_worker(void* argument)
+{
+    module_pool* pool = (module_pool*)argument;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        if (pool->next < pool->count) {
+            module* m = pool->modules[pool->next++];
+            pool->busy++;
+            pthread_mutex_unlock(&pool->lock);
+            compile_module(pool, m);
+            pthread_mutex_lock(&pool->lock);
+            pool->busy--;
+            for (int i = 0; i < m->import_count; i++)
+                if (!find_module(pool, m->imports[i]))
+                    add_module(pool, m->imports[i]);
+            pthread_cond_broadcast(&pool->changed);
+        } else if (pool->busy == 0)
+            break;
+        else
+            pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Append m and, ahead of it, everything it imports to order */
+static void order_modules(module_pool* pool, module* m, module** order, int* count)
+{
+    if (m->visited)
+        return;
+    m->visited = true;
+    for (int i = 0; i < m->import_count; i++)
+        order_modules(pool, find_module(pool, m->imports[i]), order, count);
+    order[(*count)++] = m;
+}
+
+/* The linked chunk's index for val, or -1 once the pool is full */
+static int link_constant(VM* vm, chunk* linked, value val)
+{
+    if (IS_STRING(val))
+        val = OBJ_VAL(copy_string(vm, AS_CSTRING(val), AS_STRING(val)->length));
+
+    for (int i = 0; i < linked->constants.count; i++) {
+        value constant = linked->constants.values[i];
+        if (constant.type != val.type)
+            continue;
+        if (IS_NUMBER(val) ? memcmp(&constant.as.number, &val.as.number, sizeof(double)) == 0
+                           : values_equal(constant, val))
+            return i;
+    }
+    if (linked->constants.count == UINT8_COUNT)
+        return -1;
+    return add_constant(vm, linked, val);
+}
+
+/* Append m's code to linked, dropping its OP_RETURN unless it runs last */
+static bool link_module(VM* vm, chunk* linked, chunk* code, bool last)
+{
+    int start = linked->count;
+    int cache_base = linked->cache_count;
+    for (int i = 0; i < (last ? code->count : code->count - 1); i++)
+        write_chunk(vm, linked, code->code[i], code->lines[i]);
+
+    for (int offset = start; offset < linked->count; offset += 1 + operand_length[linked->code[offset]]) {
+        uint8_t* ip = &linked->code[offset + 1];
+        switch (linked->code[offset]) {
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                int cache = ((ip[1] << 8) | ip[2]) + cache_base;
+                if (cache > UINT16_MAX)
+                    return false;
+                ip[1] = (uint8_t)(cache >> 8);
+                ip[2] = (uint8_t)cache;
+            }
+                /* fall through */
+            case OP_CONSTANT:
+            case OP_DEFINE_GLOBAL: {
+                int constant = link_constant(vm, linked, code->constants.values[ip[0]]);
+                if (constant < 0)
+                    return false;
+                ip[0] = (uint8_t)constant;
+                break;
+            }
+        }
+    }
+
+    linked->cache_count += code->cache_count;
+    if (code->max_stack > linked->max_stack)
+        linked->max_stack = code->max_stack;
+    return true;
+}
+
+/* Compile the modules interpreter->chunk imports and link them ahead of
+ * it, replacing interpreter->chunk. Returns false after reporting errors. */
+bool link_imports(polity_interpreter* interpreter)
+{
+    VM* vm = interpreter->vm;
+    module_pool pool = {0};
+    pool.settings = vm;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    char* root_path = interpreter->path ? realpath(interpreter->path, NULL) : NULL;
+    module* root = add_module(&pool, root_path);
+    free(root_path);
+    root->chunk = interpreter->chunk;
+    for (int i = 0; i < interpreter->import_count; i++)
+        add_import(root, interpreter->imports[i], vm->err);
+    for (int i = 0; i < root->import_count; i++)
+        if (!find_module(&pool, root->imports[i]))
+            add_module(&pool, root->imports[i]);
+    pool.next = 1;
+
+    /* The calling thread works alongside the pool */
+    int jobs = vm->jobs > 0 ? vm->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t* workers = (pthread_t*)calloc(jobs, sizeof(pthread_t));
+    for (int i = 1; i < jobs; i++)
+        pthread_create(&workers[i], NULL, compile_worker, &pool);
+    compile_worker(&pool);
+    for (int i = 1; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    module** order = (module**)malloc(sizeof(module*) * pool.count);
+    int count = 0;
+    order_modules(&pool, root, order, &count);
+
+    bool linked_ok = !root->failed;
+    for (int i = 0; i < count; i++) {
+        if (order[i]->errors_size > 0)
+            fprintf(vm->err, "In module \"%s\":\n%s", order[i]->path, order[i]->errors);
+        linked_ok = linked_ok && !order[i]->failed;
+    }
+
+    chunk* linked = (chunk*)calloc(1, sizeof(chunk));
+    for (int i = 0; linked_ok && i < count; i++) {
+        if (!link_module(vm, linked, order[i]->chunk, order[i] == root)) {
+            fprintf(vm->err, "Too many constants or global accesses to link this program.\n");
+            linked_ok = false;
+        }
+    }
+
+    if (linked_ok) {
+        linked->caches = ALLOCATE(vm, MEMORY_CHUNKS, global_cache, linked->cache_count);
+        if (linked->cache_count > 0)
+            memset(linked->caches, 0, sizeof(global_cache) * linked->cache_count);
+        free_chunk(vm, interpreter->chunk);
+        interpreter->chunk = linked;
+    } else
+        free_chunk(vm, linked);
+
+    for (int i = 0; i < pool.count; i++) {
+        module* m = pool.modules[i];
+        if (m != root) {
+            if (m->chunk)
+                free_chunk(m->vm, m->chunk);
+            if (m->vm)
+                free_vm(m->vm);
+        }
+        for (int j = 0; j < m->import_count; j++)
+            free(m->imports[j]);
+        free(m->imports);
+        free(m->errors);
+        free(m->path);
+        free(m);
+    }
+    free(pool.modules);
+    free(order);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+    return linked_ok;
+}
@@ -0,0 +1,21 @@
+#include <time.h>
+
+#include "interpreter.h"
+
+/* BUILTIN NATIVE FUNCTIONS */
+static bool clock_native(VM* vm, int arg_count, value* args, value* result)
+{
+    (void)vm;
+    (void)arg_count;
+    (void)args;
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+void define_builtins(VM* vm)
+{
+    define_native(vm, "clock", 0, clock_native);
+    define_file_natives(vm);
+    define_array_natives(vm);
+    define_map_natives(vm);
+}
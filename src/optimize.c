@@ -0,0 +1,1393 @@
+#include "interpreter.h"
+
+/* OPTIMIZER
+ *
+ * With -O a finished chunk is lifted into expression trees, optimized and
+ * emitted again. Stack bytecode is already a post-order walk of the source
+ * expressions, so each basic block decompiles into an ordered list of
+ * statements ("roots") over trees whose nodes are the original
+ * instructions. Emitting roots in order and trees in post-order reproduces
+ * the original evaluation order, and every pass below keeps it.
+ *
+ * Local reads are numbered by the store they observe, which gives values
+ * SSA names within a block. Copy propagation and constant folding happen
+ * while the trees are built. Slot types are inferred over the control flow
+ * graph. Backward liveness removes dead stores, and pure statements that
+ * cannot fail are dropped. Invariant trees that cannot fail move out of
+ * loops, and common subexpressions are found by value numbering. Values
+ * computed once and used again are kept in temporary slots above the
+ * deepest point the chunk's operand stack reaches. Jumps to jumps are
+ * threaded through to their final destination. */
+
+#define NO_NODE -1
+#define NO_BLOCK -1
+#define IR_RESIDENT UINT8_MAX /* a value already sitting in its stack slot */
+
+typedef enum {
+    TYPE_NONE, /* nothing known yet */
+    TYPE_NUMBER, /* an integer or a double */
+    TYPE_ANY
+} slot_type;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    bool dead; /* a local store nothing reads */
+    int operand;
+    int cache;
+    int version; /* store a local read observes, or global writes before a global read */
+    int line;
+    int kids;
+    int kid_count;
+    int temp; /* slot the value is saved to for later reuse, or -1 */
+    int reuse; /* slot to read instead of evaluating the tree, or -1 */
+} ir_node;
+
+typedef enum {
+    ROOT_PUSH,   /* value stays on the stack: a local or a value crossing blocks */
+    ROOT_POP,    /* expression statement */
+    ROOT_DROP,   /* pop of a value already on the stack */
+    ROOT_PRINT,
+    ROOT_DEFINE,
+    ROOT_REMOVED
+} root_kind;
+
+typedef struct {
+    root_kind kind;
+    int node;
+    int operand; /* stack slot of a push, name constant of a definition */
+    int line;
+} ir_root;
+
+typedef struct {
+    uint64_t bits[UINT8_COUNT / 64];
+} slot_set;
+
+typedef struct {
+    int start;
+    int end; /* offset of the exit instruction, or of the next block */
+    int depth_in;
+    int depth_out;
+    uint8_t exit; /* OP_JUMP, OP_JUMP_IF_FALSE, OP_LOOP, OP_RETURN, or 0 to fall through */
+    int exit_line;
+    int target;
+    int next;
+    int condition; /* node tested by OP_JUMP_IF_FALSE, if built here */
+    int roots;
+    int root_count;
+    bool reachable;
+    uint8_t types[UINT8_COUNT]; /* slot types on entry */
+    slot_set live; /* slots read before being written, on entry */
+    int loop; /* loop entered through this block, or -1 */
+    int emitted;
+} ir_block;
+
+typedef struct {
+    int entry;
+    bool* blocks;
+    int size;
+    int* hoisted; /* trees computed in the preheader */
+    int hoisted_count;
+    int preheader;
+} ir_loop;
+
+typedef struct {
+    VM* vm; /* charged for the code emitted into the chunk */
+    chunk* chunk;
+    ir_node* nodes;
+    int node_count;
+    int node_capacity;
+    int* kids;
+    int kid_count;
+    int kid_capacity;
+    ir_root* roots;
+    int root_count;
+    int root_capacity;
+    ir_block* blocks;
+    int block_count;
+    int* block_at;
+    ir_loop* loops;
+    int loop_count;
+    int next_temp;
+
+    /* Symbolic stack while building a block */
+    int* items;
+    bool* pending; /* tree not emitted yet */
+    int depth;
+    int versions[UINT8_COUNT];
+    int copies[UINT8_COUNT]; /* literal or local read a slot is known to equal */
+    int epoch;
+
+    /* Output */
+    uint8_t* code;
+    int* lines;
+    int count;
+    int capacity;
+} optimizer;
+
+#define NODE(n) (&o->nodes[n])
+#define KID(n, i) (o->kids[o->nodes[n].kids + (i)])
+
+static bool slot_has(slot_set* set, int slot) { return (set->bits[slot / 64] >> (slot % 64)) & 1; }
+static void slot_add(slot_set* set, int slot) { set->bits[slot / 64] |= 1ull << (slot % 64); }
+static void slot_remove(slot_set* set, int slot) { set->bits[slot / 64] &= ~(1ull << (slot % 64)); }
+
+/* TREE CONSTRUCTION */
+static int add_node(optimizer* o, uint8_t op, int operand, int line)
+{
+    if (o->node_capacity < o->node_count + 1) {
+        o->node_capacity = o->node_capacity < 64 ? 64 : o->node_capacity * 2;
+        o->nodes = (ir_node*)realloc(o->nodes, sizeof(ir_node) * o->node_capacity);
+    }
+
+    o->nodes[o->node_count] = (ir_node){op, TYPE_ANY, false, operand, 0, 0, line, o->kid_count, 0, -1, -1};
+    return o->node_count++;
+}
+
+/* Kids are appended right after their parent is created */
+static void add_kid(optimizer* o, int node, int kid)
+{
+    if (o->kid_capacity < o->kid_count + 1) {
+        o->kid_capacity = o->kid_capacity < 64 ? 64 : o->kid_capacity * 2;
+        o->kids = (int*)realloc(o->kids, sizeof(int) * o->kid_capacity);
+    }
+
+    o->kids[o->kid_count++] = kid;
+    NODE(node)->kid_count++;
+}
+
+static void add_root(optimizer* o, root_kind kind, int node, int operand, int line)
+{
+    if (o->root_capacity < o->root_count + 1) {
+        o->root_capacity = o->root_capacity < 64 ? 64 : o->root_capacity * 2;
+        o->roots = (ir_root*)realloc(o->roots, sizeof(ir_root) * o->root_capacity);
+    }
+
+    o->roots[o->root_count++] = (ir_root){kind, node, operand, line};
+}
+
+static bool is_literal(optimizer* o, int n)
+{
+    uint8_t op = NODE(n)->op;
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+static value literal_value(optimizer* o, int n)
+{
+    switch (NODE(n)->op) {
+        case OP_CONSTANT: return o->chunk->constants.values[NODE(n)->operand];
+        case OP_TRUE: return BOOL_VAL(true);
+        case OP_FALSE: return BOOL_VAL(false);
+        default: return NIL_VAL;
+    }
+}
+
+static bool literal_falsey(optimizer* o, int n)
+{
+    value val = literal_value(o, n);
+    return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
+}
+
+static int literal_node(optimizer* o, value val, int line)
+{
+    if (IS_BOOL(val))
+        return add_node(o, AS_BOOL(val) ? OP_TRUE : OP_FALSE, 0, line);
+
+    value_array* constants = &o->chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (constants->values[i].type == val.type
+                && memcmp(&constants->values[i].as, &val.as, sizeof(val.as)) == 0)
+            return add_node(o, OP_CONSTANT, i, line);
+    }
+    if (constants->count == UINT8_COUNT)
+        return NO_NODE;
+    return add_node(o, OP_CONSTANT, add_constant(o->vm, o->chunk, val), line);
+}
+
+/* Evaluate an operator on literals at compile time. Anything that would
+ * raise a runtime error is left for run time. */
+static int fold(optimizer* o, uint8_t op, int a, int b, int line)
+{
+    if (!is_literal(o, a) || (b != NO_NODE && !is_literal(o, b)))
+        return NO_NODE;
+
+    value x = literal_value(o, a);
+    value y = b != NO_NODE ? literal_value(o, b) : NIL_VAL;
+    switch (op) {
+        case OP_NOT: return literal_node(o, BOOL_VAL(literal_falsey(o, a)), line);
+        case OP_EQUAL: return literal_node(o, BOOL_VAL(values_equal(x, y)), line);
+        case OP_NEGATE: return IS_NUMERIC(x) ? literal_node(o, number_negate(x), line) : NO_NODE;
+    }
+
+    if (!IS_NUMERIC(x) || !IS_NUMERIC(y))
+        return NO_NODE;
+    switch (op) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: return literal_node(o, number_arithmetic(op, x, y), line);
+        case OP_GREATER: return literal_node(o, BOOL_VAL(number_less(y, x)), line);
+        case OP_LESS: return literal_node(o, BOOL_VAL(number_less(x, y)), line);
+    }
+    return NO_NODE;
+}
+
+/* Whether reads of a slot holding this value may be replaced by a copy */
+static bool copyable(optimizer* o, int n)
+{
+    return is_literal(o, n) || NODE(n)->op == OP_GET_LOCAL;
+}
+
+static void write_slot(optimizer* o, int slot, int value_node)
+{
+    o->versions[slot]++;
+    o->copies[slot] = value_node != NO_NODE && copyable(o, value_node) ? value_node : NO_NODE;
+}
+
+static void push_node(optimizer* o, int node)
+{
+    int slot = o->depth++;
+    o->items[slot] = node;
+    o->pending[slot] = true;
+    write_slot(o, slot, node);
+}
+
+/* Pop the top value for use as an operand */
+static int take(optimizer* o, int line)
+{
+    int slot = --o->depth;
+    int node = o->pending[slot] ? o->items[slot] : add_node(o, IR_RESIDENT, slot, line);
+    write_slot(o, slot, NO_NODE);
+    return node;
+}
+
+/* Emit everything still pending below the top keep values, in stack order */
+static void flush_below(optimizer* o, int keep)
+{
+    for (int slot = 0; slot < o->depth - keep; slot++) {
+        if (o->pending[slot]) {
+            add_root(o, ROOT_PUSH, o->items[slot], slot, NODE(o->items[slot])->line);
+            o->pending[slot] = false;
+        }
+    }
+}
+
+static void get_local(optimizer* o, int slot, int line)
+{
+    int copy = o->copies[slot];
+    if (copy != NO_NODE && (is_literal(o, copy)
+            || o->versions[NODE(copy)->operand] == NODE(copy)->version)) {
+        int node = add_node(o, NODE(copy)->op, NODE(copy)->operand, line);
+        NODE(node)->version = NODE(copy)->version;
+        push_node(o, node);
+        return;
+    }
+
+    int node = add_node(o, OP_GET_LOCAL, slot, line);
+    NODE(node)->version = o->versions[slot];
+    push_node(o, node);
+}
+
+static void apply_operator(optimizer* o, uint8_t op, int arity, int line)
+{
+    int b = arity == 2 ? take(o, line) : NO_NODE;
+    int a = take(o, line);
+    int folded = fold(o, op, a, b, line);
+    if (folded != NO_NODE) {
+        push_node(o, folded);
+        return;
+    }
+
+    int node = add_node(o, op, 0, line);
+    add_kid(o, node, a);
+    if (b != NO_NODE)
+        add_kid(o, node, b);
+    push_node(o, node);
+}
+
+static bool build_block(optimizer* o, ir_block* block)
+{
+    chunk* chunk = o->chunk;
+    o->depth = block->depth_in;
+    for (int slot = 0; slot < o->depth; slot++) {
+        o->items[slot] = NO_NODE;
+        o->pending[slot] = false;
+    }
+    for (int slot = 0; slot < UINT8_COUNT; slot++)
+        o->copies[slot] = NO_NODE;
+    block->roots = o->root_count;
+
+    for (int offset = block->start; offset < block->end; offset += 1 + operand_length[chunk->code[offset]]) {
+        uint8_t* ip = &chunk->code[offset];
+        int line = chunk->lines[offset];
+
+        switch (*ip) {
+            case OP_CONSTANT:
+                push_node(o, add_node(o, OP_CONSTANT, ip[1], line));
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                push_node(o, add_node(o, *ip, 0, line));
+                break;
+            case OP_POP:
+                if (o->pending[o->depth - 1]) {
+                    int node = take(o, line);
+                    flush_below(o, 0);
+                    add_root(o, ROOT_POP, node, 0, line);
+                } else {
+                    write_slot(o, --o->depth, NO_NODE);
+                    add_root(o, ROOT_DROP, NO_NODE, 0, line);
+                }
+                break;
+            case OP_GET_LOCAL:
+                get_local(o, ip[1], line);
+                break;
+            case OP_SET_LOCAL: {
+                int kid = take(o, line);
+                int node = add_node(o, OP_SET_LOCAL, ip[1], line);
+                add_kid(o, node, kid);
+                push_node(o, node);
+                write_slot(o, ip[1], kid);
+                break;
+            }
+            case OP_GET_GLOBAL: {
+                int node = add_node(o, OP_GET_GLOBAL, ip[1], line);
+                NODE(node)->cache = (ip[2] << 8) | ip[3];
+                NODE(node)->version = o->epoch;
+                push_node(o, node);
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                int kid = take(o, line);
+                int node = add_node(o, OP_SET_GLOBAL, ip[1], line);
+                NODE(node)->cache = (ip[2] << 8) | ip[3];
+                add_kid(o, node, kid);
+                push_node(o, node);
+                o->epoch++;
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+            case OP_PRINT: {
+                int kid = take(o, line);
+                flush_below(o, 0);
+                add_root(o, *ip == OP_PRINT ? ROOT_PRINT : ROOT_DEFINE, kid, ip[1], line);
+                o->epoch += *ip == OP_DEFINE_GLOBAL;
+                break;
+            }
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                apply_operator(o, *ip, 2, line);
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                apply_operator(o, *ip, 1, line);
+                break;
+            case OP_CALL: {
+                int args[UINT8_COUNT + 1];
+                for (int i = ip[1]; i >= 0; i--)
+                    args[i] = take(o, line);
+                int node = add_node(o, OP_CALL, ip[1], line);
+                for (int i = 0; i <= ip[1]; i++)
+                    add_kid(o, node, args[i]);
+                push_node(o, node);
+                o->epoch++;
+                break;
+            }
+            case OP_ARRAY: {
+                int items[UINT8_COUNT];
+                for (int i = ip[1] - 1; i >= 0; i--)
+                    items[i] = take(o, line);
+                int node = add_node(o, OP_ARRAY, ip[1], line);
+                for (int i = 0; i < ip[1]; i++)
+                    add_kid(o, node, items[i]);
+                push_node(o, node);
+                break;
+            }
+            case OP_GET_INDEX:
+            case OP_DELETE_INDEX:
+                apply_operator(o, *ip, 2, line);
+                break;
+            case OP_MAP: {
+                int items[2 * UINT8_COUNT];
+                for (int i = 2 * ip[1] - 1; i >= 0; i--)
+                    items[i] = take(o, line);
+                int node = add_node(o, OP_MAP, ip[1], line);
+                for (int i = 0; i < 2 * ip[1]; i++)
+                    add_kid(o, node, items[i]);
+                push_node(o, node);
+                break;
+            }
+            case OP_SET_INDEX: {
+                int val = take(o, line);
+                int index = take(o, line);
+                int node = add_node(o, OP_SET_INDEX, 0, line);
+                add_kid(o, node, take(o, line));
+                add_kid(o, node, index);
+                add_kid(o, node, val);
+                push_node(o, node);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    flush_below(o, 0);
+    block->depth_out = o->depth;
+    block->condition = block->exit == OP_JUMP_IF_FALSE ? o->items[o->depth - 1] : NO_NODE;
+    block->root_count = o->root_count - block->roots;
+    return true;
+}
+
+/* CONTROL FLOW */
+static bool is_exit(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP || op == OP_RETURN;
+}
+
+static int jump_target(chunk* chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return offset + 3 + (chunk->code[offset] == OP_LOOP ? -jump : jump);
+}
+
+static void find_blocks(optimizer* o)
+{
+    chunk* chunk = o->chunk;
+    bool* leader = (bool*)calloc(chunk->count + 1, sizeof(bool));
+    int* target_depth = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    leader[0] = true;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        int next = offset + 1 + operand_length[op];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+            leader[jump_target(chunk, offset)] = true;
+        if (is_exit(op))
+            leader[next] = true;
+        target_depth[offset] = -1;
+        offset = next;
+    }
+    target_depth[chunk->count] = -1;
+
+    for (int offset = 0; offset < chunk->count; offset++)
+        o->block_count += leader[offset];
+    o->blocks = (ir_block*)calloc(o->block_count, sizeof(ir_block));
+    o->block_at = (int*)malloc(sizeof(int) * (chunk->count + 1));
+
+    /* Stack depth on entry follows the same rule the emitter used */
+    int depth = 0;
+    bool falls_through = true;
+    ir_block* block = NULL;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        o->block_at[offset] = NO_BLOCK;
+        if (leader[offset]) {
+            block = block ? block + 1 : o->blocks;
+            o->block_at[offset] = (int)(block - o->blocks);
+            if (!falls_through && target_depth[offset] != -1)
+                depth = target_depth[offset];
+            block->start = offset;
+            block->depth_in = depth;
+            block->loop = -1;
+        }
+
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP)
+            target_depth[jump_target(chunk, offset)] = depth;
+        if (is_exit(op)) {
+            block->exit = op;
+            block->exit_line = chunk->lines[offset];
+            block->end = offset;
+            block->target = op == OP_RETURN ? -1 : jump_target(chunk, offset);
+        }
+
+        if (op == OP_CALL || op == OP_ARRAY)
+            depth -= chunk->code[offset + 1];
+        else if (op == OP_MAP)
+            depth -= 2 * chunk->code[offset + 1];
+        depth += stack_effect[op];
+        falls_through = !(op == OP_JUMP || op == OP_LOOP || op == OP_RETURN);
+        offset += 1 + operand_length[op];
+        if (!block->exit)
+            block->end = offset;
+    }
+
+    for (int i = 0; i < o->block_count; i++) {
+        ir_block* b = &o->blocks[i];
+        if (b->exit && b->exit != OP_RETURN)
+            b->target = o->block_at[b->target];
+        else
+            b->target = NO_BLOCK;
+        b->next = (b->exit == 0 || b->exit == OP_JUMP_IF_FALSE) && i + 1 < o->block_count ? i + 1 : NO_BLOCK;
+    }
+
+    free(leader);
+    free(target_depth);
+}
+
+static int successors(ir_block* block, int* out)
+{
+    int count = 0;
+    if (block->next != NO_BLOCK)
+        out[count++] = block->next;
+    if (block->target != NO_BLOCK)
+        out[count++] = block->target;
+    return count;
+}
+
+/* A conditional jump on a literal always or never jumps */
+static void fold_branches(optimizer* o)
+{
+    for (int i = 0; i < o->block_count; i++) {
+        ir_block* block = &o->blocks[i];
+        if (block->exit != OP_JUMP_IF_FALSE || block->condition == NO_NODE || !is_literal(o, block->condition))
+            continue;
+
+        if (literal_falsey(o, block->condition)) {
+            block->exit = OP_JUMP;
+            block->next = NO_BLOCK;
+        } else {
+            block->exit = 0;
+            block->target = NO_BLOCK;
+        }
+    }
+}
+
+static void mark_reachable(optimizer* o)
+{
+    int* worklist = (int*)malloc(sizeof(int) * o->block_count);
+    int count = 0;
+    o->blocks[0].reachable = true;
+    worklist[count++] = 0;
+
+    while (count > 0) {
+        int out[2];
+        int n = successors(&o->blocks[worklist[--count]], out);
+        for (int i = 0; i < n; i++) {
+            if (!o->blocks[out[i]].reachable) {
+                o->blocks[out[i]].reachable = true;
+                worklist[count++] = out[i];
+            }
+        }
+    }
+    free(worklist);
+}
+
+/* TYPES */
+static uint8_t type_node(optimizer* o, int n, uint8_t* slots)
+{
+    for (int i = 0; i < NODE(n)->kid_count; i++)
+        type_node(o, KID(n, i), slots);
+
+    ir_node* node = NODE(n);
+    uint8_t type = TYPE_ANY;
+    switch (node->op) {
+        case OP_CONSTANT:
+            type = IS_NUMERIC(o->chunk->constants.values[node->operand]) ? TYPE_NUMBER : TYPE_ANY;
+            break;
+        case OP_GET_LOCAL:
+        case IR_RESIDENT:
+            type = slots[node->operand];
+            break;
+        case OP_SET_LOCAL:
+            type = NODE(KID(n, 0))->type;
+            slots[node->operand] = type;
+            break;
+        case OP_SET_GLOBAL:
+            type = NODE(KID(n, 0))->type;
+            break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+            type = TYPE_NUMBER; /* or a runtime error */
+            break;
+        case OP_ADD:
+            if (NODE(KID(n, 0))->type == TYPE_NUMBER && NODE(KID(n, 1))->type == TYPE_NUMBER)
+                type = TYPE_NUMBER;
+            break;
+    }
+    node->type = type;
+    return type;
+}
+
+static void type_block(optimizer* o, ir_block* block, uint8_t* slots)
+{
+    memcpy(slots, block->types, sizeof(block->types));
+    for (int i = block->roots; i < block->roots + block->root_count; i++) {
+        ir_root* root = &o->roots[i];
+        if (root->node == NO_NODE)
+            continue;
+        uint8_t type = type_node(o, root->node, slots);
+        if (root->kind == ROOT_PUSH)
+            slots[root->operand] = type;
+    }
+}
+
+static void infer_types(optimizer* o)
+{
+    uint8_t slots[UINT8_COUNT];
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < o->block_count; i++) {
+            ir_block* block = &o->blocks[i];
+            if (!block->reachable)
+                continue;
+            type_block(o, block, slots);
+
+            int out[2];
+            int n = successors(block, out);
+            for (int s = 0; s < n; s++) {
+                ir_block* next = &o->blocks[out[s]];
+                for (int slot = 0; slot < next->depth_in; slot++) {
+                    uint8_t met = next->types[slot] == TYPE_NONE || next->types[slot] == slots[slot]
+                            ? slots[slot] : TYPE_ANY;
+                    if (met != next->types[slot]) {
+                        next->types[slot] = met;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* No side effects and no way to raise a runtime error */
+static bool is_quiet(optimizer* o, int n)
+{
+    if (NODE(n)->reuse != -1)
+        return true;
+    for (int i = 0; i < NODE(n)->kid_count; i++) {
+        if (!is_quiet(o, KID(n, i)))
+            return false;
+    }
+
+    switch (NODE(n)->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case IR_RESIDENT:
+        case OP_NOT:
+        case OP_EQUAL:
+            return true;
+        case OP_SET_LOCAL:
+            return NODE(n)->dead;
+        case OP_NEGATE:
+            return NODE(KID(n, 0))->type == TYPE_NUMBER;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_LESS:
+            return NODE(KID(n, 0))->type == TYPE_NUMBER && NODE(KID(n, 1))->type == TYPE_NUMBER;
+        default:
+            return false;
+    }
+}
+
+/* DEAD CODE */
+
+/* Walk a tree in reverse evaluation order, updating the live slots */
+static void live_node(optimizer* o, int n, slot_set* live, bool mark)
+{
+    ir_node* node = NODE(n);
+    if (node->op == OP_SET_LOCAL) {
+        if (mark)
+            node->dead = !slot_has(live, node->operand);
+        slot_remove(live, node->operand);
+    } else if (node->op == OP_GET_LOCAL || node->op == IR_RESIDENT) {
+        slot_add(live, node->operand);
+    }
+
+    for (int i = node->kid_count - 1; i >= 0; i--)
+        live_node(o, KID(n, i), live, mark);
+}
+
+static slot_set live_block(optimizer* o, ir_block* block, bool mark)
+{
+    slot_set live = {0};
+    int out[2];
+    int n = successors(block, out);
+    for (int s = 0; s < n; s++) {
+        for (int word = 0; word < UINT8_COUNT / 64; word++)
+            live.bits[word] |= o->blocks[out[s]].live.bits[word];
+    }
+    if (block->exit == OP_JUMP_IF_FALSE)
+        slot_add(&live, block->depth_out - 1);
+
+    for (int i = block->roots + block->root_count - 1; i >= block->roots; i--) {
+        ir_root* root = &o->roots[i];
+        if (root->kind == ROOT_PUSH)
+            slot_remove(&live, root->operand);
+        if (root->node != NO_NODE)
+            live_node(o, root->node, &live, mark);
+    }
+    return live;
+}
+
+static void eliminate_dead_code(optimizer* o)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = o->block_count - 1; i >= 0; i--) {
+            ir_block* block = &o->blocks[i];
+            if (!block->reachable)
+                continue;
+            slot_set live = live_block(o, block, false);
+            if (memcmp(&live, &block->live, sizeof(live)) != 0) {
+                block->live = live;
+                changed = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < o->block_count; i++) {
+        ir_block* block = &o->blocks[i];
+        if (!block->reachable)
+            continue;
+        live_block(o, block, true);
+
+        for (int r = block->roots; r < block->roots + block->root_count; r++) {
+            if (o->roots[r].kind == ROOT_POP && is_quiet(o, o->roots[r].node))
+                o->roots[r].kind = ROOT_REMOVED;
+        }
+    }
+}
+
+/* LOOP INVARIANT CODE MOTION */
+static bool same_tree(optimizer* o, int a, int b);
+
+/* Same operation on the same operands, whatever becomes of a and b */
+static bool same_shape(optimizer* o, int a, int b)
+{
+    ir_node* x = NODE(a);
+    ir_node* y = NODE(b);
+    if (x->op != y->op || x->operand != y->operand || x->kid_count != y->kid_count)
+        return false;
+    for (int i = 0; i < x->kid_count; i++) {
+        if (!same_tree(o, KID(a, i), KID(b, i)))
+            return false;
+    }
+    return true;
+}
+
+static bool same_tree(optimizer* o, int a, int b)
+{
+    if (NODE(a)->reuse != -1 || NODE(b)->reuse != -1)
+        return NODE(a)->reuse == NODE(b)->reuse;
+    return same_shape(o, a, b);
+}
+
+static bool is_invariant(optimizer* o, int n, ir_loop* loop, bool* written)
+{
+    ir_node* node = NODE(n);
+    if (node->reuse != -1)
+        return true;
+
+    switch (node->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return true;
+        case OP_GET_LOCAL:
+            return node->operand < o->blocks[loop->entry].depth_in && !written[node->operand];
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            for (int i = 0; i < node->kid_count; i++) {
+                if (!is_invariant(o, KID(n, i), loop, written))
+                    return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void hoist(optimizer* o, int n, ir_loop* loop, bool* written)
+{
+    ir_node* node = NODE(n);
+    if (node->reuse != -1)
+        return;
+
+    if (node->kid_count > 0 && is_invariant(o, n, loop, written) && is_quiet(o, n)) {
+        for (int i = 0; i < loop->hoisted_count; i++) {
+            if (same_shape(o, loop->hoisted[i], n)) {
+                node->reuse = NODE(loop->hoisted[i])->reuse;
+                return;
+            }
+        }
+        if (o->next_temp >= UINT8_COUNT)
+            return;
+
+        loop->hoisted = (int*)realloc(loop->hoisted, sizeof(int) * (loop->hoisted_count + 1));
+        loop->hoisted[loop->hoisted_count++] = n;
+        node->reuse = o->next_temp++;
+        return;
+    }
+
+    for (int i = 0; i < node->kid_count; i++)
+        hoist(o, KID(n, i), loop, written);
+}
+
+static void mark_written(optimizer* o, int n, bool* written)
+{
+    if (NODE(n)->op == OP_SET_LOCAL && !NODE(n)->dead)
+        written[NODE(n)->operand] = true;
+    for (int i = 0; i < NODE(n)->kid_count; i++)
+        mark_written(o, KID(n, i), written);
+}
+
+/* Natural loops of each back edge. A loop is only optimized when its header
+ * comes first in the code and it is entered through a single block. The
+ * back edge from a for loop's body to its increment does not form one. */
+static void find_loops(optimizer* o)
+{
+    int** preds = (int**)calloc(o->block_count, sizeof(int*));
+    int* pred_count = (int*)calloc(o->block_count, sizeof(int));
+    for (int i = 0; i < o->block_count; i++) {
+        if (!o->blocks[i].reachable)
+            continue;
+        int out[2];
+        int n = successors(&o->blocks[i], out);
+        for (int s = 0; s < n; s++) {
+            preds[out[s]] = (int*)realloc(preds[out[s]], sizeof(int) * (pred_count[out[s]] + 1));
+            preds[out[s]][pred_count[out[s]]++] = i;
+        }
+    }
+
+    int* worklist = (int*)malloc(sizeof(int) * o->block_count);
+    for (int tail = 0; tail < o->block_count; tail++) {
+        ir_block* block = &o->blocks[tail];
+        if (!block->reachable || block->exit != OP_LOOP)
+            continue;
+
+        bool* members = (bool*)calloc(o->block_count, sizeof(bool));
+        int size = 1;
+        int count = 0;
+        members[block->target] = true;
+        if (!members[tail]) {
+            members[tail] = true;
+            size++;
+            worklist[count++] = tail;
+        }
+        bool usable = true;
+        while (count > 0) {
+            int b = worklist[--count];
+            for (int p = 0; p < pred_count[b]; p++) {
+                if (preds[b][p] < block->target)
+                    usable = false;
+                else if (!members[preds[b][p]]) {
+                    members[preds[b][p]] = true;
+                    size++;
+                    worklist[count++] = preds[b][p];
+                }
+            }
+        }
+
+        int entry = NO_BLOCK;
+        for (int b = 0; b < o->block_count && usable; b++) {
+            if (!members[b])
+                continue;
+            for (int p = 0; p < pred_count[b]; p++) {
+                if (members[preds[b][p]])
+                    continue;
+                if (entry != NO_BLOCK && entry != b)
+                    usable = false;
+                entry = b;
+            }
+        }
+        for (int b = 0; b < entry && usable; b++)
+            usable = !members[b];
+
+        if (!usable || entry == NO_BLOCK || o->blocks[entry].loop != -1) {
+            free(members);
+            continue;
+        }
+
+        o->loops = (ir_loop*)realloc(o->loops, sizeof(ir_loop) * (o->loop_count + 1));
+        o->loops[o->loop_count] = (ir_loop){entry, members, size, NULL, 0, 0};
+        o->blocks[entry].loop = o->loop_count++;
+    }
+
+    for (int i = 0; i < o->block_count; i++)
+        free(preds[i]);
+    free(preds);
+    free(pred_count);
+    free(worklist);
+}
+
+static void hoist_invariants(optimizer* o)
+{
+    find_loops(o);
+
+    /* Outer loops first, so an expression moves as far out as it can */
+    for (int done = 0; done < o->loop_count; done++) {
+        ir_loop* loop = NULL;
+        for (int i = 0; i < o->loop_count; i++) {
+            if (o->loops[i].size > 0 && (!loop || o->loops[i].size > loop->size))
+                loop = &o->loops[i];
+        }
+
+        bool written[UINT8_COUNT] = {false};
+        for (int b = 0; b < o->block_count; b++) {
+            if (!loop->blocks[b])
+                continue;
+            ir_block* block = &o->blocks[b];
+            for (int r = block->roots; r < block->roots + block->root_count; r++) {
+                if (o->roots[r].kind == ROOT_PUSH)
+                    written[o->roots[r].operand] = true;
+                if (o->roots[r].node != NO_NODE)
+                    mark_written(o, o->roots[r].node, written);
+            }
+        }
+
+        for (int b = 0; b < o->block_count; b++) {
+            if (!loop->blocks[b])
+                continue;
+            ir_block* block = &o->blocks[b];
+            for (int r = block->roots; r < block->roots + block->root_count; r++) {
+                if (o->roots[r].kind != ROOT_REMOVED && o->roots[r].node != NO_NODE)
+                    hoist(o, o->roots[r].node, loop, written);
+            }
+        }
+        loop->size = -loop->size; /* done */
+    }
+}
+
+/* COMMON SUBEXPRESSIONS */
+typedef struct {
+    int op;
+    int operand;
+    int version;
+    int a;
+    int b;
+} value_key;
+
+typedef struct {
+    value_key* keys;
+    int* numbers;
+    int capacity;
+    int count; /* value numbers handed out */
+    int* used; /* filled entries, to clear between blocks */
+    int used_count;
+    int* of_node;
+    int* available; /* node that computed each value number, or -1 */
+    int next_temp;
+} value_table;
+
+static bool can_share(optimizer* o, int n)
+{
+    switch (NODE(n)->op) {
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GET_GLOBAL:
+            return NODE(n)->reuse == -1;
+        default:
+            return false;
+    }
+}
+
+static int lookup_key(value_table* t, value_key key)
+{
+    uint32_t hash = (uint32_t)key.op * 31u + (uint32_t)key.operand * 131u + (uint32_t)key.version * 257u
+            + (uint32_t)key.a * 65537u + (uint32_t)key.b * 2654435761u;
+    int index = hash & (t->capacity - 1);
+    while (t->numbers[index] != -1) {
+        if (memcmp(&t->keys[index], &key, sizeof(key)) == 0)
+            return t->numbers[index];
+        index = (index + 1) & (t->capacity - 1);
+    }
+
+    t->keys[index] = key;
+    t->numbers[index] = t->count;
+    t->used[t->used_count++] = index;
+    return t->count++;
+}
+
+static void number_node(optimizer* o, value_table* t, int n)
+{
+    for (int i = 0; i < NODE(n)->kid_count; i++)
+        number_node(o, t, KID(n, i));
+
+    ir_node* node = NODE(n);
+    value_key key = {node->op, node->operand, 0, -1, -1};
+    if (node->reuse != -1) {
+        key = (value_key){IR_RESIDENT + 1, node->reuse, 0, -1, -1};
+    } else if (node->op == OP_GET_LOCAL || node->op == OP_GET_GLOBAL) {
+        key.version = node->version;
+    } else if (can_share(o, n)) {
+        key.operand = 0;
+        key.a = t->of_node[KID(n, 0)];
+        key.b = node->kid_count > 1 ? t->of_node[KID(n, 1)] : -1;
+    } else if (!is_literal(o, n)) {
+        t->of_node[n] = t->count++; /* never equal to anything else */
+        return;
+    }
+    t->of_node[n] = lookup_key(t, key);
+}
+
+static void share(optimizer* o, value_table* t, int n)
+{
+    ir_node* node = NODE(n);
+    if (node->reuse != -1)
+        return;
+
+    int number = t->of_node[n];
+    if (can_share(o, n) && t->available[number] != NO_NODE) {
+        ir_node* earlier = NODE(t->available[number]);
+        if (earlier->temp == -1 && t->next_temp < UINT8_COUNT)
+            earlier->temp = t->next_temp++;
+        if (earlier->temp != -1) {
+            node->reuse = earlier->temp;
+            return;
+        }
+    }
+
+    for (int i = 0; i < node->kid_count; i++)
+        share(o, t, KID(n, i));
+    if (can_share(o, n))
+        t->available[number] = n;
+}
+
+static void eliminate_common_subexpressions(optimizer* o)
+{
+    value_table t = {0};
+    t.capacity = 64;
+    while (t.capacity < o->node_count * 2)
+        t.capacity *= 2;
+    t.keys = (value_key*)malloc(sizeof(value_key) * t.capacity);
+    t.numbers = (int*)malloc(sizeof(int) * t.capacity);
+    t.used = (int*)malloc(sizeof(int) * t.capacity);
+    for (int i = 0; i < t.capacity; i++)
+        t.numbers[i] = -1;
+    t.of_node = (int*)malloc(sizeof(int) * o->node_count);
+    t.available = (int*)malloc(sizeof(int) * o->node_count);
+    int highest = o->next_temp;
+
+    for (int b = 0; b < o->block_count; b++) {
+        ir_block* block = &o->blocks[b];
+        if (!block->reachable)
+            continue;
+
+        /* Value numbers and temporaries are local to the block */
+        for (int i = 0; i < t.used_count; i++)
+            t.numbers[t.used[i]] = -1;
+        t.used_count = 0;
+        t.count = 0;
+        t.next_temp = o->next_temp;
+        for (int r = block->roots; r < block->roots + block->root_count; r++) {
+            if (o->roots[r].kind != ROOT_REMOVED && o->roots[r].node != NO_NODE)
+                number_node(o, &t, o->roots[r].node);
+        }
+        for (int i = 0; i < t.count; i++)
+            t.available[i] = NO_NODE;
+        for (int r = block->roots; r < block->roots + block->root_count; r++) {
+            if (o->roots[r].kind != ROOT_REMOVED && o->roots[r].node != NO_NODE)
+                share(o, &t, o->roots[r].node);
+        }
+        if (t.next_temp > highest)
+            highest = t.next_temp;
+    }
+    o->next_temp = highest;
+
+    free(t.keys);
+    free(t.numbers);
+    free(t.used);
+    free(t.of_node);
+    free(t.available);
+}
+
+/* EMISSION */
+static void emit(optimizer* o, uint8_t byte, int line)
+{
+    if (o->capacity < o->count + 1) {
+        int old_capacity = o->capacity;
+        o->capacity = o->capacity < 64 ? 64 : o->capacity * 2;
+        o->code = GROW_ARRAY(o->vm, MEMORY_CHUNKS, uint8_t, o->code, old_capacity, o->capacity);
+        o->lines = GROW_ARRAY(o->vm, MEMORY_CHUNKS, int, o->lines, old_capacity, o->capacity);
+    }
+
+    o->code[o->count] = byte;
+    o->lines[o->count++] = line;
+}
+
+static void emit_node(optimizer* o, int n, bool evaluate)
+{
+    ir_node* node = NODE(n);
+    if (node->reuse != -1 && !evaluate) {
+        emit(o, OP_GET_LOCAL, node->line);
+        emit(o, node->reuse, node->line);
+        return;
+    }
+
+    for (int i = 0; i < node->kid_count; i++)
+        emit_node(o, KID(n, i), false);
+
+    node = NODE(n);
+    switch (node->op) {
+        case IR_RESIDENT:
+            break;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_CALL:
+        case OP_ARRAY:
+        case OP_MAP:
+            emit(o, node->op, node->line);
+            emit(o, node->operand, node->line);
+            break;
+        case OP_SET_LOCAL:
+            if (!node->dead) {
+                emit(o, OP_SET_LOCAL, node->line);
+                emit(o, node->operand, node->line);
+            }
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            emit(o, node->op, node->line);
+            emit(o, node->operand, node->line);
+            emit(o, node->cache >> 8, node->line);
+            emit(o, node->cache & 0xff, node->line);
+            break;
+        default:
+            emit(o, node->op, node->line);
+            break;
+    }
+
+    if (node->temp != -1) {
+        emit(o, OP_SET_LOCAL, node->line);
+        emit(o, node->temp, node->line);
+    }
+}
+
+/* Whether a block emits nothing before its exit */
+static bool is_empty(optimizer* o, ir_block* block)
+{
+    if (block->loop != -1)
+        return false;
+    for (int r = block->roots; r < block->roots + block->root_count; r++) {
+        if (o->roots[r].kind != ROOT_REMOVED)
+            return false;
+    }
+    return true;
+}
+
+/* A jump to an empty block that only jumps on goes straight to where that
+ * block leads. The common case is the end of an if branch in tail position
+ * of a loop body: it jumped to the loop's OP_LOOP, and now loops back to
+ * the header itself, saving a dispatch per iteration. */
+static void thread_jumps(optimizer* o)
+{
+    for (int b = 0; b < o->block_count; b++) {
+        ir_block* block = &o->blocks[b];
+        if (!block->reachable || block->exit != OP_JUMP)
+            continue;
+
+        for (int steps = 0; steps < o->block_count; steps++) {
+            ir_block* target = &o->blocks[block->target];
+            if (!is_empty(o, target))
+                break;
+            if (target->exit == OP_JUMP)
+                block->target = target->target;
+            else if (target->exit == OP_LOOP && target->target <= b) {
+                /* Only a back edge that stays inside the loop, so it does
+                 * not run the preheader again */
+                ir_block* header = &o->blocks[target->target];
+                if (header->loop != -1 && !o->loops[header->loop].blocks[b])
+                    break;
+                block->exit = OP_LOOP;
+                block->target = target->target;
+                break;
+            } else
+                break;
+        }
+    }
+}
+
+/* Jumps into a loop from outside go through its preheader */
+static int destination(optimizer* o, int from, int to)
+{
+    ir_block* block = &o->blocks[to];
+    if (block->loop != -1 && !o->loops[block->loop].blocks[from])
+        return o->loops[block->loop].preheader;
+    return block->emitted;
+}
+
+static bool emit_blocks(optimizer* o)
+{
+    int* jumps = (int*)malloc(sizeof(int) * o->block_count);
+    int next_reachable = NO_BLOCK;
+
+    for (int b = 0; b < o->block_count; b++) {
+        ir_block* block = &o->blocks[b];
+        jumps[b] = -1;
+        if (!block->reachable)
+            continue;
+
+        if (block->loop != -1) {
+            ir_loop* loop = &o->loops[block->loop];
+            loop->preheader = o->count;
+            for (int i = 0; i < loop->hoisted_count; i++) {
+                ir_node* node = NODE(loop->hoisted[i]);
+                emit_node(o, loop->hoisted[i], true);
+                emit(o, OP_SET_LOCAL, node->line);
+                emit(o, node->reuse, node->line);
+                emit(o, OP_POP, node->line);
+            }
+        }
+        block->emitted = o->count;
+
+        for (int r = block->roots; r < block->roots + block->root_count; r++) {
+            ir_root* root = &o->roots[r];
+            if (root->kind != ROOT_REMOVED && root->node != NO_NODE)
+                emit_node(o, root->node, false);
+            switch (root->kind) {
+                case ROOT_POP:
+                case ROOT_DROP:
+                    emit(o, OP_POP, root->line);
+                    break;
+                case ROOT_PRINT:
+                    emit(o, OP_PRINT, root->line);
+                    break;
+                case ROOT_DEFINE:
+                    emit(o, OP_DEFINE_GLOBAL, root->line);
+                    emit(o, root->operand, root->line);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        next_reachable = b + 1;
+        while (next_reachable < o->block_count && !o->blocks[next_reachable].reachable)
+            next_reachable++;
+
+        switch (block->exit) {
+            case OP_JUMP:
+                if (block->target == next_reachable)
+                    break;
+                /* fall through */
+            case OP_JUMP_IF_FALSE:
+                emit(o, block->exit, block->exit_line);
+                jumps[b] = o->count;
+                emit(o, 0xff, block->exit_line);
+                emit(o, 0xff, block->exit_line);
+                break;
+            case OP_LOOP: {
+                int distance = o->count + 3 - destination(o, b, block->target);
+                if (distance > UINT16_MAX) {
+                    free(jumps);
+                    return false;
+                }
+                emit(o, OP_LOOP, block->exit_line);
+                emit(o, (distance >> 8) & 0xff, block->exit_line);
+                emit(o, distance & 0xff, block->exit_line);
+                break;
+            }
+            case OP_RETURN:
+                emit(o, OP_RETURN, block->exit_line);
+                break;
+        }
+    }
+
+    bool fits = true;
+    for (int b = 0; b < o->block_count; b++) {
+        if (jumps[b] == -1)
+            continue;
+        int distance = destination(o, b, o->blocks[b].target) - (jumps[b] + 2);
+        fits = fits && distance <= UINT16_MAX;
+        o->code[jumps[b]] = (distance >> 8) & 0xff;
+        o->code[jumps[b] + 1] = distance & 0xff;
+    }
+    free(jumps);
+    return fits;
+}
+
+static void free_optimizer(optimizer* o)
+{
+    for (int i = 0; i < o->loop_count; i++) {
+        free(o->loops[i].blocks);
+        free(o->loops[i].hoisted);
+    }
+    free(o->loops);
+    free(o->nodes);
+    free(o->kids);
+    free(o->roots);
+    free(o->blocks);
+    free(o->block_at);
+    free(o->items);
+    free(o->pending);
+    FREE_ARRAY(o->vm, MEMORY_CHUNKS, uint8_t, o->code, o->code ? o->capacity : 0);
+    FREE_ARRAY(o->vm, MEMORY_CHUNKS, int, o->lines, o->lines ? o->capacity : 0);
+}
+
+/* Rewrite a freshly compiled chunk. Chunks holding anything the optimizer
+ * does not model are left as they are. */
+void optimize_chunk(VM* vm, chunk* chunk)
+{
+    /* Slot tables are sized for the slots an instruction can name */
+    if (chunk->max_stack >= UINT8_COUNT)
+        return;
+
+    optimizer o = {0};
+    o.vm = vm;
+    o.chunk = chunk;
+    o.next_temp = chunk->max_stack;
+    o.items = (int*)malloc(sizeof(int) * (chunk->max_stack + 1));
+    o.pending = (bool*)malloc(sizeof(bool) * (chunk->max_stack + 1));
+
+    find_blocks(&o);
+    for (int i = 0; i < o.block_count; i++) {
+        if (!build_block(&o, &o.blocks[i])) {
+            free_optimizer(&o);
+            return;
+        }
+    }
+
+    fold_branches(&o);
+    mark_reachable(&o);
+    infer_types(&o);
+    eliminate_dead_code(&o);
+    hoist_invariants(&o);
+    eliminate_common_subexpressions(&o);
+    thread_jumps(&o);
+
+    if (emit_blocks(&o)) {
+        FREE_ARRAY(vm, MEMORY_CHUNKS, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, MEMORY_CHUNKS, int, chunk->lines, chunk->capacity);
+        chunk->code = o.code;
+        chunk->lines = o.lines;
+        chunk->count = o.count;
+        chunk->capacity = o.capacity;
+        if (o.next_temp > chunk->max_stack)
+            chunk->max_stack = o.next_temp;
+        o.code = NULL;
+        o.lines = NULL;
+    }
+    free_optimizer(&o);
+}
@@ -0,0 +1,615 @@
+#include "interpreter.h"
+
+/* REGISTER TRANSLATION
+ *
+ * Stack bytecode is rewritten into three-address register code one basic
+ * block at a time. Each stack slot has a home register of the same number.
+ * Pushes of locals and constants stay symbolic until something needs the
+ * value in its home register, so `a = b + c` on locals becomes a single
+ * REG_ADD that reads b and c and writes a directly. Every block boundary
+ * flushes the symbolic stack so all paths agree on where values live. */
+typedef struct {
+    chunk* source;
+    reg_chunk* code;
+    uint16_t* slots; /* operand currently holding each stack slot */
+    int depth;
+    int last_write; /* instruction whose destination is the top slot, or -1 */
+    int origin;
+    uint16_t nil_constant;
+    uint16_t true_constant;
+    uint16_t false_constant;
+} translator;
+
+static int emit(translator* t, uint16_t op, uint16_t a, uint16_t b, uint16_t c)
+{
+    reg_chunk* code = t->code;
+    if (code->capacity < code->count + 1) {
+        code->capacity = code->capacity < 8 ? 8 : code->capacity * 2;
+        code->code = (reg_instruction*)realloc(code->code, sizeof(reg_instruction) * code->capacity);
+        code->origins = (int*)realloc(code->origins, sizeof(int) * code->capacity);
+    }
+
+    code->code[code->count] = (reg_instruction){op, a, b, c};
+    code->origins[code->count] = t->origin;
+    t->last_write = -1;
+    return code->count++;
+}
+
+static uint16_t add_register_constant(reg_chunk* code, value val)
+{
+    value_array* constants = &code->constants;
+    if (constants->capacity < constants->count + 1) {
+        constants->capacity = constants->capacity < 8 ? 8 : constants->capacity * 2;
+        constants->values = (value*)realloc(constants->values, sizeof(value) * constants->capacity);
+    }
+
+    constants->values[constants->count] = val;
+    return RK_CONSTANT | constants->count++;
+}
+
+/* Move a symbolic slot into its home register */
+static void materialize(translator* t, int slot)
+{
+    if (t->slots[slot] == slot)
+        return;
+
+    emit(t, REG_MOVE, slot, t->slots[slot], 0);
+    t->slots[slot] = slot;
+}
+
+static void flush(translator* t)
+{
+    for (int slot = 0; slot < t->depth; slot++)
+        materialize(t, slot);
+}
+
+/* Register reg is about to be overwritten; anything still reading it lazily
+ * has to be copied out first. Returns whether anything was. */
+static bool spill_readers(translator* t, int reg, int except)
+{
+    bool spilled = false;
+    for (int slot = 0; slot < t->depth; slot++) {
+        if (slot != except && slot != reg && t->slots[slot] == reg) {
+            materialize(t, slot);
+            spilled = true;
+        }
+    }
+    return spilled;
+}
+
+static void push_home(translator* t, int instruction)
+{
+    t->slots[t->depth] = t->depth;
+    t->depth++;
+    t->last_write = instruction;
+}
+
+static void binary_op(translator* t, uint16_t op)
+{
+    uint16_t b = t->slots[t->depth - 2];
+    uint16_t c = t->slots[t->depth - 1];
+    t->depth -= 2;
+    push_home(t, emit(t, op, t->depth, b, c));
+}
+
+static void unary_op(translator* t, uint16_t op)
+{
+    uint16_t b = t->slots[--t->depth];
+    push_home(t, emit(t, op, t->depth, b, 0));
+}
+
+static void set_local(translator* t, int local)
+{
+    int top = t->depth - 1;
+    uint16_t val = t->slots[top];
+    bool hazard = spill_readers(t, local, top);
+
+    /* Retarget the instruction that just computed the value */
+    if (!hazard && val == top && t->last_write == t->code->count - 1
+            && t->code->code[t->last_write].a == top) {
+        t->code->code[t->last_write].a = local;
+        t->slots[top] = local;
+    } else if (val != local) {
+        emit(t, REG_MOVE, local, val, 0);
+    }
+
+    if (local != top && local < t->depth)
+        t->slots[local] = local;
+}
+
+reg_chunk* compile_registers(chunk* source)
+{
+    reg_chunk* code = (reg_chunk*)calloc(1, sizeof(reg_chunk));
+    for (int i = 0; i < source->constants.count; i++)
+        add_register_constant(code, source->constants.values[i]);
+
+    translator t = {0};
+    t.source = source;
+    t.code = code;
+    t.slots = (uint16_t*)malloc(sizeof(uint16_t) * (source->max_stack + 1));
+    t.last_write = -1;
+    t.nil_constant = add_register_constant(code, NIL_VAL);
+    t.true_constant = add_register_constant(code, BOOL_VAL(true));
+    t.false_constant = add_register_constant(code, BOOL_VAL(false));
+
+    /* Find jump targets and the stack depth on arrival */
+    bool* is_target = (bool*)calloc(source->count + 1, sizeof(bool));
+    int* target_depth = (int*)malloc(sizeof(int) * (source->count + 1));
+    int* mapped = (int*)malloc(sizeof(int) * (source->count + 1));
+    int* jump_targets = (int*)malloc(sizeof(int) * (source->count + 1));
+
+    for (int offset = 0; offset <= source->count; offset++)
+        target_depth[offset] = -1;
+
+    for (int offset = 0; offset < source->count;) {
+        uint8_t op = source->code[offset];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            int jump = (source->code[offset + 1] << 8) | source->code[offset + 2];
+            is_target[offset + 3 + (op == OP_LOOP ? -jump : jump)] = true;
+        }
+        offset += 1 + operand_length[op];
+    }
+
+    bool reachable = true;
+    for (int offset = 0; offset < source->count;) {
+        uint8_t* ip = &source->code[offset];
+        t.origin = offset;
+
+        if (is_target[offset]) {
+            /* Code after an unconditional jump is entered from a jump. If
+             * that jump comes later (a loop increment), the depth carries
+             * over from the jump just before, as it did during emission. */
+            if (reachable)
+                flush(&t);
+            else if (target_depth[offset] != -1)
+                t.depth = target_depth[offset];
+            for (int slot = 0; slot < t.depth; slot++)
+                t.slots[slot] = slot;
+            t.last_write = -1;
+            reachable = true;
+        }
+        mapped[offset] = code->count;
+
+        switch (*ip) {
+            case OP_CONSTANT:
+                t.slots[t.depth++] = RK_CONSTANT | ip[1];
+                offset += 2;
+                break;
+            case OP_NIL:
+                t.slots[t.depth++] = t.nil_constant;
+                offset += 1;
+                break;
+            case OP_TRUE:
+                t.slots[t.depth++] = t.true_constant;
+                offset += 1;
+                break;
+            case OP_FALSE:
+                t.slots[t.depth++] = t.false_constant;
+                offset += 1;
+                break;
+            case OP_POP:
+                t.depth--;
+                t.last_write = -1;
+                offset += 1;
+                break;
+            case OP_GET_LOCAL:
+                /* Slots above the stack hold -O temporaries, always at home */
+                if (ip[1] < t.depth)
+                    materialize(&t, ip[1]);
+                t.slots[t.depth++] = ip[1];
+                t.last_write = -1;
+                offset += 2;
+                break;
+            case OP_SET_LOCAL:
+                set_local(&t, ip[1]);
+                offset += 2;
+                break;
+            case OP_GET_GLOBAL:
+                push_home(&t, emit(&t, REG_GET_GLOBAL, t.depth, ip[1], (ip[2] << 8) | ip[3]));
+                offset += 4;
+                break;
+            case OP_DEFINE_GLOBAL:
+                emit(&t, REG_DEFINE_GLOBAL, t.slots[--t.depth], ip[1], 0);
+                offset += 2;
+                break;
+            case OP_SET_GLOBAL:
+                emit(&t, REG_SET_GLOBAL, t.slots[t.depth - 1], ip[1], (ip[2] << 8) | ip[3]);
+                offset += 4;
+                break;
+            case OP_EQUAL: binary_op(&t, REG_EQUAL); offset += 1; break;
+            case OP_GREATER: binary_op(&t, REG_GREATER); offset += 1; break;
+            case OP_LESS: binary_op(&t, REG_LESS); offset += 1; break;
+            case OP_ADD: binary_op(&t, REG_ADD); offset += 1; break;
+            case OP_SUBTRACT: binary_op(&t, REG_SUBTRACT); offset += 1; break;
+            case OP_MULTIPLY: binary_op(&t, REG_MULTIPLY); offset += 1; break;
+            case OP_DIVIDE: binary_op(&t, REG_DIVIDE); offset += 1; break;
+            case OP_NOT: unary_op(&t, REG_NOT); offset += 1; break;
+            case OP_NEGATE: unary_op(&t, REG_NEGATE); offset += 1; break;
+            case OP_PRINT:
+                emit(&t, REG_PRINT, t.slots[--t.depth], 0, 0);
+                offset += 1;
+                break;
+            case OP_JUMP: {
+                int target = offset + 3 + ((ip[1] << 8) | ip[2]);
+                flush(&t);
+                target_depth[target] = t.depth;
+                jump_targets[emit(&t, REG_JUMP, 0, 0, 0)] = target;
+                reachable = false;
+                offset += 3;
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                int target = offset + 3 + ((ip[1] << 8) | ip[2]);
+                int condition = t.slots[t.depth - 1];
+                /* Both successors usually pop the condition straight away,
+                 * in which case it never needs a home */
+                if (source->code[offset + 3] == OP_POP && source->code[target] == OP_POP)
+                    t.slots[t.depth - 1] = t.depth - 1;
+                flush(&t);
+                target_depth[target] = t.depth;
+                jump_targets[emit(&t, REG_JUMP_IF_FALSE, condition, 0, 0)] = target;
+                offset += 3;
+                break;
+            }
+            case OP_LOOP: {
+                int target = offset + 3 - ((ip[1] << 8) | ip[2]);
+                flush(&t);
+                int loop = emit(&t, REG_LOOP, 0, 0, 0);
+                code->code[loop].b = loop + 1 - mapped[target];
+                reachable = false;
+                offset += 3;
+                break;
+            }
+            case OP_CALL: {
+                int arg_count = ip[1];
+                flush(&t);
+                t.depth -= arg_count + 1;
+                emit(&t, REG_CALL, t.depth, arg_count, 0);
+                t.slots[t.depth] = t.depth;
+                t.depth++;
+                offset += 2;
+                break;
+            }
+            case OP_ARRAY: {
+                int count = ip[1];
+                flush(&t);
+                t.depth -= count;
+                push_home(&t, emit(&t, REG_ARRAY, t.depth, count, 0));
+                offset += 2;
+                break;
+            }
+            case OP_GET_INDEX: binary_op(&t, REG_GET_INDEX); offset += 1; break;
+            case OP_SET_INDEX:
+                flush(&t);
+                t.depth -= 3;
+                push_home(&t, emit(&t, REG_SET_INDEX, t.depth, 0, 0));
+                offset += 1;
+                break;
+            case OP_MAP: {
+                int pair_count = ip[1];
+                flush(&t);
+                t.depth -= 2 * pair_count;
+                push_home(&t, emit(&t, REG_MAP, t.depth, pair_count, 0));
+                offset += 2;
+                break;
+            }
+            case OP_DELETE_INDEX: binary_op(&t, REG_DELETE_INDEX); offset += 1; break;
+            case OP_YIELD:
+                emit(&t, REG_YIELD, 0, 0, 0);
+                offset += 1;
+                break;
+            case OP_RETURN:
+                emit(&t, REG_RETURN, 0, 0, 0);
+                reachable = false;
+                offset += 1;
+                break;
+        }
+    }
+
+    /* Resolve forward jumps now that every target has a register offset */
+    for (int i = 0; i < code->count; i++) {
+        uint16_t op = code->code[i].op;
+        if (op == REG_JUMP || op == REG_JUMP_IF_FALSE)
+            code->code[i].b = mapped[jump_targets[i]] - (i + 1);
+    }
+
+    free(t.slots);
+    free(is_target);
+    free(target_depth);
+    free(mapped);
+    free(jump_targets);
+    return code;
+}
+
+void free_reg_chunk(reg_chunk* code)
+{
+    free(code->code);
+    free(code->origins);
+    free(code->constants.values);
+    free(code);
+}
+
+/* REGISTER DEBUGGER OPERATIONS */
+static void print_operand(FILE* out, uint16_t operand)
+{
+    if (operand & RK_CONSTANT)
+        fprintf(out, " k%-3d", operand & ~RK_CONSTANT);
+    else
+        fprintf(out, " r%-3d", operand);
+}
+
+void disassemble_registers(FILE* out, reg_chunk* code, const char* name)
+{
+    static const char* names[] = {
+        [REG_MOVE] = "REG_MOVE", [REG_GET_GLOBAL] = "REG_GET_GLOBAL",
+        [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL", [REG_SET_GLOBAL] = "REG_SET_GLOBAL",
+        [REG_EQUAL] = "REG_EQUAL", [REG_GREATER] = "REG_GREATER", [REG_LESS] = "REG_LESS",
+        [REG_ADD] = "REG_ADD", [REG_SUBTRACT] = "REG_SUBTRACT",
+        [REG_MULTIPLY] = "REG_MULTIPLY", [REG_DIVIDE] = "REG_DIVIDE",
+        [REG_NOT] = "REG_NOT", [REG_NEGATE] = "REG_NEGATE", [REG_PRINT] = "REG_PRINT",
+        [REG_JUMP] = "REG_JUMP", [REG_JUMP_IF_FALSE] = "REG_JUMP_IF_FALSE",
+        [REG_LOOP] = "REG_LOOP", [REG_CALL] = "REG_CALL", [REG_ARRAY] = "REG_ARRAY",
+        [REG_GET_INDEX] = "REG_GET_INDEX", [REG_SET_INDEX] = "REG_SET_INDEX",
+        [REG_MAP] = "REG_MAP", [REG_DELETE_INDEX] = "REG_DELETE_INDEX",
+        [REG_YIELD] = "REG_YIELD", [REG_RETURN] = "REG_RETURN",
+    };
+
+    fprintf(out, "== %s ==\n", name);
+    for (int i = 0; i < code->count; i++) {
+        reg_instruction* ins = &code->code[i];
+        fprintf(out, "%04d %-18s", i, names[ins->op]);
+        switch (ins->op) {
+            case REG_MOVE: case REG_NOT: case REG_NEGATE:
+                print_operand(out, ins->a); print_operand(out, ins->b);
+                break;
+            case REG_GET_GLOBAL:
+                fprintf(out, " r%-3d k%-3d", ins->a, ins->b);
+                break;
+            case REG_DEFINE_GLOBAL: case REG_SET_GLOBAL:
+                print_operand(out, ins->a); fprintf(out, " k%-3d", ins->b);
+                break;
+            case REG_PRINT:
+                print_operand(out, ins->a);
+                break;
+            case REG_JUMP:
+                fprintf(out, " -> %d", i + 1 + ins->b);
+                break;
+            case REG_JUMP_IF_FALSE:
+                print_operand(out, ins->a); fprintf(out, " -> %d", i + 1 + ins->b);
+                break;
+            case REG_LOOP:
+                fprintf(out, " -> %d", i + 1 - ins->b);
+                break;
+            case REG_CALL: case REG_ARRAY: case REG_MAP:
+                fprintf(out, " r%-3d %d", ins->a, ins->b);
+                break;
+            case REG_SET_INDEX:
+                fprintf(out, " r%-3d", ins->a);
+                break;
+            case REG_YIELD:
+            case REG_RETURN:
+                break;
+            default:
+                print_operand(out, ins->a); print_operand(out, ins->b); print_operand(out, ins->c);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/* REGISTER VIRTUAL MACHINE */
+static inline bool is_falsey(value val) { return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val)); }
+
+interpret_result run_registers(VM* vm, reg_chunk* code, int start)
+{
+    if (!ensure_stack(vm, vm->chunk->max_stack))
+        return out_of_memory(vm);
+
+    value* registers = vm->stack;
+    value* constants = code->constants.values;
+    reg_instruction* ip = code->code + start;
+    int64_t integer;
+
+#define RK(operand) ((operand) & RK_CONSTANT ? constants[(operand) & ~RK_CONSTANT] : registers[operand])
+/* Point vm->ip inside the originating stack instruction so errors report its line */
+#define SYNC_IP() (vm->ip = vm->chunk->code + code->origins[ip - 1 - code->code] + 1)
+#define NUMERIC_OPERANDS(b, c) \
+    if (!IS_NUMERIC(b) || !IS_NUMERIC(c)) { \
+        SYNC_IP(); \
+        return runtime_error(vm, "Operands must be numbers"); \
+    }
+/* As run(): out of fuel, stop in front of this instruction for resume_chunk() */
+#define CONSUME_FUEL() \
+    if (--vm->fuel < 0) { \
+        SYNC_IP(); \
+        vm->suspended_at = (int)(ins - code->code); \
+        return INTERPRET_YIELD; \
+    }
+/* Two integers take the overflow-checked path, two doubles the direct one */
+#define ARITHMETIC(op, checked, operator) \
+    if (IS_INT(b) && IS_INT(c) && !checked(AS_INT(b), AS_INT(c), &integer)) \
+        registers[ins->a] = INT_VAL(integer); \
+    else if (IS_NUMBER(b) && IS_NUMBER(c)) \
+        registers[ins->a] = NUMBER_VAL(AS_NUMBER(b) operator AS_NUMBER(c)); \
+    else \
+        registers[ins->a] = number_arithmetic(op, b, c);
+
+    while (1) {
+        reg_instruction* ins = ip++;
+        switch (ins->op) {
+            case REG_MOVE:
+                registers[ins->a] = RK(ins->b);
+                break;
+            case REG_GET_GLOBAL: {
+                global_cache* cache = &vm->chunk->caches[ins->c];
+                if (cache->version == vm->globals.version) {
+                    registers[ins->a] = vm->globals.entries[cache->index].value;
+                    break;
+                }
+
+                obj_string* name = AS_STRING(constants[ins->b]);
+                entry* global = table_lookup(&vm->globals, name);
+                if (!global) {
+                    SYNC_IP();
+                    return runtime_error(vm, "Undefined variable '%s'", name->chars);
+                }
+
+                cache->version = vm->globals.version;
+                cache->index = (int)(global - vm->globals.entries);
+                registers[ins->a] = global->value;
+                break;
+            }
+            case REG_DEFINE_GLOBAL:
+                define_global(vm, AS_STRING(constants[ins->b]), RK(ins->a));
+                break;
+            case REG_SET_GLOBAL: {
+                global_cache* cache = &vm->chunk->caches[ins->c];
+                if (cache->version == vm->globals.version) {
+                    vm->globals.entries[cache->index].value = RK(ins->a);
+                    break;
+                }
+
+                obj_string* name = AS_STRING(constants[ins->b]);
+                entry* global = table_lookup(&vm->globals, name);
+                if (!global) {
+                    SYNC_IP();
+                    return runtime_error(vm, "Undefined variable '%s'", name->chars);
+                }
+
+                cache->version = vm->globals.version;
+                cache->index = (int)(global - vm->globals.entries);
+                global->value = RK(ins->a);
+                break;
+            }
+            case REG_EQUAL:
+                registers[ins->a] = BOOL_VAL(values_equal(RK(ins->b), RK(ins->c)));
+                break;
+            case REG_GREATER: {
+                value b = RK(ins->b), c = RK(ins->c);
+                NUMERIC_OPERANDS(b, c);
+                registers[ins->a] = BOOL_VAL(number_less(c, b));
+                break;
+            }
+            case REG_LESS: {
+                value b = RK(ins->b), c = RK(ins->c);
+                NUMERIC_OPERANDS(b, c);
+                registers[ins->a] = BOOL_VAL(number_less(b, c));
+                break;
+            }
+            case REG_ADD: {
+                value b = RK(ins->b), c = RK(ins->c);
+                if (IS_NUMERIC(b) && IS_NUMERIC(c)) {
+                    ARITHMETIC(OP_ADD, __builtin_add_overflow, +);
+                } else if (IS_STRING(b) && IS_STRING(c)) {
+                    obj_string* result = concatenate_strings(vm, AS_STRING(b), AS_STRING(c));
+                    if (!result) {
+                        SYNC_IP();
+                        return out_of_memory(vm);
+                    }
+                    registers[ins->a] = OBJ_VAL(result);
+                } else {
+                    SYNC_IP();
+                    return runtime_error(vm, "Operands must be two numbers or two strings\n");
+                }
+                break;
+            }
+            case REG_SUBTRACT: {
+                value b = RK(ins->b), c = RK(ins->c);
+                NUMERIC_OPERANDS(b, c);
+                ARITHMETIC(OP_SUBTRACT, __builtin_sub_overflow, -);
+                break;
+            }
+            case REG_MULTIPLY: {
+                value b = RK(ins->b), c = RK(ins->c);
+                NUMERIC_OPERANDS(b, c);
+                ARITHMETIC(OP_MULTIPLY, __builtin_mul_overflow, *);
+                break;
+            }
+            case REG_DIVIDE: {
+                value b = RK(ins->b), c = RK(ins->c);
+                NUMERIC_OPERANDS(b, c);
+                registers[ins->a] = number_arithmetic(OP_DIVIDE, b, c);
+                break;
+            }
+            case REG_NOT:
+                registers[ins->a] = BOOL_VAL(is_falsey(RK(ins->b)));
+                break;
+            case REG_NEGATE: {
+                value b = RK(ins->b);
+                if (!IS_NUMERIC(b)) {
+                    SYNC_IP();
+                    return runtime_error(vm, "Operand must be a number");
+                }
+                registers[ins->a] = number_negate(b);
+                break;
+            }
+            case REG_PRINT:
+                print_value(vm->out, RK(ins->a));
+                fprintf(vm->out, "\n");
+                break;
+            case REG_JUMP:
+                ip += ins->b;
+                break;
+            case REG_JUMP_IF_FALSE:
+                if (is_falsey(RK(ins->a)))
+                    ip += ins->b;
+                break;
+            case REG_LOOP:
+                CONSUME_FUEL();
+                ip -= ins->b;
+                break;
+            case REG_CALL: {
+                CONSUME_FUEL();
+                value callee = registers[ins->a];
+                SYNC_IP();
+                if (!IS_NATIVE(callee))
+                    return runtime_error(vm, "Can only call functions");
+
+                obj_native* native = AS_NATIVE(callee);
+                if (native->arity != -1 && native->arity != ins->b)
+                    return runtime_error(vm, "Expected %d arguments but got %d", native->arity, ins->b);
+
+                if (!native->function(vm, ins->b, &registers[ins->a + 1], &registers[ins->a]))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            }
+            case REG_ARRAY:
+                SYNC_IP();
+                if (!make_array(vm, &registers[ins->a], ins->b, &registers[ins->a]))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            case REG_GET_INDEX:
+                SYNC_IP();
+                if (!get_index(vm, RK(ins->b), RK(ins->c), &registers[ins->a]))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            case REG_SET_INDEX:
+                SYNC_IP();
+                if (!set_index(vm, registers[ins->a], registers[ins->a + 1], registers[ins->a + 2]))
+                    return INTERPRET_RUNTIME_ERROR;
+                registers[ins->a] = registers[ins->a + 2];
+                break;
+            case REG_MAP:
+                SYNC_IP();
+                if (!make_map(vm, &registers[ins->a], ins->b, &registers[ins->a]))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            case REG_DELETE_INDEX:
+                SYNC_IP();
+                if (!delete_index(vm, RK(ins->b), RK(ins->c), &registers[ins->a]))
+                    return INTERPRET_RUNTIME_ERROR;
+                break;
+            case REG_YIELD:
+                SYNC_IP();
+                vm->suspended_at = (int)(ip - code->code);
+                return INTERPRET_YIELD;
+            case REG_RETURN:
+                return INTERPRET_OK;
+        }
+    }
+
+#undef RK
+#undef SYNC_IP
+#undef NUMERIC_OPERANDS
+#undef ARITHMETIC
+#undef CONSUME_FUEL
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE /* accept4, MSG_CMSG_CLOEXEC */
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+
+/* COMPILE SERVER
+ *
+ * polity --serve <socket> keeps one VM alive and runs scripts for
+ * polity --client <socket> script.np, skipping process startup, init_vm()
+ * and, while the script is unchanged, compile().
+ *
+ * A request is a single SOCK_SEQPACKET message holding the script's
+ * absolute path, with the client's stdout and stderr attached as
+ * SCM_RIGHTS. The server points its own stdout and stderr at them while
+ * the script runs, so output and errors look exactly like a local run,
+ * then answers with the exit status the client should return.
+ *
+ * Compiled chunks stay in a small LRU cache keyed by path and mtime, and
+ * keep their quickened instructions and JIT code between runs. Between
+ * requests the VM is reset: globals go back to the builtins and every
+ * object the script allocated is freed. Strings interned by compile()
+ * outlive the request, since cached chunks refer to them. Scripts that
+ * import modules are compiled for every request, as the cache key does
+ * not cover the modules.
+ *
+ * Requests are served one at a time, so each runs on SERVE_FUEL; one that
+ * spends it all is stopped with a runtime error rather than holding up
+ * every client behind it. */
+
+#define SERVE_CACHE_SIZE 64
+#define SERVE_TIMEOUT 5 /* seconds a client has to send its request */
+#define SERVE_FUEL 1000000000 /* back edges and calls one request may run */
+
+typedef struct {
+    char* path;
+    struct timespec mtime;
+    off_t size;
+    chunk* chunk;
+    uint64_t last_used;
+} served_script;
+
+typedef struct {
+    polity_interpreter* interpreter;
+    table builtins; /* the globals a fresh VM starts with */
+    served_script scripts[SERVE_CACHE_SIZE];
+    uint64_t clock;
+} server;
+
+/* Find the cached chunk for path, compiling it on a miss or after the file
+ * changed. Returns the exit status for a script that cannot run. */
+static int lookup_script(server* s, const char* path, chunk** found, bool* cached)
+{
+    size_t length = strlen(path);
+    if (length < 3 || strcmp(&path[length - 3], ".np")) {
+        fprintf(stderr, "Must be file of type .np\n");
+        return 74;
+    }
+
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    served_script* slot = &s->scripts[0];
+    for (int i = 0; i < SERVE_CACHE_SIZE; i++) {
+        served_script* script = &s->scripts[i];
+        if (script->path && strcmp(script->path, path) == 0) {
+            slot = script;
+            if (script->mtime.tv_sec == info.st_mtim.tv_sec && script->mtime.tv_nsec == info.st_mtim.tv_nsec
+                    && script->size == info.st_size) {
+                script->last_used = ++s->clock;
+#ifdef DEBUG
+                disassemble_chunk(stdout, script->chunk, "code");
+#endif
+                *found = script->chunk;
+                *cached = true;
+                return 0;
+            }
+            break;
+        }
+        if (slot->path && (!script->path || script->last_used < slot->last_used))
+            slot = script;
+    }
+
+    /* Miss: evict whatever held the slot, then compile */
+    if (slot->path) {
+        free(slot->path);
+        free_chunk(s->interpreter->vm, slot->chunk);
+        slot->path = NULL;
+    }
+
+    char* source = read_file(path);
+    if (!source) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    polity_interpreter* interpreter = s->interpreter;
+    interpreter->path = path;
+    interpreter->chunk = (chunk*)calloc(1, sizeof(chunk));
+    bool compiled = compile(source, interpreter);
+    free(source);
+    if (!compiled) {
+        free_chunk(interpreter->vm, interpreter->chunk);
+        printf("Compile error\n");
+        return 65;
+    }
+
+    /* The mtime of the script says nothing about the modules it imports */
+    *found = interpreter->chunk;
+    *cached = interpreter->import_count == 0;
+    if (!*cached)
+        return 0;
+
+    slot->path = strdup(path);
+    slot->mtime = info.st_mtim;
+    slot->size = info.st_size;
+    slot->chunk = interpreter->chunk;
+    slot->last_used = ++s->clock;
+    return 0;
+}
+
+static int run_request(server* s, const char* path)
+{
+    chunk* script = NULL;
+    bool cached = false;
+    int status = lookup_script(s, path, &script, &cached);
+    if (!script)
+        return status;
+
+    /* Run in slices of --fuel, or of the whole allowance, counting what
+     * each slice burned; yield; statements hand back the rest of theirs */
+    VM* vm = s->interpreter->vm;
+    struct obj* mark = vm->objects;
+    int64_t budget = vm->budget;
+    vm->budget = budget > 0 && budget < SERVE_FUEL ? budget : SERVE_FUEL;
+    int64_t spent = 0;
+    interpret_result result = run_chunk(vm, script);
+    while (result == INTERPRET_YIELD) {
+        spent += vm->budget - (vm->fuel > 0 ? vm->fuel : 0);
+        if (spent >= SERVE_FUEL) {
+            result = runtime_error(vm, "Script ran out of fuel after %lld back edges and calls", (long long)spent);
+            break;
+        }
+        result = resume_chunk(vm);
+    }
+    vm->budget = budget;
+    if (!cached)
+        free_chunk(vm, script);
+    reset_vm(vm, mark, &s->builtins);
+
+    if (result == INTERPRET_RUNTIME_ERROR) {
+        printf("Runtime error\n");
+        return 70;
+    }
+    return 0;
+}
+
+static void serve_connection(server* s, int connection)
+{
+    char path[PATH_MAX + 1];
+    struct iovec data = {path, PATH_MAX};
+    union {
+        struct cmsghdr header;
+        char bytes[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.bytes;
+    message.msg_controllen = sizeof(control.bytes);
+
+    ssize_t length = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    if (length <= 0)
+        return;
+    path[length] = '\0';
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        return;
+    int descriptors = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int output[2] = {-1, -1};
+    memcpy(output, CMSG_DATA(header), sizeof(int) * (descriptors < 2 ? descriptors : 2));
+
+    int status = 74;
+    if (descriptors == 2 && (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) == 0) {
+        fflush(stdout);
+        fflush(stderr);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int saved_stderr = dup(STDERR_FILENO);
+        dup2(output[0], STDOUT_FILENO);
+        dup2(output[1], STDERR_FILENO);
+
+        status = run_request(s, path);
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+    }
+    for (int i = 0; i < descriptors && i < 2; i++)
+        close(output[i]);
+
+    int32_t reply = status;
+    send(connection, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+/* Run the compile server on socket_path until it fails. Returns the
+ * process exit status. */
+int serve(polity_interpreter* interpreter, const char* socket_path)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+        return 64;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(socket_path); /* left behind by a server that was killed */
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+            || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", socket_path, strerror(errno));
+        return 71;
+    }
+
+    /* Scripts may write to pipes their reader closed; that must not end the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    server* s = (server*)calloc(1, sizeof(server));
+    s->interpreter = interpreter;
+    table* globals = &interpreter->vm->globals;
+    for (int i = 0; i < globals->capacity; i++)
+        if (globals->entries[i].key)
+            table_set(interpreter->vm, &s->builtins, globals->entries[i].key, globals->entries[i].value);
+
+    for (;;) {
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Could not accept on \"%s\": %s\n", socket_path, strerror(errno));
+            break;
+        }
+        /* Connections are served one at a time, so a client that connects
+         * and sends nothing must not hold up the ones behind it */
+        struct timeval timeout = {SERVE_TIMEOUT, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_connection(s, connection);
+        close(connection);
+    }
+
+    for (int i = 0; i < SERVE_CACHE_SIZE; i++) {
+        if (s->scripts[i].path) {
+            free(s->scripts[i].path);
+            free_chunk(interpreter->vm, s->scripts[i].chunk);
+        }
+    }
+    free_table(interpreter->vm, &s->builtins);
+    free(s);
+    close(listener);
+    unlink(socket_path);
+    return 71;
+}
+
+/* Ask the server on socket_path to run script_path with this process's
+ * stdout and stderr. Returns the exit status the script finished with. */
+int run_client(const char* socket_path, const char* script_path)
+{
+    char path[PATH_MAX];
+    if (!realpath(script_path, path)) {
+        fprintf(stderr, "Could not open file \"%s\".\n", script_path);
+        return 74;
+    }
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+        return 64;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int connection = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Could not connect to \"%s\": %s\n", socket_path, strerror(errno));
+        return 69;
+    }
+
+    int output[2] = {STDOUT_FILENO, STDERR_FILENO};
+    union {
+        struct cmsghdr header;
+        char bytes[CMSG_SPACE(sizeof(output))];
+    } control = {0};
+    struct iovec data = {path, strlen(path)};
+    struct msghdr message = {0};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.bytes;
+    message.msg_controllen = sizeof(control.bytes);
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(output));
+    memcpy(CMSG_DATA(header), output, sizeof(output));
+
+    int32_t status;
+    if (sendmsg(connection, &message, MSG_NOSIGNAL) < 0
+            || recv(connection, &status, sizeof(status), 0) != sizeof(status)) {
+        fprintf(stderr, "Server on \"%s\" did not answer.\n", socket_path);
+        close(connection);
+        return 70;
+    }
+
+    close(connection);
+    return status;
+}